@@ -0,0 +1,449 @@
+/*
+ * Artwork cache shared by all cliap2 processes
+ *
+ * Music Assistant starts a cliap2 per room, and each of them used to fetch
+ * the same artwork. Fetched artwork is now stored in a cache directory, one
+ * file per URL, named after murmur_hash64() of the URL. Entries are written
+ * to a temporary file and renamed into place, so readers only ever see
+ * complete files, and are memory mapped when read. A hit updates the mtime of
+ * the entry, and after each store the oldest entries are removed until the
+ * cache is below its size limit. Whoever holds the lock on the .lock file of
+ * the directory does the eviction, other processes skip it.
+ *
+ * Hits and misses are counted on the stats page (STATS_ARTWORK_HITS/MISSES).
+ *
+ * Cached images go to the ffmpeg decoders, so the directory must be private:
+ * it defaults to one below $XDG_CACHE_HOME (or ~/.cache, or $XDG_RUNTIME_DIR),
+ * and is only used if it is owned by us and not writable by anyone else.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+
+#include <event2/buffer.h>
+
+#include "artcache.h"
+#include "artwork.h"
+#include "logger.h"
+#include "misc.h"
+#include "stats.h"
+
+#define ARTCACHE_SUFFIX     ".art"
+#define ARTCACHE_TMPSUFFIX  ".tmp"
+#define ARTCACHE_LOCKFILE   ".lock"
+#define ARTCACHE_SUBDIR     "cliap2-artwork"
+#define ARTCACHE_IOV_MAX    16
+#define ARTCACHE_TMP_STALE_SEC 60 // Left behind by a session that died while storing
+
+struct artcache_entry
+{
+  char name[32];
+  off_t size;
+  time_t mtime;
+};
+
+// Not freed on deinit, as the worker thread may still be using it
+static char artcache_dir[PATH_MAX];
+static size_t artcache_max_bytes;
+static atomic_bool artcache_enabled;
+
+static void
+entry_path(char *path, size_t path_size, const char *url)
+{
+  uint64_t hash;
+
+  hash = murmur_hash64(url, strlen(url), 0);
+  snprintf(path, path_size, "%s/%016" PRIx64 ARTCACHE_SUFFIX, artcache_dir, hash);
+}
+
+// The format is not stored, it is recognised from the image itself
+static int
+format_detect(const uint8_t *data, size_t len)
+{
+  if (len >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+    return ART_FMT_JPEG;
+  if (len >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+    return ART_FMT_PNG;
+
+  return ART_E_NONE;
+}
+
+static void
+unmap_cb(const void *data, size_t datalen, void *extra)
+{
+  munmap((void *)data, datalen);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+  const struct artcache_entry *ea = a;
+  const struct artcache_entry *eb = b;
+
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/**
+ * Remove the least recently used entries until the cache is below its limit
+ */
+static void
+evict(void)
+{
+  struct artcache_entry *entries = NULL;
+  struct artcache_entry *tmp;
+  struct dirent *de;
+  struct stat sb;
+  char path[PATH_MAX];
+  size_t nentries = 0;
+  size_t alloced = 0;
+  size_t len;
+  size_t i;
+  off_t total = 0;
+  time_t now;
+  DIR *dir;
+  int lockfd;
+
+  snprintf(path, sizeof(path), "%s/" ARTCACHE_LOCKFILE, artcache_dir);
+  lockfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (lockfd < 0)
+    return;
+
+  // Someone else is already evicting
+  if (flock(lockfd, LOCK_EX | LOCK_NB) < 0)
+    goto out;
+
+  dir = opendir(artcache_dir);
+  if (!dir)
+    goto out;
+
+  now = time(NULL);
+
+  while ((de = readdir(dir)))
+    {
+      len = strlen(de->d_name);
+      if (len > strlen(ARTCACHE_TMPSUFFIX) && strcmp(de->d_name + len - strlen(ARTCACHE_TMPSUFFIX), ARTCACHE_TMPSUFFIX) == 0)
+	{
+	  if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && now - sb.st_mtime > ARTCACHE_TMP_STALE_SEC)
+	    unlinkat(dirfd(dir), de->d_name, 0);
+	  continue;
+	}
+
+      if (len <= strlen(ARTCACHE_SUFFIX) || len >= sizeof(entries[0].name) || strcmp(de->d_name + len - strlen(ARTCACHE_SUFFIX), ARTCACHE_SUFFIX) != 0)
+	continue;
+
+      if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+	continue;
+
+      if (nentries == alloced)
+	{
+	  alloced = alloced ? alloced * 2 : 64;
+	  tmp = realloc(entries, alloced * sizeof(struct artcache_entry));
+	  if (!tmp)
+	    break;
+	  entries = tmp;
+	}
+
+      strcpy(entries[nentries].name, de->d_name);
+      entries[nentries].size = sb.st_size;
+      entries[nentries].mtime = sb.st_mtime;
+      total += sb.st_size;
+      nentries++;
+    }
+
+  if (total > (off_t)artcache_max_bytes)
+    {
+      qsort(entries, nentries, sizeof(struct artcache_entry), entry_cmp);
+      for (i = 0; i < nentries && total > (off_t)artcache_max_bytes; i++)
+	{
+	  if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+	    total -= entries[i].size;
+	}
+
+      DPRINTF(E_DBG, L_ART, "Evicted %zu entries from artwork cache '%s'\n", i, artcache_dir);
+    }
+
+  closedir(dir);
+  free(entries);
+
+ out:
+  close(lockfd); // Also releases the lock
+}
+
+/**
+ * Look up artwork in the cache
+ * @param url  the artwork URL
+ * @param raw  [out] the image, added by reference to the mapped entry
+ * @returns ART_FMT_* on a hit, ART_E_NONE on a miss or if the cache is disabled
+ */
+int
+artcache_get(const char *url, struct evbuffer *raw)
+{
+  char path[PATH_MAX];
+  struct stat sb;
+  void *data;
+  int format;
+  int fd;
+
+  if (!atomic_load(&artcache_enabled))
+    return ART_E_NONE;
+
+  entry_path(path, sizeof(path), url);
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    goto miss;
+
+  if (fstat(fd, &sb) < 0 || sb.st_size == 0)
+    goto miss_close;
+
+  data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    goto miss_close;
+
+  format = format_detect(data, sb.st_size);
+  if (format <= 0 || evbuffer_add_reference(raw, data, sb.st_size, unmap_cb, NULL) < 0)
+    {
+      munmap(data, sb.st_size);
+      goto miss_close;
+    }
+
+  // Mark as recently used for the eviction
+  futimens(fd, NULL);
+  close(fd);
+
+  stats_add(STATS_ARTWORK_HITS, 1);
+  DPRINTF(E_SPAM, L_ART, "Artwork cache hit for '%s' (%s)\n", url, path);
+
+  return format;
+
+ miss_close:
+  close(fd);
+ miss:
+  stats_add(STATS_ARTWORK_MISSES, 1);
+  return ART_E_NONE;
+}
+
+/**
+ * Store artwork in the cache. raw is not modified.
+ * @param url     the artwork URL
+ * @param raw     the image
+ * @param format  ART_FMT_* of the image
+ * @returns 0 on success, -1 on failure or if the cache is disabled
+ */
+int
+artcache_put(const char *url, struct evbuffer *raw, int format)
+{
+  struct evbuffer_iovec v[ARTCACHE_IOV_MAX];
+  struct evbuffer_ptr ptr;
+  char path[PATH_MAX];
+  char tmppath[PATH_MAX];
+  size_t len;
+  ssize_t written;
+  int n;
+  int fd;
+
+  if (!atomic_load(&artcache_enabled) || format <= 0)
+    return -1;
+
+  len = evbuffer_get_length(raw);
+  if (len == 0 || len > artcache_max_bytes)
+    return -1;
+
+  entry_path(path, sizeof(path), url);
+  snprintf(tmppath, sizeof(tmppath), "%s.%d" ARTCACHE_TMPSUFFIX, path, (int)getpid());
+
+  // Never follow or reuse what is there, a leftover of ours is removed first
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == EEXIST && unlink(tmppath) == 0)
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      DPRINTF(E_WARN, L_ART, "Could not create artwork cache entry '%s': %s\n", tmppath, strerror(errno));
+      return -1;
+    }
+
+  // Write straight from the evbuffer, without draining it
+  evbuffer_ptr_set(raw, &ptr, 0, EVBUFFER_PTR_SET);
+  while (len > 0)
+    {
+      n = evbuffer_peek(raw, len, &ptr, v, ARTCACHE_IOV_MAX);
+      if (n <= 0)
+	goto error;
+      if (n > ARTCACHE_IOV_MAX)
+	n = ARTCACHE_IOV_MAX;
+
+      written = writev(fd, v, n);
+      if (written < 0 && errno == EINTR)
+	continue;
+      if (written <= 0)
+	goto error;
+
+      len -= written;
+      evbuffer_ptr_set(raw, &ptr, written, EVBUFFER_PTR_ADD);
+    }
+
+  if (close(fd) < 0)
+    {
+      fd = -1;
+      goto error;
+    }
+
+  // Atomic, readers see either the old entry, or the complete new one
+  if (rename(tmppath, path) < 0)
+    {
+      DPRINTF(E_WARN, L_ART, "Could not store artwork cache entry '%s': %s\n", path, strerror(errno));
+      unlink(tmppath);
+      return -1;
+    }
+
+  evict();
+
+  return 0;
+
+ error:
+  DPRINTF(E_WARN, L_ART, "Could not write artwork cache entry '%s': %s\n", tmppath, strerror(errno));
+  if (fd >= 0)
+    close(fd);
+  unlink(tmppath);
+  return -1;
+}
+
+/**
+ * Default cache directory of the user, created if needed
+ * @returns 0 on success, -1 if there is no suitable base directory
+ */
+static int
+default_dir(char *dir, size_t dir_size)
+{
+  const char *base;
+  char cache[PATH_MAX];
+
+  base = getenv("XDG_CACHE_HOME");
+  if (!base || base[0] != '/')
+    {
+      base = getenv("HOME");
+      if (base && base[0] == '/')
+	{
+	  snprintf(cache, sizeof(cache), "%s/.cache", base);
+	  if (mkdir(cache, 0700) < 0 && errno != EEXIST)
+	    base = NULL;
+	  else
+	    base = cache;
+	}
+      else
+	base = getenv("XDG_RUNTIME_DIR");
+    }
+
+  if (!base || base[0] != '/')
+    return -1;
+
+  if (snprintf(dir, dir_size, "%s/" ARTCACHE_SUBDIR, base) >= (int)dir_size)
+    return -1;
+
+  return 0;
+}
+
+/**
+ * Check that nobody else can put files in the cache directory
+ */
+static int
+dir_is_private(const char *dir)
+{
+  struct stat sb;
+
+  if (lstat(dir, &sb) < 0)
+    {
+      DPRINTF(E_WARN, L_ART, "Could not stat artwork cache directory '%s': %s\n", dir, strerror(errno));
+      return 0;
+    }
+
+  if (!S_ISDIR(sb.st_mode) || sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+      DPRINTF(E_LOG, L_ART, "Not using artwork cache directory '%s', it must be a directory owned by uid %d and writable only by it\n",
+	dir, (int)geteuid());
+      return 0;
+    }
+
+  return 1;
+}
+
+/**
+ * Enable the cache
+ * @param dir        the cache directory, created if it doesn't exist. NULL for
+ *                   the default of the user, see default_dir().
+ * @param max_bytes  size limit of the cache, 0 to disable it
+ * @returns 0 on success, -1 on failure. Failure is not fatal, artwork is then
+ *          always fetched.
+ */
+int
+artcache_init(const char *dir, size_t max_bytes)
+{
+  char path[PATH_MAX];
+
+  if (max_bytes == 0)
+    return 0;
+
+  if (!dir)
+    {
+      if (default_dir(path, sizeof(path)) < 0)
+	{
+	  DPRINTF(E_INFO, L_ART, "No cache directory for artwork, set artwork_cache_dir to enable the artwork cache\n");
+	  return -1;
+	}
+      dir = path;
+    }
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    {
+      DPRINTF(E_WARN, L_ART, "Could not create artwork cache directory '%s': %s\n", dir, strerror(errno));
+      return -1;
+    }
+
+  if (!dir_is_private(dir))
+    return -1;
+
+  if (strlen(dir) >= sizeof(artcache_dir) - 32)
+    return -1;
+
+  strcpy(artcache_dir, dir);
+  artcache_max_bytes = max_bytes;
+  atomic_store(&artcache_enabled, true);
+
+  DPRINTF(E_DBG, L_ART, "Artwork cache in '%s', limit %zu bytes\n", artcache_dir, artcache_max_bytes);
+
+  return 0;
+}
+
+void
+artcache_deinit(void)
+{
+  atomic_store(&artcache_enabled, false);
+}
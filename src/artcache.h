@@ -0,0 +1,19 @@
+#ifndef __ARTCACHE_H__
+#define __ARTCACHE_H__
+
+#include <stddef.h>
+#include <event2/buffer.h>
+
+int
+artcache_init(const char *dir, size_t max_bytes);
+
+void
+artcache_deinit(void);
+
+int
+artcache_get(const char *url, struct evbuffer *raw);
+
+int
+artcache_put(const char *url, struct evbuffer *raw, int format);
+
+#endif /* !__ARTCACHE_H__ */
@@ -0,0 +1,306 @@
+/*
+ * Downscaling of artwork for the output module
+ *
+ * Music Assistant usually hands us artwork of 1500-3000 pixels, while AirPlay
+ * devices display a few hundred at most. The output module asks for artwork of
+ * a maximum size (ART_DEFAULT_WIDTH/HEIGHT), so images that are larger are
+ * decoded, scaled to fit with the aspect ratio kept, and encoded again in
+ * their original format. JPEG is the common case and the one that matters for
+ * the RTSP payload, PNG keeps its alpha channel.
+ *
+ * This is called from the thread that prepares metadata for the outputs,
+ * never from the player or mass_cmd threads. Results are cached per size by
+ * the caller, see artwork_get_by_queue_item_id().
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "artscale.h"
+#include "artwork.h"
+#include "logger.h"
+#include "wrappers.h"
+
+// Quantizer for the JPEG encoder, 2 (best) to 31. Artwork is shown small, so
+// this is well above what can be seen on a device.
+#define ARTSCALE_JPEG_QSCALE 3
+// Largest image that is decoded, in pixels. The artwork comes from the
+// network, and a small file can declare a huge size, which the decoder would
+// allocate frames for. Well above the 3000x3000 that Music Assistant sends.
+#define ARTSCALE_MAX_PIXELS  (4096 * 4096)
+
+static void
+packet_free_cb(const void *data, size_t datalen, void *extra)
+{
+  AVPacket *pkt = extra;
+
+  av_packet_free(&pkt);
+}
+
+/**
+ * Fit src_w x src_h inside max_w x max_h, keeping the aspect ratio
+ * @returns 0 if the image must be scaled, -1 if it already fits
+ */
+static int
+size_calculate(int *dst_w, int *dst_h, int src_w, int src_h, int max_w, int max_h)
+{
+  if (max_w <= 0)
+    max_w = src_w;
+  if (max_h <= 0)
+    max_h = src_h;
+
+  if (src_w <= max_w && src_h <= max_h)
+    return -1;
+
+  if ((int64_t)src_w * max_h > (int64_t)src_h * max_w)
+    {
+      *dst_w = max_w;
+      *dst_h = (int)((int64_t)src_h * max_w / src_w);
+    }
+  else
+    {
+      *dst_h = max_h;
+      *dst_w = (int)((int64_t)src_w * max_h / src_h);
+    }
+
+  if (*dst_w < 1)
+    *dst_w = 1;
+  if (*dst_h < 1)
+    *dst_h = 1;
+
+  return 0;
+}
+
+static AVFrame *
+image_decode(struct evbuffer *in, enum AVCodecID codec_id)
+{
+  const AVCodec *codec;
+  AVCodecContext *ctx = NULL;
+  AVPacket *pkt = NULL;
+  AVFrame *frame = NULL;
+  size_t len;
+  int ret;
+
+  len = evbuffer_get_length(in);
+  if (len == 0 || len > INT32_MAX)
+    return NULL;
+
+  codec = avcodec_find_decoder(codec_id);
+  if (!codec)
+    return NULL;
+
+  ctx = avcodec_alloc_context3(codec);
+  pkt = av_packet_alloc();
+  frame = av_frame_alloc();
+  if (!ctx || !pkt || !frame)
+    goto error;
+
+  ctx->max_pixels = ARTSCALE_MAX_PIXELS;
+
+  if (avcodec_open2(ctx, codec, NULL) < 0)
+    goto error;
+
+  // The decoder wants padding after the data, so this is the one copy made
+  if (av_new_packet(pkt, (int)len) < 0)
+    goto error;
+  evbuffer_copyout(in, pkt->data, len);
+
+  ret = avcodec_send_packet(ctx, pkt);
+  if (ret < 0)
+    goto error;
+  avcodec_send_packet(ctx, NULL);
+
+  ret = avcodec_receive_frame(ctx, frame);
+  if (ret < 0)
+    goto error;
+
+  av_packet_free(&pkt);
+  avcodec_free_context(&ctx);
+  return frame;
+
+ error:
+  av_frame_free(&frame);
+  av_packet_free(&pkt);
+  avcodec_free_context(&ctx);
+  return NULL;
+}
+
+static AVFrame *
+image_scale(AVFrame *src, int dst_w, int dst_h, enum AVPixelFormat dst_fmt)
+{
+  struct SwsContext *sws;
+  AVFrame *dst;
+
+  dst = av_frame_alloc();
+  if (!dst)
+    return NULL;
+
+  dst->width = dst_w;
+  dst->height = dst_h;
+  dst->format = dst_fmt;
+  if (av_frame_get_buffer(dst, 0) < 0)
+    goto error;
+
+  sws = sws_getContext(src->width, src->height, src->format, dst_w, dst_h, dst_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+  if (!sws)
+    goto error;
+
+  sws_scale(sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+  sws_freeContext(sws);
+
+  return dst;
+
+ error:
+  av_frame_free(&dst);
+  return NULL;
+}
+
+static AVPacket *
+image_encode(AVFrame *frame, enum AVCodecID codec_id)
+{
+  const AVCodec *codec;
+  AVCodecContext *ctx;
+  AVPacket *pkt = NULL;
+
+  codec = avcodec_find_encoder(codec_id);
+  if (!codec)
+    return NULL;
+
+  ctx = avcodec_alloc_context3(codec);
+  if (!ctx)
+    return NULL;
+
+  ctx->width = frame->width;
+  ctx->height = frame->height;
+  ctx->pix_fmt = frame->format;
+  ctx->time_base = (AVRational){ 1, 1 };
+
+  if (codec_id == AV_CODEC_ID_MJPEG)
+    {
+      ctx->flags |= AV_CODEC_FLAG_QSCALE;
+      ctx->global_quality = FF_QP2LAMBDA * ARTSCALE_JPEG_QSCALE;
+      frame->quality = ctx->global_quality;
+    }
+
+  if (avcodec_open2(ctx, codec, NULL) < 0)
+    goto out;
+
+  pkt = av_packet_alloc();
+  if (!pkt)
+    goto out;
+
+  if (avcodec_send_frame(ctx, frame) < 0 || avcodec_send_frame(ctx, NULL) < 0 || avcodec_receive_packet(ctx, pkt) < 0)
+    av_packet_free(&pkt);
+
+ out:
+  avcodec_free_context(&ctx);
+  return pkt;
+}
+
+/**
+ * Scale an image to fit a maximum size
+ * @param out     [out] the scaled image, which references the encoder's packet
+ * @param in      the image, not modified
+ * @param format  ART_FMT_* of the image, the scaled image has the same format
+ * @param max_w   maximum width, 0 for no limit
+ * @param max_h   maximum height, 0 for no limit
+ * @returns ART_FMT_* of out on success, ART_E_NONE if the image should be used
+ *          as it is, since it already fits or scaling would not make it
+ *          smaller, ART_E_ERROR on failure
+ */
+int
+artscale_scale(struct evbuffer *out, struct evbuffer *in, int format, int max_w, int max_h)
+{
+  const AVPixFmtDescriptor *desc;
+  enum AVPixelFormat dst_fmt;
+  enum AVCodecID codec_id;
+  AVFrame *src = NULL;
+  AVFrame *dst = NULL;
+  AVPacket *pkt = NULL;
+  int dst_w;
+  int dst_h;
+  int ret;
+
+  if (format == ART_FMT_JPEG)
+    codec_id = AV_CODEC_ID_MJPEG;
+  else if (format == ART_FMT_PNG)
+    codec_id = AV_CODEC_ID_PNG;
+  else
+    return ART_E_NONE;
+
+  src = image_decode(in, codec_id);
+  if (!src)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not decode artwork for scaling\n");
+      return ART_E_ERROR;
+    }
+
+  if (size_calculate(&dst_w, &dst_h, src->width, src->height, max_w, max_h) < 0)
+    {
+      ret = ART_E_NONE;
+      goto out;
+    }
+
+  if (codec_id == AV_CODEC_ID_MJPEG)
+    dst_fmt = AV_PIX_FMT_YUVJ420P;
+  else
+    {
+      desc = av_pix_fmt_desc_get(src->format);
+      dst_fmt = (desc && (desc->flags & AV_PIX_FMT_FLAG_ALPHA)) ? AV_PIX_FMT_RGBA : AV_PIX_FMT_RGB24;
+    }
+
+  ret = ART_E_ERROR;
+
+  dst = image_scale(src, dst_w, dst_h, dst_fmt);
+  if (!dst)
+    goto out;
+
+  pkt = image_encode(dst, codec_id);
+  if (!pkt)
+    goto out;
+
+  if ((size_t)pkt->size >= evbuffer_get_length(in))
+    {
+      ret = ART_E_NONE;
+      goto out;
+    }
+
+  DPRINTF(E_DBG, L_ART, "Scaled artwork from %dx%d (%zu bytes) to %dx%d (%d bytes)\n",
+    src->width, src->height, evbuffer_get_length(in), dst_w, dst_h, pkt->size);
+
+  // The packet is freed once out and everything referencing it are done with it
+  if (evbuffer_add_reference(out, pkt->data, pkt->size, packet_free_cb, pkt) < 0)
+    goto out;
+  pkt = NULL;
+
+  ret = format;
+
+ out:
+  if (ret == ART_E_ERROR)
+    DPRINTF(E_LOG, L_ART, "Could not scale artwork to %dx%d\n", max_w, max_h);
+
+  av_packet_free(&pkt);
+  av_frame_free(&dst);
+  av_frame_free(&src);
+  return ret;
+}
@@ -0,0 +1,9 @@
+#ifndef __ARTSCALE_H__
+#define __ARTSCALE_H__
+
+#include <event2/buffer.h>
+
+int
+artscale_scale(struct evbuffer *out, struct evbuffer *in, int format, int max_w, int max_h);
+
+#endif /* !__ARTSCALE_H__ */
@@ -30,163 +30,25 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <signal.h>
-#include <limits.h>
-#include <grp.h>
 #include <stdint.h>
 #include <inttypes.h>
-
-#ifdef HAVE_SIGNALFD
-# include <sys/signalfd.h>
-#else
-# include <sys/time.h>
-# include <sys/event.h>
-#endif
-
 #include <getopt.h>
-#include <event2/event.h>
-#include <event2/thread.h>
-#include <libavutil/avutil.h>
-#include <libavutil/log.h>
-#include <libavformat/avformat.h>
-#include <libavfilter/avfilter.h>
-#include <curl/curl.h>
-
-#include <pthread.h>
-#include <gcrypt.h>
-
-#include "conffile.h"
-#include "library.h"
-#include "logger.h"
-#include "misc.h"
-#include "player.h"
-#include "worker.h"
-#include "outputs/rtp_common.h"
-#include "wrappers.h"
-#include "cliap2.h"
-#include "mass.h"
-
-#define AIRPLAY2_CONNECT_TIME_MS (int32_t) 2500 // Minimum time we need to connect and buffer before starting playback
-
-/*
- * Below explanation is from libraop raop_client.h
- *
- * RAOP players have a latency which is usually 11025 frames.
- *
- * The precise time at the DAC is the time at the client plus the latency, so when
- * setting a start time, we must anticipate by the latency if we want the first
- * frame to be *exactly* played at that NTP value.
- * 
- * For Music Assistant, we will simply subtract 250ms (11025 frames at 44100 sample rate)
- * This approach may need to change when we implement higher quality streams
- */
-#define DAC_LATENCY_TS {0, 250e6}
-
-struct event_base *evbase_main;
-static struct event *sig_event;
-static int main_exit;
-ap2_device_info_t ap2_device_info;
-mass_named_pipes_t mass_named_pipes = {"-", 0}; // force stdin only for audio input
-
-static inline void
-timespec_to_ntp(struct timespec *ts, struct ntp_timestamp *ns)
-{
-  /* Seconds since NTP Epoch (1900-01-01) */
-  ns->sec = ts->tv_sec + NTP_EPOCH_DELTA;
-
-  // tv_nsec is a long (ie 64-bit). frac is a uint32_t (32-bit). By definition, we will lose granularity upon conversion
-  ns->frac = (uint32_t)((double)ts->tv_nsec * 1e-9 * FRAC);
-}
-
-static inline void
-ntp_to_timespec(struct ntp_timestamp *ns, struct timespec *ts)
-{
-  // Seconds since Unix Epoch (1970-01-01)
-  ts->tv_sec = ns->sec - NTP_EPOCH_DELTA;
-
-  ts->tv_nsec = (long)((double)ns->frac / (1e-9 * FRAC));
-}
-
-static inline int
-timing_get_clock_ntp(struct ntp_timestamp *ns)
-{
-  struct timespec ts;
-  int ret;
-
-  ret = clock_gettime(CLOCK_REALTIME, &ts); // Music Assistant CLOCK_ID basis
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_AIRPLAY, "Couldn't get clock: %s\n", strerror(errno));
-
-      return -1;
-    }
-
-  timespec_to_ntp(&ts, ns);
+#include <signal.h>
 
-  return 0;
-}
+#include "misc.h"
+#include "libcliap2.h"
+#include "zygote.h"
 
 static void
 ntptime(void)
 {
-  struct ntp_timestamp ns = {0, 0};
   uint64_t t;
 
-  timing_get_clock_ntp(&ns);
-  t = ((uint64_t)ns.sec << 32) | ns.frac;
+  cliap2_ntp_now(&t);
 
   printf("%" PRIu64 "\n", t);
 }
 
-/**
- * Subtract t2 from t1
- * @param result  t1 less t2
- * @param t1      base timespec to be subracted from
- * @param t2      timespec amount to subtract from t1
- */
-static void 
-timespec_subtract(struct timespec *result, const struct timespec *t1, const struct timespec *t2) {
-    if (t1->tv_nsec < t2->tv_nsec) {
-        // Nanoseconds of t1 are less than t2, so we need to "borrow" a second
-        result->tv_sec = t1->tv_sec - t2->tv_sec - 1;
-        result->tv_nsec = 1000000000 + t1->tv_nsec - t2->tv_nsec;
-    } else {
-        result->tv_sec = t1->tv_sec - t2->tv_sec;
-        result->tv_nsec = t1->tv_nsec - t2->tv_nsec;
-    }
-}
-
-/**
- * Determine the timespec delta between the CLOCK_ID's used by Music Assistant (CLOCK_REALTIME) and OwnTone (CLOCK_MONOTONIC) codebase
- * @param ns  Pointer to the timespec delta to be returned.
- * @returns 0 on success, -1 on failure
- */
-static int
-ts_delta(struct timespec *delta)
-{
-  struct timespec ot_now; // OwnTone time basis of now
-  struct timespec ma_now; // Music Assistant time basis of now
-  int ret;
-
-  ret = clock_gettime(CLOCK_MONOTONIC, &ot_now);
-  if (ret < 0) {
-    DPRINTF(E_LOG, L_MAIN, "%s: Unable to obtain current time in OwnTone time basis. %s\n", __func__, strerror(errno));
-    return -1;
-  }
-  ret = clock_gettime(CLOCK_REALTIME, &ma_now);
-  if (ret < 0) {
-    DPRINTF(E_LOG, L_MAIN, "%s: Unable to obtain current time in Music Assistant time basis. %s\n", __func__, strerror(errno));
-    return -1;
-  }
-  timespec_subtract(delta, &ma_now, &ot_now);
-
-  return 0;
-}
-
 static void
 version(void)
 {
@@ -217,338 +79,38 @@ usage(char *program)
   printf("  --latency <latency>               ms of data to buffer in the output buffer. Defaults to 2000\n");
   printf("  --pairing_latency <ms>            Anticipated duration, in ms, of the time taken to pair with the AirPlay device and negotiate session. Defaults to 2500\n");
   printf("  --password <password>             Device password.\n");
+  printf("  --realtime                        Run audio threads with SCHED_FIFO priority, locked memory and PI mutexes. Falls back if not permitted.\n");
+  printf("  --server <socket>                 Initialize once, then fork a ready session for each request on Unix socket <socket>.\n");
+  printf("  --status_fd <fd>                  Write status events as JSON lines to file descriptor <fd>.\n");
   printf("  -v, --version                     Display version information and exit\n");
   printf("\n\n");
 }
 
 
-#ifdef HAVE_SIGNALFD
-static void
-signal_signalfd_cb(int fd, short event, void *arg)
-{
-  struct signalfd_siginfo info;
-  int status;
-
-  while (read(fd, &info, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
-    {
-      switch (info.ssi_signo)
-	{
-	  case SIGCHLD:
-	    DPRINTF(E_LOG, L_MAIN, "Got SIGCHLD\n");
-
-	    while (waitpid(-1, &status, WNOHANG) > 0)
-	      /* Nothing. */ ;
-	    break;
-
-	  case SIGINT:
-	  case SIGTERM:
-	    DPRINTF(E_LOG, L_MAIN, "Got SIGTERM or SIGINT\n");
-
-	    main_exit = 1;
-	    break;
-
-	  case SIGHUP:
-	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
-
-	    if (!main_exit)
-	      logger_reinit();
-	    break;
-	}
-    }
-
-  if (main_exit)
-    event_base_loopbreak(evbase_main);
-  else
-    event_add(sig_event, NULL);
-}
-
-#else
-
-static void
-signal_kqueue_cb(int fd, short event, void *arg)
-{
-  struct timespec ts;
-  struct kevent ke;
-  int status;
-
-  ts.tv_sec = 0;
-  ts.tv_nsec = 0;
-
-  while (kevent(fd, NULL, 0, &ke, 1, &ts) > 0)
-    {
-      switch (ke.ident)
-	{
-	  case SIGCHLD:
-	    DPRINTF(E_LOG, L_MAIN, "Got SIGCHLD\n");
-
-	    while (waitpid(-1, &status, WNOHANG) > 0)
-	      /* Nothing. */ ;
-	    break;
-
-	  case SIGINT:
-	  case SIGTERM:
-	    DPRINTF(E_LOG, L_MAIN, "Got SIGTERM or SIGINT\n");
-
-	    main_exit = 1;
-	    break;
-
-	  case SIGHUP:
-	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
-
-	    if (!main_exit)
-	      logger_reinit();
-	    break;
-	}
-    }
-
-  if (main_exit)
-    event_base_loopbreak(evbase_main);
-  else
-    event_add(sig_event, NULL);
-}
-#endif
-
-#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
-static int
-ffmpeg_lockmgr(void **pmutex, enum AVLockOp op)
-{
-  switch (op)
-    {
-      case AV_LOCK_CREATE:
-	*pmutex = malloc(sizeof(pthread_mutex_t));
-	if (!*pmutex)
-	  return 1;
-        CHECK_ERR(L_MAIN, mutex_init(*pmutex));
-	return 0;
-
-      case AV_LOCK_OBTAIN:
-        CHECK_ERR(L_MAIN, pthread_mutex_lock(*pmutex));
-	return 0;
-
-      case AV_LOCK_RELEASE:
-        CHECK_ERR(L_MAIN, pthread_mutex_unlock(*pmutex));
-	return 0;
-
-      case AV_LOCK_DESTROY:
-	CHECK_ERR(L_MAIN, pthread_mutex_destroy(*pmutex));
-	free(*pmutex);
-        *pmutex = NULL;
-
-	return 0;
-    }
-
-  return 1;
-}
-#endif
-
-// Parses a string of "key=value" "key=value" into a keyval struct
-static int
-parse_keyval(const char *str, struct keyval *kv)
-{
-  char *key;
-  char *value;
-  char *s;
-  char *outer_token, *inner_token;
-  char *outer_saveptr, *inner_saveptr;
-
-  s = (char *)str;
-  if (*s != '"') {
-    DPRINTF(E_FATAL, L_MAIN, "Keyval string must start with a double quote (\"), not with '%c':%d\n", *s, *s);
-    return -1;
-  }
-  s++; // Skip opening quote
-
-  // Tokenize the main string by double quotes
-  outer_token = strtok_r(s, "\"", &outer_saveptr);
-  while (outer_token != NULL) {
-    // For each keyval pair, tokenize by =
-    inner_token = strtok_r(outer_token, "=", &inner_saveptr);
-    for (int i=0; inner_token != NULL; i++) {
-      switch (i) {
-        case 0:
-          key = inner_token;
-          break;
-        case 1:
-          value = inner_token;
-          keyval_add(kv, key, value);
-          break;
-        default:
-          DPRINTF(E_FATAL, L_MAIN, "Keyval pair '%s' has too many '=' characters\n", outer_token);
-          return -1;        
-      }
-      inner_token = strtok_r(NULL, "=", &inner_saveptr);
-    }
-    outer_token = strtok_r(NULL, "\"", &outer_saveptr);
-    outer_token = strtok_r(NULL, "\"", &outer_saveptr);
-  }
-
-  return 0;
-}
-
-// Check for valid named pipe, creating it if it doesn't exist.
-// @param name the filename of the named pipe
-// @returns 0 on success, -1 on failure
-static
-int check_pipe(const char *pipe_path)
-{
-  struct stat st;
-
-  // Allow "-" to mean stdin
-  if (strcmp(pipe_path, "-") == 0) {
-      return 0;
-  }
-
-  // Check if the file exists and get its information
-  if (stat(pipe_path, &st) == 0) {
-      // File exists, now check if it's a FIFO (named pipe)
-      if (S_ISFIFO(st.st_mode)) {
-          DPRINTF(E_SPAM, L_MAIN, "%s:Using existing pipe '%s'\n", __func__, pipe_path);
-          return 0;
-      }
-      else {
-          DPRINTF(E_FATAL, L_MAIN, "%s:File '%s' exists, but it is not a named pipe.\n", __func__, pipe_path);
-          return -1;
-      }
-  }
-  else {
-      // File does not exist - create the pipe
-      if (errno == ENOENT) {
-          if (mkfifo(pipe_path, 0666) == 0) {
-              DPRINTF(E_SPAM, L_MAIN, "%s:Created pipe '%s'\n", __func__, pipe_path);
-              return 0;
-          }
-          DPRINTF(E_FATAL, L_MAIN, "%s:Failed to create pipe '%s': %s\n", __func__, pipe_path, strerror(errno));
-          return -1;
-      }
-      else {
-          DPRINTF(E_FATAL, L_MAIN, "%s:Error checking for named pipe %s. %s\n", __func__, pipe_path, strerror(errno));
-          return -1;
-      }
-  }
-
-  return 0;
-}
-
-/**
- * Obtain the output buffer duration in milliseconds
- * @returns   Output buffer duration in milliseconds
- * @note      Output buffer duration includes the inherent DAC latency of the output device. 
- *            This is typically 250ms or 11025 frames at 44100 sample rate 
- */
-uint64_t
-get_output_buffer_ms(void)
-{
-  return cfg_getint(cfg_getsec(cfg, "general"), "start_buffer_ms");
-}
-
-/**
- * Obtain the output buffer duration as a timespec
- * @param [out] ts  Pointer to a timespec structure where the output buffer duration will be returned
- * @returns   void
- * @note      Output buffer duration includes the inherent DAC latency of the output device. 
- *            This is typically 250ms or 11025 frames at 44100 sample rate 
- */
-void
-get_output_buffer_ts(struct timespec *ts)
+struct cli_options
 {
-  uint64_t buffer_duration_ms;
-
-  buffer_duration_ms = cfg_getint(cfg_getsec(cfg, "general"), "start_buffer_ms");
-
-  ts->tv_sec = (time_t)(buffer_duration_ms / 1000);
-  ts->tv_nsec = (long)((buffer_duration_ms % 1000) * 1000 * 1000);
-
-  return;
-}
+  char *configfile;
+  int loglevel;
+  char *logfile;
+  const char *server_path;
+  struct cliap2_params params;
+};
 
 /**
- * Determine a valid playback start time given a specified NTP start time
- * @param ts        Pointer to a timespec structure where the start time will be returned
- * @param ntpstart  NTP start time encoded as uint64_t
- * @returns         0 on success, -1 on failure.
+ * Parse the command line options
+ * @param argc  argument count
+ * @param argv  argument vector
+ * @param opts  [out] parsed options
+ * @returns     0 to continue startup, 1 to exit successfully (e.g. --version),
+ *              -1 on invalid options
+ * @note        May be called again in a session forked by --server, with the
+ *              options of the session request
  */
 static int
-get_start_ts(struct timespec *ts, uint64_t ntpstart)
-{
-  struct ntp_timestamp start_ns;  // MA clock basis
-  struct timespec now_ts;         // OT clock basis
-  struct timespec start_ts;       // MA clock basis
-  struct timespec delta_ts;       // delta between MA and OT clock basis
-  struct timespec lag_ts;         // lag between now and start time
-  struct timespec latency_ts;     // output buffer duration, inclusive of DAC latency
-  int32_t lag_ms;                 // lag in milliseconds between now and start time
-  int32_t pairing_latency_ms = ap2_device_info.pairing_latency_ts.tv_sec + (ap2_device_info.pairing_latency_ts.tv_nsec / 1e6);
-  int ret;
-
-  ret = clock_gettime(CLOCK_MONOTONIC, &now_ts); // Use OwnTone time basis
-  if (ret != 0) {
-    DPRINTF(E_FATAL, L_MAIN, "Could not get current time: %s\n", strerror(errno));
-    return -1;
-  }
-  start_ns.sec = (uint32_t)(ntpstart >> 32);
-  start_ns.frac = (uint32_t)(ntpstart);
-
-  ntp_to_timespec(&start_ns, &start_ts);
-
-  // convert from Music Assistant time basis to OwnTone time basis
-    // delta_ts is the epoch difference CLOCK_REALTIME-CLOCK_MONOTONIC = uptime - 1/1/1970
-  ret = ts_delta(&delta_ts);
-  if (ret < 0) {
-    DPRINTF(E_FATAL, L_MAIN, "Unable to determine time basis delta\n");
-    return -1;
-  }
-  DPRINTF(E_SPAM, L_MAIN, "%s:%s:CLOCK_REALTIME - CLOCK_MONOTONIC = %ld.%09ld\n", 
-    __func__, ap2_device_info.name, delta_ts.tv_sec, delta_ts.tv_nsec
-  );
-  timespec_subtract(ts, &start_ts, &delta_ts); // ts will now be the requested start time, excluding latency, in OwnTone time basis
-  get_output_buffer_ts(&latency_ts);
-  timespec_subtract(ts, ts, &latency_ts);
-  timespec_to_ntp(ts, &start_ns);
-  timespec_subtract(&lag_ts, ts, &now_ts);
-  DPRINTF(E_INFO, L_MAIN, "%s:%s:Audio starts in %ld.%.9ld secs.\n", __func__, ap2_device_info.name, lag_ts.tv_sec, lag_ts.tv_nsec);
-
-  lag_ms = (int32_t)(lag_ts.tv_sec * 1000) + (int32_t)(lag_ts.tv_nsec / 1e6);
-  if (lag_ms < pairing_latency_ms) {
-    // Give ourselves enough time to get connected and build our buffer
-    int32_t extra_ms = pairing_latency_ms - lag_ms;
-    DPRINTF(E_WARN, L_MAIN, 
-      "%s:%s:ntpstart time too soon. Adjust pairing_latency to align with device capability or increase ntpstart by at least %" PRId32
-      " ms to prevent loss of audio.\n", __func__, ap2_device_info.name, extra_ms
-    );
-    return -1;
-  }
-  return 0;
-}
-
-int
-main(int argc, char **argv)
+options_parse(int argc, char **argv, struct cli_options *opts)
 {
   int option;
-  char *configfile = NULL; // default to no config file
-  int loglevel = -1;
-  char *logdomains = NULL;
-  char *logfile = NULL;
-  char *logformat = NULL;
-  const char *av_version;
-  const char *gcry_version;
-  sigset_t sigs;
-  int sigfd;
-#ifdef HAVE_KQUEUE
-  struct kevent ke_sigs[4];
-#endif
   int ret;
-  int port = -1;
-  const char *name = NULL;
-  const char *hostname = NULL;
-  const char *address = NULL;
-  const char *txt = NULL;
-
-  uint64_t ntpstart = 0;
-  int volume = 0;
-  uint64_t latency_ms = 0;
-  uint64_t pairing_ms = 0;
-  int64_t input_write_ms = 0;
-  struct keyval *txt_kv = NULL;
 
   struct option option_map[] = {
     { "loglevel",       1, NULL, 500 },
@@ -572,24 +134,20 @@ main(int argc, char **argv)
     { "password",       1, NULL, 518 },
     { "pairing_latency",1, NULL, 519 },
     { "input_write_ms", 1, NULL, 520 }, // Used to test/validate logic in mass.c play(). Not documented to user
+    { "realtime",       0, NULL, 521 },
+    { "server",         1, NULL, 522 },
+    { "status_fd",      1, NULL, 523 },
 
     { NULL,            0, NULL, 0   }
   };
 
-  // Default some values
-  ap2_device_info.auth_key = (char *)NULL;
-  ap2_device_info.password = (char *)NULL;
-  ap2_device_info.pairing_latency_ts.tv_sec = 2;
-  ap2_device_info.pairing_latency_ts.tv_nsec = 500e6;
-  ap2_device_info.input_write_ms = 15;
-
-  // Ensure stderr is unbuffered. Python defaults to bufferred IO for all streams
-  ret = setvbuf(stderr, NULL, _IONBF, 0);
-  if (ret < 0) {
-    fprintf(stderr, "Error: Unable to set stderr to unbuffered. %s\n", strerror(errno));
-    fflush(stderr);
-    return EXIT_FAILURE;
-  }
+  // Restart the scan, in case we are parsing session options after --server
+#if defined(__APPLE__) || defined(__FreeBSD__)
+  optreset = 1;
+  optind = 1;
+#else
+  optind = 0;
+#endif
 
   while ((option = getopt_long(argc, argv, "", option_map, NULL)) != -1) {
       switch (option) {
@@ -598,27 +156,27 @@ main(int argc, char **argv)
         if (ret < 0)
           fprintf(stderr, "Error: loglevel must be an integer in '--loglevel %s'\n", optarg);
         else
-          loglevel = option;
+          opts->loglevel = option;
         break;
 
       case 501: // logfile
-        logfile = optarg;
+        opts->logfile = optarg;
         break;
 
       case 502: //config
-        configfile = optarg;
+        opts->configfile = optarg;
         break;
 
       case 503: // name
-        name = optarg;
+        opts->params.name = optarg;
         break;
 
       case 504: // hostname
-        hostname = optarg;
+        opts->params.hostname = optarg;
         break;
 
       case 505:  // address
-        address = optarg;
+        opts->params.address = optarg;
         break;
 
       case 506: // port
@@ -626,21 +184,21 @@ main(int argc, char **argv)
         if (ret < 0)
           fprintf(stderr, "Error: port must be an integer in '--port %s'\n", optarg);
         else
-          port = option;
+          opts->params.port = option;
         break;
 
       case 507: // txt
-        txt = optarg;
+        opts->params.txt = optarg;
         break;
 
       case 508: // ntp
         // output ntp time to stdout and exit
         ntptime();
-        return EXIT_SUCCESS;
+        return 1;
 
       case 509:
         // ntpstart
-        ret = safe_atou64(optarg, (uint64_t *)&ntpstart);
+        ret = safe_atou64(optarg, &opts->params.ntpstart);
         if (ret < 0) {
           fprintf(stderr, "Error: ntpstart must be an unsigned 64-bit integer in '--ntpstart %s'\n", optarg);
           exit(EXIT_FAILURE);
@@ -648,7 +206,7 @@ main(int argc, char **argv)
         break;
       
       case 510: // volume
-        ret = safe_atoi32(optarg, &volume);
+        ret = safe_atoi32(optarg, &opts->params.volume);
         if (ret < 0) {
           fprintf(stderr, "Error: volume must be an integer in '--volume %s'\n", optarg);
           exit(EXIT_FAILURE);
@@ -657,332 +215,186 @@ main(int argc, char **argv)
 
       case 511: // version
         version();
-        return EXIT_SUCCESS;
+        return 1;
         break;
 
       case 512: // testrun
         fprintf(stdout, "%s check\n", PACKAGE);
-        return EXIT_SUCCESS;
+        return 1;
         break;
 
       case 513: // named pipe filename - now obsolete. We use stdin only
         break;
 
       case 514: // command/metadata named pipe filename
-        mass_named_pipes.metadata_pipe = optarg;
+        opts->params.command_pipe = optarg;
         break;
 
       case 515: // authorization key
-        ap2_device_info.auth_key = strdup(optarg);
+        opts->params.auth_key = optarg;
         break;
 
       case 516: // dacp_id - DACP ID for remote control callbacks
-        // Parse hex string to uint64 and set libhash
-        ret = safe_hextou64(optarg, &libhash);
-        if (ret < 0) {
-          fprintf(stderr, "Error: dacp_id must be a hex string in '--dacp_id %s'\n", optarg);
-          exit(EXIT_FAILURE);
-        }
-        DPRINTF(E_DBG, L_MAIN, "DACP ID set to: %" PRIX64 "\n", libhash);
+        opts->params.dacp_id = optarg;
         break;
       
       case 517: // latency in ms - not inclusive of DAC latency
-        ret = safe_atou64(optarg, &latency_ms);
+        ret = safe_atou64(optarg, &opts->params.latency_ms);
         if (ret < 0) {
           fprintf(stderr, "Error: latency must be an integer in '--latency %s'\n", optarg);
           exit(EXIT_FAILURE);
         }
-        latency_ms += 250; // Add the 250ms inherent latency of the device DAC
-        DPRINTF(E_DBG, L_MAIN, "Latency set to %" PRIu64 " ms inclusive of 250ms DAC latency\n", latency_ms);
+        opts->params.latency_ms += 250; // Add the 250ms inherent latency of the device DAC
         break;
 
       case 518: // device password
-        ap2_device_info.password = strdup(optarg);
+        opts->params.password = optarg;
         break;
       
       case 519: // pairing milliseconds
-        ret = safe_atou64(optarg, &pairing_ms);
+        ret = safe_atou64(optarg, &opts->params.pairing_latency_ms);
         if (ret < 0) {
           fprintf(stderr, "Error: value must be an integer in '--pairing_latency %s'\n", optarg);
           exit(EXIT_FAILURE);
         }
-        ap2_device_info.pairing_latency_ts.tv_sec = (time_t)(pairing_ms / 1000);
-        ap2_device_info.pairing_latency_ts.tv_nsec = (long)((pairing_ms % 1000) * 1e6);
         break;
       
       case 520: // input_write milliseconds
-        ret = safe_atoi64(optarg, &input_write_ms);
+        ret = safe_atoi64(optarg, &opts->params.input_write_ms);
         if (ret < 0) {
           fprintf(stderr, "Error: value must be an integer in '--input_write_ms %s'\n", optarg);
           exit(EXIT_FAILURE);
         }
-        ap2_device_info.input_write_ms = input_write_ms;
+        break;
+
+      case 521: // realtime scheduling of the audio threads
+        opts->params.realtime = true;
+        break;
+
+      case 522: // prefork session server
+        opts->server_path = optarg;
+        break;
+
+      case 523: // machine readable status events
+        ret = safe_atoi32(optarg, &opts->params.status_fd);
+        if (ret < 0 || opts->params.status_fd < 0) {
+          fprintf(stderr, "Error: status_fd must be a file descriptor number in '--status_fd %s'\n", optarg);
+          return -1;
+        }
         break;
         
       default:
       case '?':
         usage(argv[0]);
-        return EXIT_FAILURE;
+        return -1;
         break;
 	  }
   }
 
-  // Check that mandatory arguments have been supplied
-  if (port == -1 ||
-      name == (char *)NULL ||
-      hostname == (char *)NULL ||
-      address == (char*)NULL ||
-      txt == (char*)NULL ||
-      mass_named_pipes.metadata_pipe == (char*)NULL
-     ) {
-      usage(argv[0]);
-      return EXIT_FAILURE;
-  }
-  
-  ap2_device_info.name = name;
-  ap2_device_info.hostname = hostname;
-  ap2_device_info.address = address;
-  ap2_device_info.port = port;
-  ap2_device_info.volume = volume;
-  ap2_device_info.latency_ms = latency_ms;
-
-  ret = logger_init(NULL, NULL, (loglevel < 0) ? E_LOG : loglevel, NULL);
-  if (ret != 0) {
-    fprintf(stderr, "Could not initialize log facility\n");
-    return EXIT_FAILURE;
-  }
 
-  ret = conffile_load(configfile);
-  if (ret != 0) {
-    DPRINTF(E_FATAL, L_MAIN, "Config file errors; please fix your config\n");
-    logger_deinit();
-    return EXIT_FAILURE;
-  }
+  return 0;
+}
 
-  logger_deinit();
+/**
+ * Check that the mandatory session options have been supplied
+ */
+static bool
+options_session_valid(struct cli_options *opts)
+{
+  return !(opts->params.port == -1 ||
+           opts->params.name == (char *)NULL ||
+           opts->params.hostname == (char *)NULL ||
+           opts->params.address == (char*)NULL ||
+           opts->params.txt == (char*)NULL ||
+           opts->params.command_pipe == (char*)NULL
+          );
+}
 
-  /* Reinit log facility with configfile values */
-  if (loglevel < 0)
-    loglevel = cfg_getint(cfg_getsec(cfg, "general"), "loglevel");
-  if (!logformat)
-    logformat = cfg_getstr(cfg_getsec(cfg, "general"), "logformat");
+int
+main(int argc, char **argv)
+{
+  struct cli_options opts = { .loglevel = -1 };
+  struct cliap2_session *session;
+  sigset_t sigs;
+  int session_argc;
+  char **session_argv;
+  bool realtime;
+  int ret;
 
-  ret = logger_init(logfile, logdomains, loglevel, logformat);
-  if (ret != 0) {
-    fprintf(stderr, "Could not reinitialize log facility with config file settings\n");
-    conffile_unload();
-    return EXIT_FAILURE;
-  }
+  // SIGUSR1 asks for a trace dump, but would kill us until the session takes
+  // over signals. Blocked it stays pending until then. The --server process
+  // never takes it, so there it is effectively ignored.
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+  cliap2_params_init(&opts.params);
 
-  // Check that named pipe exists for metadata/commands
-  ret = check_pipe(mass_named_pipes.metadata_pipe);
+  // Ensure stderr is unbuffered. Python defaults to bufferred IO for all streams
+  ret = setvbuf(stderr, NULL, _IONBF, 0);
   if (ret < 0) {
+    fprintf(stderr, "Error: Unable to set stderr to unbuffered. %s\n", strerror(errno));
+    fflush(stderr);
     return EXIT_FAILURE;
   }
 
-  CHECK_NULL(L_MAIN, txt_kv = keyval_alloc());
-
-  ret = parse_keyval(txt, txt_kv);
-  if (ret != 0){
-    DPRINTF(E_FATAL, L_MAIN, 
-      "Error: txt keyvals must be in format \"key=value\" \"key=value\" format in '--txt %s'\n", 
-      txt);
-    goto txt_fail;
-  }
-  ap2_device_info.txt = txt_kv;
-
-  get_start_ts(&ap2_device_info.start_ts, ntpstart); // We no longer care about returned result
-
-  /* Set up libevent logging callback */
-  event_set_log_callback(logger_libevent);
-
-  DPRINTF(E_INFO, L_MAIN, "%s version %s taking off\n", PACKAGE, VERSION);
-
-#if HAVE_DECL_AV_VERSION_INFO
-  av_version = av_version_info();
-#else
-  av_version = "(unknown version)";
-#endif
-
-#ifdef HAVE_FFMPEG
-  DPRINTF(E_INFO, L_MAIN, "Initialized with ffmpeg %s\n", av_version);
-#else
-  DPRINTF(E_INFO, L_MAIN, "Initialized with libav %s\n", av_version);
-#endif
-
-// The following was deprecated with ffmpeg 4.0 = avcodec 58.18, avformat 58.12, avfilter 7.16
-#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
-  ret = av_lockmgr_register(ffmpeg_lockmgr);
-  if (ret < 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Could not register ffmpeg lock manager callback\n");
-
-      ret = EXIT_FAILURE;
-      goto ffmpeg_init_fail;
-    }
-#endif
-#if (LIBAVFORMAT_VERSION_MAJOR < 58) || ((LIBAVFORMAT_VERSION_MAJOR == 58) && (LIBAVFORMAT_VERSION_MINOR < 12))
-  av_register_all();
-#endif
-#if (LIBAVFILTER_VERSION_MAJOR < 7) || ((LIBAVFILTER_VERSION_MAJOR == 7) && (LIBAVFILTER_VERSION_MINOR < 16))
-  avfilter_register_all();
-#endif
-
-#if HAVE_DECL_AVFORMAT_NETWORK_INIT
-  avformat_network_init();
-#endif
-  av_log_set_callback(logger_ffmpeg);
-
-  /* Initialize libcurl */
-  curl_global_init(CURL_GLOBAL_DEFAULT);
-
-  gcry_version = gcry_check_version(GCRYPT_VERSION);
-  if (!gcry_version)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "libgcrypt version mismatch\n");
-
-      ret = EXIT_FAILURE;
-      goto gcrypt_init_fail;
-    }
-
-  /* We aren't handling anything sensitive, so give up on secure
-   * memory, which is a scarce system resource.
-   */
-  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
-
-  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
-
-  DPRINTF(E_DBG, L_MAIN, "Initialized with gcrypt %s\n", gcry_version);
-
-  /* Block signals for all threads except the main one */
-  sigemptyset(&sigs);
-  sigaddset(&sigs, SIGINT);
-  sigaddset(&sigs, SIGHUP);
-  sigaddset(&sigs, SIGCHLD);
-  sigaddset(&sigs, SIGTERM);
-  sigaddset(&sigs, SIGPIPE);
-  ret = pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  ret = options_parse(argc, argv, &opts);
   if (ret != 0)
-    {
-      DPRINTF(E_LOG, L_MAIN, "Error setting signal set\n");
-
-      ret = EXIT_FAILURE;
-      goto signal_block_fail;
-    }
-
-  /* Initialize event base (after forking) */
-  CHECK_NULL(L_MAIN, evbase_main = event_base_new());
-
-  CHECK_ERR(L_MAIN, evthread_use_pthreads());
-
+    return (ret > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-  /* Spawn worker thread */
-  ret = worker_init();
-  if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Worker thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto worker_fail;
-    }
+  // Check that mandatory arguments have been supplied. In server mode they
+  // come with each session request instead.
+  if (!opts.server_path && !options_session_valid(&opts)) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+  }
 
-  /* Spawn player thread */
-  ret = player_init();
+  // A server pays for all of the library initialisation up front, so that
+  // its forked sessions don't have to
+  ret = cliap2_init(opts.configfile, opts.loglevel, opts.logfile, (opts.server_path != NULL));
   if (ret != 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Player thread failed to start\n");
-
-      ret = EXIT_FAILURE;
-      goto player_fail;
-    }
-
-#ifdef HAVE_SIGNALFD
-  /* Set up signal fd */
-  sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
-  if (sigfd < 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Could not setup signalfd: %s\n", strerror(errno));
-
-      ret = EXIT_FAILURE;
-      goto signalfd_fail;
-    }
-
-  sig_event = event_new(evbase_main, sigfd, EV_READ, signal_signalfd_cb, NULL);
-#else
-  sigfd = kqueue();
-  if (sigfd < 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Could not setup kqueue: %s\n", strerror(errno));
-
-      ret = EXIT_FAILURE;
-      goto signalfd_fail;
-    }
+    return EXIT_FAILURE;
 
-  EV_SET(&ke_sigs[0], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-  EV_SET(&ke_sigs[1], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-  EV_SET(&ke_sigs[2], SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
-  EV_SET(&ke_sigs[3], SIGCHLD, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+  if (opts.server_path) {
+    /* Only the forked session children return from zygote_run() with 0 */
+    ret = zygote_run(opts.server_path, argv[0], &session_argc, &session_argv);
+    if (ret != 0)
+      {
+        ret = (ret > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        goto out;
+      }
 
-  ret = kevent(sigfd, ke_sigs, 4, NULL, 0, NULL);
-  if (ret < 0)
-    {
-      DPRINTF(E_FATAL, L_MAIN, "Could not register signal events: %s\n", strerror(errno));
+    realtime = opts.params.realtime;
+    opts = (struct cli_options){ .loglevel = opts.loglevel };
+    cliap2_params_init(&opts.params);
+    opts.params.realtime = realtime;
+
+    ret = options_parse(session_argc, session_argv, &opts);
+    if (ret != 0 || opts.server_path || !options_session_valid(&opts))
+      {
+        fprintf(stderr, "Invalid options in session request\n");
+        ret = EXIT_FAILURE;
+        goto out;
+      }
+  }
 
-      ret = EXIT_FAILURE;
-      goto signalfd_fail;
-    }
+  // PCM audio is always read from stdin
+  opts.params.audio_fd = STDIN_FILENO;
 
-  sig_event = event_new(evbase_main, sigfd, EV_READ, signal_kqueue_cb, NULL);
-#endif
-  if (!sig_event)
+  session = cliap2_session_new(&opts.params);
+  if (!session)
     {
-      DPRINTF(E_FATAL, L_MAIN, "Could not create signal event\n");
-
       ret = EXIT_FAILURE;
-      goto sig_event_fail;
+      goto out;
     }
 
-  event_add(sig_event, NULL);
-
-  /* Run the loop */
-  event_base_dispatch(evbase_main);
-
-  DPRINTF(E_INFO, L_MAIN, "Stopping gracefully\n");
-  ret = EXIT_SUCCESS;
-
-  event_free(sig_event);
-
- sig_event_fail:
- signalfd_fail:
-  DPRINTF(E_INFO, L_MAIN, "Player deinit\n");
-  player_deinit();
-
- player_fail:
-  DPRINTF(E_INFO, L_MAIN, "Worker deinit\n");
-  worker_deinit();
-
- worker_fail:
-  db_deinit();
-  event_base_free(evbase_main);
-
- signal_block_fail:
- gcrypt_init_fail:
-  curl_global_cleanup();
-#if HAVE_DECL_AVFORMAT_NETWORK_INIT
-  avformat_network_deinit();
-#endif
-
-#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
-  av_lockmgr_register(NULL);
- ffmpeg_init_fail:
-#endif
+  ret = cliap2_session_run(session);
+  ret = (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 
- txt_fail:
-  if (txt_kv) keyval_clear(txt_kv);
+  cliap2_session_free(session);
 
-  DPRINTF(E_INFO, L_MAIN, "Exiting.\n");
-  conffile_unload();
-  logger_deinit();
+ out:
+  cliap2_deinit();
 
   return ret;
 }
@@ -1,6 +1,8 @@
 #ifndef __CLIAP2_H__
 #define __CLIAP2_H__
 
+#include <stdbool.h>
+
 #define METADATA_NAMED_PIPE_DEFAULT_SUFFIX ".metadata"
 
 typedef struct ap2_device_info
@@ -10,6 +12,7 @@ typedef struct ap2_device_info
   const char *address;
   int port;
   struct keyval *txt;
+  bool wants_artwork; // false if the txt features show that the device doesn't display artwork
   char pin[5];
   char *auth_key;
   char *password; // unencryptd device password
@@ -32,5 +35,10 @@ typedef struct mass_named_pipes
 
 uint64_t get_output_buffer_ms(void);
 void get_output_buffer_ts(struct timespec *ts);
+void startup_phase_mark(const char *phase);
+void session_end(void);
+
+/* In the local logger.c */
+void logger_atfork_register(void);
 
 #endif /* !__CLIAP2_H__ */
\ No newline at end of file
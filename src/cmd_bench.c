@@ -0,0 +1,270 @@
+/*
+ * cliap2-cmd-bench - items per second of the command pipe tokenizer
+ *
+ * Usage: cliap2-cmd-bench [-n <items>]
+ *
+ *   -n  number of items to parse with each parser, default 2000000
+ *
+ * Feeds a typical mix of command pipe items (mostly PROGRESS and VOLUME, with
+ * a metadata batch now and then) through the in place tokenizer and gperf key
+ * lookup of mass_item.c, and through a copy of the parser it replaced, which
+ * copied every item out of the evbuffer, split it with two more mallocs and
+ * matched keys with a chain of prefix compares. Only finding, splitting and
+ * looking up the items is measured, not acting on their values.
+ *
+ * Not installed, build with "make cliap2-cmd-bench".
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+
+#include "mass_item.h"
+
+#define BENCH_ITEMS_DEFAULT 2000000
+// Items per evbuffer_add(), roughly what one read of the pipe brings in
+#define BENCH_ITEMS_PER_READ 64
+
+static const char *bench_items[] =
+{
+  "PROGRESS=61",
+  "VOLUME=42",
+  "PROGRESS=62",
+  "ACTION=BEGIN",
+  "TITLE=Shine On You Crazy Diamond (Parts I-V)",
+  "ARTIST=Pink Floyd",
+  "ALBUM=Wish You Were Here",
+  "DURATION=811",
+  "ARTWORK=http://192.168.1.10:8097/imageproxy?path=abcdef0123456789&size=500",
+  "ACTION=COMMIT",
+  "PROGRESS=63",
+  "VOLUME=43",
+  "PROGRESS=64",
+  "ACTION=PLAY",
+  "PROGRESS=65",
+  "VOLUME=44",
+};
+
+// The keys, in the order the replaced parser compared them
+static const char *legacy_keys[] =
+{
+  "ALBUM", "ARTIST", "TITLE", "DURATION", "PROGRESS", "ARTWORK", "VOLUME", "PIN", "ACTION",
+};
+
+static double
+sec_since(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/* ------------------------- The replaced parser ---------------------------- */
+
+static char *
+legacy_extract_item(struct evbuffer *evbuf)
+{
+  struct evbuffer_ptr evptr;
+  size_t size;
+  char *item;
+
+  evptr = evbuffer_search(evbuf, "\n", strlen("\n"), NULL);
+  if (evptr.pos < 0)
+    return NULL;
+
+  size = evptr.pos + strlen("\n") + 1;
+  item = malloc(size);
+  if (!item)
+    return NULL;
+
+  evbuffer_remove(evbuf, item, size - 1);
+  item[size - 2] = '\0';
+
+  return item;
+}
+
+static void
+legacy_extract_key_value(const char *input_string, char **key, char **value)
+{
+  char *delimiter_pos = strchr(input_string, '=');
+  size_t key_len;
+
+  *key = NULL;
+  *value = NULL;
+  if (!delimiter_pos)
+    return;
+
+  key_len = delimiter_pos - input_string;
+  *key = malloc(key_len + 1);
+  *value = strdup(delimiter_pos + 1);
+  if (!*key || !*value)
+    {
+      free(*key);
+      free(*value);
+      *key = NULL;
+      *value = NULL;
+      return;
+    }
+
+  memcpy(*key, input_string, key_len);
+  (*key)[key_len] = '\0';
+}
+
+static int
+legacy_parse(struct evbuffer *evbuf)
+{
+  char *item;
+  char *key;
+  char *value;
+  int n = 0;
+  int i;
+
+  while ((item = legacy_extract_item(evbuf)))
+    {
+      legacy_extract_key_value(item, &key, &value);
+      free(item);
+      if (!key)
+	continue;
+
+      for (i = 0; i < (int)(sizeof(legacy_keys) / sizeof(legacy_keys[0])); i++)
+	{
+	  if (strncmp(key, legacy_keys[i], strlen(legacy_keys[i])) == 0)
+	    {
+	      n++;
+	      break;
+	    }
+	}
+
+      free(key);
+      free(value);
+    }
+
+  return n;
+}
+
+/* ------------------------------ mass_item.c ------------------------------- */
+
+static int
+inplace_parse(struct evbuffer *evbuf)
+{
+  enum mass_key key;
+  const char *sep;
+  char *item;
+  size_t len;
+  int n = 0;
+
+  while ((item = mass_item_next(evbuf, &len)))
+    {
+      sep = memchr(item, MASS_ITEM_KEYVAL_SEP, len);
+      if (sep && mass_item_key(&key, item, sep - item) == 0)
+	n++;
+
+      evbuffer_drain(evbuf, len + 1);
+    }
+
+  return n;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int
+bench_run(const char *name, int (*parse)(struct evbuffer *evbuf), char *reads[], int nreads, int items)
+{
+  struct evbuffer *evbuf;
+  struct timespec start;
+  double sec;
+  int parsed = 0;
+  int i;
+
+  evbuf = evbuffer_new();
+  if (!evbuf)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; parsed < items; i = (i + 1) % nreads)
+    {
+      // Copied in, like evbuffer_read() does with the pipe
+      evbuffer_add(evbuf, reads[i], strlen(reads[i]));
+      parsed += parse(evbuf);
+    }
+  sec = sec_since(&start);
+
+  printf("%-24s %9d items in %6.3f s, %12.0f items/s\n", name, parsed, sec, parsed / sec);
+
+  evbuffer_free(evbuf);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  char *reads[sizeof(bench_items) / sizeof(bench_items[0])];
+  size_t size;
+  size_t len;
+  int nitems = sizeof(bench_items) / sizeof(bench_items[0]);
+  int items = BENCH_ITEMS_DEFAULT;
+  int opt;
+  int i;
+  int j;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+      switch (opt)
+	{
+	  case 'n':
+	    items = atoi(optarg);
+	    break;
+
+	  default:
+	    fprintf(stderr, "Usage: %s [-n <items>]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (items <= 0)
+    {
+      fprintf(stderr, "Usage: %s [-n <items>]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  // Each read starts at a different item, so the mix doesn't line up with reads
+  for (i = 0; i < nitems; i++)
+    {
+      for (j = 0, size = 1; j < BENCH_ITEMS_PER_READ; j++)
+	size += strlen(bench_items[(i + j) % nitems]) + 1;
+
+      reads[i] = malloc(size);
+      if (!reads[i])
+	return EXIT_FAILURE;
+
+      for (j = 0, len = 0; j < BENCH_ITEMS_PER_READ; j++)
+	len += sprintf(reads[i] + len, "%s\n", bench_items[(i + j) % nitems]);
+    }
+
+  if (bench_run("in place + gperf", inplace_parse, reads, nitems, items) < 0 ||
+      bench_run("copy + prefix compare", legacy_parse, reads, nitems, items) < 0)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < nitems; i++)
+    free(reads[i]);
+
+  return EXIT_SUCCESS;
+}
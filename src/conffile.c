@@ -72,6 +72,10 @@ static cfg_opt_t sec_general[] =
     CFG_BOOL("ssl_verifypeer", cfg_true, CFGF_NONE),
     CFG_BOOL("timer_test", cfg_false, CFGF_NONE),
     CFG_INT("start_buffer_ms", 2250, CFGF_NONE),
+    CFG_BOOL("realtime", cfg_false, CFGF_NONE),
+    CFG_INT("realtime_priority", 40, CFGF_NONE),
+    CFG_INT_LIST("realtime_cpus", NULL, CFGF_NONE),
+    CFG_BOOL("realtime_mlock", cfg_true, CFGF_NONE),
     CFG_END()
   };
 
@@ -136,6 +140,10 @@ static cfg_opt_t sec_mass[] =
     CFG_INT("pcm_sample_rate", 44100, CFGF_NONE),
     CFG_INT("pcm_bits_per_sample", 16, CFGF_NONE),
     CFG_INT("pcm_channels", 2, CFGF_NONE),
+    CFG_INT("progress_interval_ms", 1000, CFGF_NONE),
+    CFG_STR("artwork_cache_dir", NULL, CFGF_NONE), // NULL for a per-user directory, see artcache.c
+    CFG_INT("artwork_cache_size_mb", 64, CFGF_NONE),
+    CFG_END()
   };
 
 
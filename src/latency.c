@@ -0,0 +1,185 @@
+/*
+ * Latency histograms of the stages between reading audio/commands and handing
+ * them on to the player
+ *
+ * Each stage has a log-linear histogram of microsecond values: 8 linear
+ * buckets below 8 us, then 8 buckets per power of two, so a percentile is
+ * accurate to within 12.5%. The maximum is kept exactly. Samples are added
+ * with relaxed atomics from the mass_aud and mass_cmd threads, and
+ * latency_report() takes and resets the counts, so each report covers the
+ * interval since the previous one.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "latency.h"
+
+#define LATENCY_SUB_BITS  3
+#define LATENCY_SUB       (1 << LATENCY_SUB_BITS)
+// Values from 2^LATENCY_MSB_MAX us (~36 min) go in the last bucket
+#define LATENCY_MSB_MAX   31
+#define LATENCY_BUCKETS   ((LATENCY_MSB_MAX - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+
+struct latency_hist
+{
+  atomic_uint buckets[LATENCY_BUCKETS];
+  atomic_uint max_us;
+};
+
+static struct latency_hist latency_hists[CLIAP2_LATENCY_STAGES];
+
+static const char *latency_stage_names[CLIAP2_LATENCY_STAGES] =
+{
+  [CLIAP2_LATENCY_HOLD] = "hold",
+  [CLIAP2_LATENCY_INPUT_WRITE] = "input_write",
+  [CLIAP2_LATENCY_COMMAND] = "command",
+};
+
+static int
+bucket_of(uint32_t us)
+{
+  int msb;
+
+  if (us < LATENCY_SUB)
+    return us;
+
+  msb = 31 - __builtin_clz(us);
+  if (msb > LATENCY_MSB_MAX)
+    return LATENCY_BUCKETS - 1;
+
+  return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB + ((us >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+// Upper bound of the values in a bucket
+static uint32_t
+bucket_value(int bucket)
+{
+  int msb;
+  int sub;
+
+  if (bucket < LATENCY_SUB)
+    return bucket;
+
+  msb = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+  sub = bucket % LATENCY_SUB;
+
+  return (((uint64_t)(LATENCY_SUB + sub + 1) << (msb - LATENCY_SUB_BITS)) - 1) & UINT32_MAX;
+}
+
+static uint32_t
+percentile(const uint32_t *counts, uint32_t total, int pct)
+{
+  uint64_t rank;
+  uint64_t seen;
+  int i;
+
+  rank = ((uint64_t)total * pct + 99) / 100;
+  for (i = 0, seen = 0; i < LATENCY_BUCKETS; i++)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+	return bucket_value(i);
+    }
+
+  return bucket_value(LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Get the start time of a timed stage
+ * @param ts  [out] the current CLOCK_MONOTONIC time
+ */
+void
+latency_start(struct timespec *ts)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/**
+ * Add a sample to a stage, ending now
+ * @param stage  the stage
+ * @param start  start time of the sample from latency_start()
+ */
+void
+latency_record(enum cliap2_latency_stage stage, const struct timespec *start)
+{
+  struct latency_hist *hist = &latency_hists[stage];
+  struct timespec now;
+  int64_t us;
+  unsigned int max;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+  if (us < 0)
+    us = 0;
+  else if (us > UINT32_MAX)
+    us = UINT32_MAX;
+
+  atomic_fetch_add_explicit(&hist->buckets[bucket_of(us)], 1, memory_order_relaxed);
+
+  max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+  while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us, memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+/**
+ * Get the latency of each stage since the previous call, and start a new interval
+ * @param latency  [out] CLIAP2_LATENCY_STAGES entries
+ */
+void
+latency_report(struct cliap2_latency *latency)
+{
+  uint32_t counts[LATENCY_BUCKETS];
+  uint32_t total;
+  int stage;
+  int i;
+
+  for (stage = 0; stage < CLIAP2_LATENCY_STAGES; stage++)
+    {
+      for (i = 0, total = 0; i < LATENCY_BUCKETS; i++)
+	{
+	  counts[i] = atomic_exchange_explicit(&latency_hists[stage].buckets[i], 0, memory_order_relaxed);
+	  total += counts[i];
+	}
+
+      memset(&latency[stage], 0, sizeof(struct cliap2_latency));
+      latency[stage].max_us = atomic_exchange_explicit(&latency_hists[stage].max_us, 0, memory_order_relaxed);
+      latency[stage].count = total;
+      if (total == 0)
+	continue;
+
+      latency[stage].p50_us = percentile(counts, total, 50);
+      latency[stage].p99_us = percentile(counts, total, 99);
+
+      // The bucket bound can be above the exact maximum
+      if (latency[stage].p50_us > latency[stage].max_us)
+	latency[stage].p50_us = latency[stage].max_us;
+      if (latency[stage].p99_us > latency[stage].max_us)
+	latency[stage].p99_us = latency[stage].max_us;
+    }
+}
+
+const char *
+latency_stage_name(enum cliap2_latency_stage stage)
+{
+  if (stage < 0 || stage >= CLIAP2_LATENCY_STAGES)
+    return "unknown";
+
+  return latency_stage_names[stage];
+}
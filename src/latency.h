@@ -0,0 +1,21 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libcliap2.h"
+
+void
+latency_start(struct timespec *ts);
+
+void
+latency_record(enum cliap2_latency_stage stage, const struct timespec *start);
+
+void
+latency_report(struct cliap2_latency *latency);
+
+const char *
+latency_stage_name(enum cliap2_latency_stage stage);
+
+#endif /* !__LATENCY_H__ */
@@ -0,0 +1,1535 @@
+/*
+ * libcliap2: the AirPlay 2 session behind the cliap2 CLI, see libcliap2.h
+ *
+ * Pieces from owntone-server:
+ * Copyright (C) 2009-2011 Julien BLACHE <jb@jblache.org>
+ *
+ * Pieces from mt-daapd:
+ * Copyright (C) 2003 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <limits.h>
+#include <grp.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifdef HAVE_SIGNALFD
+# include <sys/signalfd.h>
+#else
+# include <sys/time.h>
+# include <sys/event.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <libavutil/avutil.h>
+#include <libavutil/log.h>
+#include <libavformat/avformat.h>
+#include <libavfilter/avfilter.h>
+
+#include <pthread.h>
+#include <gcrypt.h>
+#include <sodium.h>
+
+#include "conffile.h"
+#include "library.h"
+#include "logger.h"
+#include "misc.h"
+#include "player.h"
+#include "worker.h"
+#include "outputs/rtp_common.h"
+#include "wrappers.h"
+#include "cliap2.h"
+#include "mass.h"
+#include "realtime.h"
+#include "stats.h"
+#include "status.h"
+#include "trace.h"
+#include "libcliap2.h"
+
+#define AIRPLAY2_CONNECT_TIME_MS (int32_t) 2500 // Minimum time we need to connect and buffer before starting playback
+#define STATS_UPDATE_INTERVAL_SEC 1
+
+/*
+ * Below explanation is from libraop raop_client.h
+ *
+ * RAOP players have a latency which is usually 11025 frames.
+ *
+ * The precise time at the DAC is the time at the client plus the latency, so when
+ * setting a start time, we must anticipate by the latency if we want the first
+ * frame to be *exactly* played at that NTP value.
+ * 
+ * For Music Assistant, we will simply subtract 250ms (11025 frames at 44100 sample rate)
+ * This approach may need to change when we implement higher quality streams
+ */
+#define DAC_LATENCY_TS {0, 250e6}
+
+struct event_base *evbase_main;
+static struct event *sig_event;
+static int main_exit;
+ap2_device_info_t ap2_device_info;
+mass_named_pipes_t mass_named_pipes = {"-", 0}; // force stdin only for audio input
+
+static inline void
+timespec_to_ntp(struct timespec *ts, struct ntp_timestamp *ns)
+{
+  /* Seconds since NTP Epoch (1900-01-01) */
+  ns->sec = ts->tv_sec + NTP_EPOCH_DELTA;
+
+  // tv_nsec is a long (ie 64-bit). frac is a uint32_t (32-bit). By definition, we will lose granularity upon conversion
+  ns->frac = (uint32_t)((double)ts->tv_nsec * 1e-9 * FRAC);
+}
+
+static inline void
+ntp_to_timespec(struct ntp_timestamp *ns, struct timespec *ts)
+{
+  // Seconds since Unix Epoch (1970-01-01)
+  ts->tv_sec = ns->sec - NTP_EPOCH_DELTA;
+
+  ts->tv_nsec = (long)((double)ns->frac / (1e-9 * FRAC));
+}
+
+static inline int
+timing_get_clock_ntp(struct ntp_timestamp *ns)
+{
+  struct timespec ts;
+  int ret;
+
+  ret = clock_gettime(CLOCK_REALTIME, &ts); // Music Assistant CLOCK_ID basis
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_AIRPLAY, "Couldn't get clock: %s\n", strerror(errno));
+
+      return -1;
+    }
+
+  timespec_to_ntp(&ts, ns);
+
+  return 0;
+}
+
+/**
+ * Subtract t2 from t1
+ * @param result  t1 less t2
+ * @param t1      base timespec to be subracted from
+ * @param t2      timespec amount to subtract from t1
+ */
+static void 
+timespec_subtract(struct timespec *result, const struct timespec *t1, const struct timespec *t2) {
+    if (t1->tv_nsec < t2->tv_nsec) {
+        // Nanoseconds of t1 are less than t2, so we need to "borrow" a second
+        result->tv_sec = t1->tv_sec - t2->tv_sec - 1;
+        result->tv_nsec = 1000000000 + t1->tv_nsec - t2->tv_nsec;
+    } else {
+        result->tv_sec = t1->tv_sec - t2->tv_sec;
+        result->tv_nsec = t1->tv_nsec - t2->tv_nsec;
+    }
+}
+
+/**
+ * Determine the timespec delta between the CLOCK_ID's used by Music Assistant (CLOCK_REALTIME) and OwnTone (CLOCK_MONOTONIC) codebase
+ * @param ns  Pointer to the timespec delta to be returned.
+ * @returns 0 on success, -1 on failure
+ */
+static int
+ts_delta(struct timespec *delta)
+{
+  struct timespec ot_now; // OwnTone time basis of now
+  struct timespec ma_now; // Music Assistant time basis of now
+  int ret;
+
+  ret = clock_gettime(CLOCK_MONOTONIC, &ot_now);
+  if (ret < 0) {
+    DPRINTF(E_LOG, L_MAIN, "%s: Unable to obtain current time in OwnTone time basis. %s\n", __func__, strerror(errno));
+    return -1;
+  }
+  ret = clock_gettime(CLOCK_REALTIME, &ma_now);
+  if (ret < 0) {
+    DPRINTF(E_LOG, L_MAIN, "%s: Unable to obtain current time in Music Assistant time basis. %s\n", __func__, strerror(errno));
+    return -1;
+  }
+  timespec_subtract(delta, &ma_now, &ot_now);
+
+  return 0;
+}
+
+#ifdef HAVE_SIGNALFD
+static void
+signal_signalfd_cb(int fd, short event, void *arg)
+{
+  struct signalfd_siginfo info;
+  int status;
+
+  while (read(fd, &info, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
+    {
+      trace_event(TRACE_SIGNAL, info.ssi_signo, 0, 0);
+
+      switch (info.ssi_signo)
+	{
+	  case SIGCHLD:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGCHLD\n");
+
+	    while (waitpid(-1, &status, WNOHANG) > 0)
+	      /* Nothing. */ ;
+	    break;
+
+	  case SIGINT:
+	  case SIGTERM:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGTERM or SIGINT\n");
+
+	    main_exit = 1;
+	    break;
+
+	  case SIGHUP:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
+
+	    if (!main_exit)
+	      logger_reinit();
+	    break;
+
+	  case SIGUSR1:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGUSR1, dumping trace\n");
+
+	    trace_dump("SIGUSR1");
+	    break;
+	}
+    }
+
+  if (main_exit)
+    event_base_loopbreak(evbase_main);
+  else
+    event_add(sig_event, NULL);
+}
+
+#else
+
+static void
+signal_kqueue_cb(int fd, short event, void *arg)
+{
+  struct timespec ts;
+  struct kevent ke;
+  int status;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = 0;
+
+  while (kevent(fd, NULL, 0, &ke, 1, &ts) > 0)
+    {
+      trace_event(TRACE_SIGNAL, ke.ident, 0, 0);
+
+      switch (ke.ident)
+	{
+	  case SIGCHLD:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGCHLD\n");
+
+	    while (waitpid(-1, &status, WNOHANG) > 0)
+	      /* Nothing. */ ;
+	    break;
+
+	  case SIGINT:
+	  case SIGTERM:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGTERM or SIGINT\n");
+
+	    main_exit = 1;
+	    break;
+
+	  case SIGHUP:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGHUP\n");
+
+	    if (!main_exit)
+	      logger_reinit();
+	    break;
+
+	  case SIGUSR1:
+	    DPRINTF(E_LOG, L_MAIN, "Got SIGUSR1, dumping trace\n");
+
+	    trace_dump("SIGUSR1");
+	    break;
+	}
+    }
+
+  if (main_exit)
+    event_base_loopbreak(evbase_main);
+  else
+    event_add(sig_event, NULL);
+}
+#endif
+
+#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
+static int
+ffmpeg_lockmgr(void **pmutex, enum AVLockOp op)
+{
+  switch (op)
+    {
+      case AV_LOCK_CREATE:
+	*pmutex = malloc(sizeof(pthread_mutex_t));
+	if (!*pmutex)
+	  return 1;
+        CHECK_ERR(L_MAIN, mutex_init(*pmutex));
+	return 0;
+
+      case AV_LOCK_OBTAIN:
+        CHECK_ERR(L_MAIN, pthread_mutex_lock(*pmutex));
+	return 0;
+
+      case AV_LOCK_RELEASE:
+        CHECK_ERR(L_MAIN, pthread_mutex_unlock(*pmutex));
+	return 0;
+
+      case AV_LOCK_DESTROY:
+	CHECK_ERR(L_MAIN, pthread_mutex_destroy(*pmutex));
+	free(*pmutex);
+        *pmutex = NULL;
+
+	return 0;
+    }
+
+  return 1;
+}
+#endif
+
+/**
+ * Register the ffmpeg components and logging. Does nothing if already done,
+ * e.g. in a session forked by --server.
+ * @returns 0 on success, -1 on failure
+ */
+static int
+ffmpeg_init(void)
+{
+  static bool ffmpeg_ready;
+#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
+  int ret;
+#endif
+
+  if (ffmpeg_ready)
+    return 0;
+
+// The following was deprecated with ffmpeg 4.0 = avcodec 58.18, avformat 58.12, avfilter 7.16
+#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
+  ret = av_lockmgr_register(ffmpeg_lockmgr);
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Could not register ffmpeg lock manager callback\n");
+      return -1;
+    }
+#endif
+#if (LIBAVFORMAT_VERSION_MAJOR < 58) || ((LIBAVFORMAT_VERSION_MAJOR == 58) && (LIBAVFORMAT_VERSION_MINOR < 12))
+  av_register_all();
+#endif
+#if (LIBAVFILTER_VERSION_MAJOR < 7) || ((LIBAVFILTER_VERSION_MAJOR == 7) && (LIBAVFILTER_VERSION_MINOR < 16))
+  avfilter_register_all();
+#endif
+
+  // avformat_network_init() and, where libcurl allows it, curl_global_init()
+  // are deferred until the first artwork fetch, see net_lazy_init() in
+  // wrappers.c
+  av_log_set_callback(logger_ffmpeg);
+
+  ffmpeg_ready = true;
+  return 0;
+}
+
+
+// Parses a string of "key=value" "key=value" into a keyval struct
+static int
+parse_keyval(const char *str, struct keyval *kv)
+{
+  char *key;
+  char *value;
+  char *s;
+  char *outer_token, *inner_token;
+  char *outer_saveptr, *inner_saveptr;
+
+  s = (char *)str;
+  if (*s != '"') {
+    DPRINTF(E_FATAL, L_MAIN, "Keyval string must start with a double quote (\"), not with '%c':%d\n", *s, *s);
+    return -1;
+  }
+  s++; // Skip opening quote
+
+  // Tokenize the main string by double quotes
+  outer_token = strtok_r(s, "\"", &outer_saveptr);
+  while (outer_token != NULL) {
+    // For each keyval pair, tokenize by =
+    inner_token = strtok_r(outer_token, "=", &inner_saveptr);
+    for (int i=0; inner_token != NULL; i++) {
+      switch (i) {
+        case 0:
+          key = inner_token;
+          break;
+        case 1:
+          value = inner_token;
+          keyval_add(kv, key, value);
+          break;
+        default:
+          DPRINTF(E_FATAL, L_MAIN, "Keyval pair '%s' has too many '=' characters\n", outer_token);
+          return -1;        
+      }
+      inner_token = strtok_r(NULL, "=", &inner_saveptr);
+    }
+    outer_token = strtok_r(NULL, "\"", &outer_saveptr);
+    outer_token = strtok_r(NULL, "\"", &outer_saveptr);
+  }
+
+  return 0;
+}
+
+// Whether the device displays artwork, i.e. has bit 15 (MetadataFeatures_0) of
+// the AirPlay features set. The txt value is "0x<low 32 bits>,0x<high 32 bits>".
+// Devices that don't say are assumed to display it.
+static bool
+txt_wants_artwork(struct keyval *kv)
+{
+  const char *features;
+  unsigned long long low;
+  char *end;
+
+  features = keyval_get(kv, "features");
+  if (!features)
+    return true;
+
+  errno = 0;
+  low = strtoull(features, &end, 16);
+  if (errno || end == features)
+    return true;
+
+  return (low & (1ULL << 15)) != 0;
+}
+
+// Check for valid named pipe, creating it if it doesn't exist.
+// @param name the filename of the named pipe
+// @returns 0 on success, -1 on failure
+static
+int check_pipe(const char *pipe_path)
+{
+  struct stat st;
+
+  // Allow "-" to mean stdin
+  if (strcmp(pipe_path, "-") == 0) {
+      return 0;
+  }
+
+  // Check if the file exists and get its information
+  if (stat(pipe_path, &st) == 0) {
+      // File exists, now check if it's a FIFO (named pipe)
+      if (S_ISFIFO(st.st_mode)) {
+          DPRINTF(E_SPAM, L_MAIN, "%s:Using existing pipe '%s'\n", __func__, pipe_path);
+          return 0;
+      }
+      else {
+          DPRINTF(E_FATAL, L_MAIN, "%s:File '%s' exists, but it is not a named pipe.\n", __func__, pipe_path);
+          return -1;
+      }
+  }
+  else {
+      // File does not exist - create the pipe
+      if (errno == ENOENT) {
+          if (mkfifo(pipe_path, 0666) == 0) {
+              DPRINTF(E_SPAM, L_MAIN, "%s:Created pipe '%s'\n", __func__, pipe_path);
+              return 0;
+          }
+          DPRINTF(E_FATAL, L_MAIN, "%s:Failed to create pipe '%s': %s\n", __func__, pipe_path, strerror(errno));
+          return -1;
+      }
+      else {
+          DPRINTF(E_FATAL, L_MAIN, "%s:Error checking for named pipe %s. %s\n", __func__, pipe_path, strerror(errno));
+          return -1;
+      }
+  }
+
+  return 0;
+}
+
+/* ------------------------- STARTUP TIMING/CRYPTO -------------------------- */
+
+static struct timespec startup_ts;
+static struct timespec startup_last_ts;
+static pthread_mutex_t startup_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t
+startup_elapsed_ms(struct timespec *from, struct timespec *to)
+{
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/**
+ * Log the time spent in a startup phase and the total time since main() began
+ * @param phase  name of the phase that just completed
+ * @note  May be called from any thread. Used to measure time-to-first-packet.
+ */
+void
+startup_phase_mark(const char *phase)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&startup_lck);
+  DPRINTF(E_DBG, L_MAIN, "Startup phase '%s' took %" PRIi64 "ms, %" PRIi64 "ms since start\n",
+    phase, startup_elapsed_ms(&startup_last_ts, &now), startup_elapsed_ms(&startup_ts, &now));
+  startup_last_ts = now;
+  pthread_mutex_unlock(&startup_lck);
+}
+
+static pthread_t crypto_tid;
+static bool crypto_running;
+static int crypto_ret = -1;
+
+/**
+ * Initialise libgcrypt and libsodium and seed their random generators, so that
+ * the first pairing doesn't pay for entropy gathering
+ * @returns 0 on success, -1 on failure. The result is also kept in crypto_ret.
+ */
+static int
+crypto_init(void)
+{
+  const char *gcry_version;
+  unsigned char seed[16];
+
+  crypto_ret = -1;
+
+  gcry_version = gcry_check_version(GCRYPT_VERSION);
+  if (!gcry_version)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "libgcrypt version mismatch\n");
+      return -1;
+    }
+
+  /* We aren't handling anything sensitive, so give up on secure
+   * memory, which is a scarce system resource.
+   */
+  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+
+  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  DPRINTF(E_DBG, L_MAIN, "Initialized with gcrypt %s\n", gcry_version);
+
+  // Pull once from the strong pool, which is what pairing key generation uses
+  gcry_randomize(seed, sizeof(seed), GCRY_STRONG_RANDOM);
+
+  if (sodium_init() < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Could not initialize libsodium\n");
+      return -1;
+    }
+
+  randombytes_buf(seed, sizeof(seed));
+
+  crypto_ret = 0;
+  return 0;
+}
+
+static void *
+crypto_init_thread(void *arg)
+{
+  thread_setname("crypto_init");
+
+  crypto_init();
+
+  return NULL;
+}
+
+/**
+ * Run crypto_init() on its own thread. Does nothing if it has already
+ * completed, e.g. in a session forked by --server, or is still running.
+ */
+static void
+crypto_init_start(void)
+{
+  int ret;
+
+  if (crypto_ret == 0 || crypto_running)
+    return;
+
+  ret = pthread_create(&crypto_tid, NULL, crypto_init_thread, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_WARN, L_MAIN, "Could not start crypto init thread (%s), running it inline\n", strerror(ret));
+      crypto_init();
+      return;
+    }
+
+  crypto_running = true;
+}
+
+/**
+ * Wait for crypto_init_start() to complete. Safe to call more than once.
+ * @returns 0 on success, -1 if crypto initialisation failed
+ */
+static int
+crypto_init_join(void)
+{
+  if (crypto_running)
+    {
+      pthread_join(crypto_tid, NULL);
+      crypto_running = false;
+    }
+
+  return crypto_ret;
+}
+
+/**
+ * Obtain the output buffer duration in milliseconds
+ * @returns   Output buffer duration in milliseconds
+ * @note      Output buffer duration includes the inherent DAC latency of the output device. 
+ *            This is typically 250ms or 11025 frames at 44100 sample rate 
+ */
+uint64_t
+get_output_buffer_ms(void)
+{
+  return cfg_getint(cfg_getsec(cfg, "general"), "start_buffer_ms");
+}
+
+/**
+ * Obtain the output buffer duration as a timespec
+ * @param [out] ts  Pointer to a timespec structure where the output buffer duration will be returned
+ * @returns   void
+ * @note      Output buffer duration includes the inherent DAC latency of the output device. 
+ *            This is typically 250ms or 11025 frames at 44100 sample rate 
+ */
+void
+get_output_buffer_ts(struct timespec *ts)
+{
+  uint64_t buffer_duration_ms;
+
+  buffer_duration_ms = cfg_getint(cfg_getsec(cfg, "general"), "start_buffer_ms");
+
+  ts->tv_sec = (time_t)(buffer_duration_ms / 1000);
+  ts->tv_nsec = (long)((buffer_duration_ms % 1000) * 1000 * 1000);
+
+  return;
+}
+
+/**
+ * Determine a valid playback start time given a specified NTP start time
+ * @param ts        Pointer to a timespec structure where the start time will be returned
+ * @param ntpstart  NTP start time encoded as uint64_t
+ * @returns         0 on success, -1 on failure.
+ */
+static int
+get_start_ts(struct timespec *ts, uint64_t ntpstart)
+{
+  struct ntp_timestamp start_ns;  // MA clock basis
+  struct timespec now_ts;         // OT clock basis
+  struct timespec start_ts;       // MA clock basis
+  struct timespec delta_ts;       // delta between MA and OT clock basis
+  struct timespec lag_ts;         // lag between now and start time
+  struct timespec latency_ts;     // output buffer duration, inclusive of DAC latency
+  int32_t lag_ms;                 // lag in milliseconds between now and start time
+  int32_t pairing_latency_ms = ap2_device_info.pairing_latency_ts.tv_sec + (ap2_device_info.pairing_latency_ts.tv_nsec / 1e6);
+  int ret;
+
+  ret = clock_gettime(CLOCK_MONOTONIC, &now_ts); // Use OwnTone time basis
+  if (ret != 0) {
+    DPRINTF(E_FATAL, L_MAIN, "Could not get current time: %s\n", strerror(errno));
+    return -1;
+  }
+  start_ns.sec = (uint32_t)(ntpstart >> 32);
+  start_ns.frac = (uint32_t)(ntpstart);
+
+  ntp_to_timespec(&start_ns, &start_ts);
+
+  // convert from Music Assistant time basis to OwnTone time basis
+    // delta_ts is the epoch difference CLOCK_REALTIME-CLOCK_MONOTONIC = uptime - 1/1/1970
+  ret = ts_delta(&delta_ts);
+  if (ret < 0) {
+    DPRINTF(E_FATAL, L_MAIN, "Unable to determine time basis delta\n");
+    return -1;
+  }
+  DPRINTF(E_SPAM, L_MAIN, "%s:%s:CLOCK_REALTIME - CLOCK_MONOTONIC = %ld.%09ld\n", 
+    __func__, ap2_device_info.name, delta_ts.tv_sec, delta_ts.tv_nsec
+  );
+  timespec_subtract(ts, &start_ts, &delta_ts); // ts will now be the requested start time, excluding latency, in OwnTone time basis
+  get_output_buffer_ts(&latency_ts);
+  timespec_subtract(ts, ts, &latency_ts);
+  timespec_to_ntp(ts, &start_ns);
+  timespec_subtract(&lag_ts, ts, &now_ts);
+  DPRINTF(E_INFO, L_MAIN, "%s:%s:Audio starts in %ld.%.9ld secs.\n", __func__, ap2_device_info.name, lag_ts.tv_sec, lag_ts.tv_nsec);
+
+  lag_ms = (int32_t)(lag_ts.tv_sec * 1000) + (int32_t)(lag_ts.tv_nsec / 1e6);
+  if (lag_ms < pairing_latency_ms) {
+    // Give ourselves enough time to get connected and build our buffer
+    int32_t extra_ms = pairing_latency_ms - lag_ms;
+    DPRINTF(E_WARN, L_MAIN, 
+      "%s:%s:ntpstart time too soon. Adjust pairing_latency to align with device capability or increase ntpstart by at least %" PRId32
+      " ms to prevent loss of audio.\n", __func__, ap2_device_info.name, extra_ms
+    );
+    return -1;
+  }
+  return 0;
+}
+
+/* -------------------------------- SESSION --------------------------------- */
+
+struct cliap2_session
+{
+  char *name;
+  char *hostname;
+  char *address;
+  struct keyval *txt_kv;
+  uint64_t ntpstart;
+
+  // Paths handed to mass.c, and our ends of the internal pipes (-1 if unused)
+  char *audio_path;
+  char *command_path;
+  int audio_rfd;
+  int audio_wfd;
+  int command_rfd;
+  int command_wfd;
+
+  // Run by cliap2_session_run(), i.e. owns the process like the CLI does
+  bool foreground;
+  bool ended;
+
+  pthread_t tid;
+  bool thread_running;
+  int result;
+
+  // Protects stop_requested/stop_ev, as cliap2_session_stop() can be called
+  // from any thread, also before the event loop exists
+  pthread_mutex_t lck;
+  bool stop_requested;
+  struct event *stop_ev;
+
+  // Becomes readable when the session is stopped, wakes writers blocked on a
+  // full internal pipe
+  int wake_rfd;
+  int wake_wfd;
+};
+
+static bool lib_initialized;
+static struct cliap2_session *session_current;
+// "realtime" from the configuration, which params->realtime only overrides
+// for the session that asked for it
+static cfg_bool_t realtime_configured;
+
+static void
+startup_atfork_child(void)
+{
+  // A forked session (see --server) measures its startup from the fork
+  clock_gettime(CLOCK_MONOTONIC, &startup_ts);
+  startup_last_ts = startup_ts;
+}
+
+static int
+session_pipe_create(int *rfd, int *wfd, char **path)
+{
+  int fds[2];
+
+  if (pipe(fds) < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create session pipe: %s\n", strerror(errno));
+      return -1;
+    }
+
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  // Our end, see session_write()
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+  *rfd = fds[0];
+  *wfd = fds[1];
+
+  // mass.c opens its inputs by path, /dev/fd gives it a new fd for our read end
+  CHECK_NULL(L_MAIN, *path = safe_asprintf("/dev/fd/%d", fds[0]));
+
+  return 0;
+}
+
+static void
+session_stop_cb(int fd, short what, void *arg)
+{
+  event_base_loopbreak(evbase_main);
+}
+
+static void
+stats_timer_cb(int fd, short what, void *arg)
+{
+  stats_publish();
+}
+
+/**
+ * write() without SIGPIPE, which would kill the host process if the session
+ * has closed the read end
+ */
+static ssize_t
+write_nosigpipe(int fd, const void *buf, size_t len)
+{
+  sigset_t pipe_set;
+  sigset_t old_set;
+  sigset_t pending;
+  struct timespec zero = { 0, 0 };
+  bool was_pending;
+  ssize_t written;
+  int saved_errno;
+
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+
+  sigpending(&pending);
+  was_pending = sigismember(&pending, SIGPIPE);
+
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+  written = write(fd, buf, len);
+  if (written < 0 && errno == EPIPE && !was_pending)
+    {
+      // Consume the SIGPIPE we raised ourselves
+      saved_errno = errno;
+      sigtimedwait(&pipe_set, NULL, &zero);
+      errno = saved_errno;
+    }
+
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+  return written;
+}
+
+/**
+ * Write to one of the internal pipes, waiting while it is full
+ * @returns 0 on success, -1 on failure or once the session has stopped
+ */
+static int
+session_write(struct cliap2_session *session, int fd, const void *buf, size_t len)
+{
+  const uint8_t *ptr = buf;
+  struct pollfd pfd[2];
+  ssize_t written;
+  bool stopped;
+
+  while (len > 0)
+    {
+      pthread_mutex_lock(&session->lck);
+      stopped = session->stop_requested;
+      pthread_mutex_unlock(&session->lck);
+      if (stopped)
+	{
+	  errno = ECANCELED;
+	  return -1;
+	}
+
+      written = write_nosigpipe(fd, ptr, len);
+      if (written < 0 && errno == EINTR)
+	continue;
+      if (written < 0 && errno == EAGAIN)
+	{
+	  pfd[0].fd = fd;
+	  pfd[0].events = POLLOUT;
+	  pfd[1].fd = session->wake_rfd;
+	  pfd[1].events = POLLIN;
+	  if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+	    return -1;
+	  continue;
+	}
+      if (written < 0)
+	return -1;
+
+      ptr += written;
+      len -= written;
+    }
+
+  return 0;
+}
+
+/**
+ * Run a session on the calling thread until it is stopped
+ * @returns 0 on success, -1 on failure
+ */
+static int
+session_run(struct cliap2_session *session)
+{
+  sigset_t sigs;
+  int sigfd = -1;
+#ifdef HAVE_KQUEUE
+  struct kevent ke_sigs[5];
+#endif
+  struct timeval stats_tv = { STATS_UPDATE_INTERVAL_SEC, 0 };
+  struct event *stats_ev;
+  int ret;
+
+  get_start_ts(&ap2_device_info.start_ts, session->ntpstart); // We no longer care about returned result
+
+  ret = realtime_init();
+  if (ret != 0) {
+    DPRINTF(E_FATAL, L_MAIN, "Invalid realtime configuration\n");
+    return -1;
+  }
+
+  if (session->foreground)
+    {
+      /* Block signals for all threads except the main one */
+      sigemptyset(&sigs);
+      sigaddset(&sigs, SIGINT);
+      sigaddset(&sigs, SIGHUP);
+      sigaddset(&sigs, SIGCHLD);
+      sigaddset(&sigs, SIGTERM);
+      sigaddset(&sigs, SIGPIPE);
+      sigaddset(&sigs, SIGUSR1);
+      ret = pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Error setting signal set\n");
+	  return -1;
+	}
+    }
+
+  /* libgcrypt/libsodium setup and RNG seeding were started by cliap2_init(),
+   * this only starts them if that failed. They are joined before
+   * player_init(), since the player thread may start pairing straight away.
+   */
+  crypto_init_start();
+
+  /* Initialize event base */
+  CHECK_NULL(L_MAIN, evbase_main = event_base_new());
+
+  CHECK_NULL(L_MAIN, session->stop_ev = event_new(evbase_main, -1, 0, session_stop_cb, NULL));
+
+  /* Stats page for external monitoring, see cliap2-stats. Not fatal if unavailable */
+  stats_init(ap2_device_info.name);
+  CHECK_NULL(L_MAIN, stats_ev = event_new(evbase_main, -1, EV_PERSIST, stats_timer_cb, NULL));
+  event_add(stats_ev, &stats_tv);
+
+  /* Spawn worker thread */
+  ret = worker_init();
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Worker thread failed to start\n");
+
+      ret = -1;
+      goto worker_fail;
+    }
+
+  startup_phase_mark("worker");
+
+  ret = crypto_init_join();
+  if (ret != 0)
+    {
+      ret = -1;
+      goto crypto_fail;
+    }
+
+  startup_phase_mark("crypto");
+
+  /* Spawn player thread. In realtime mode the player, input and mass threads
+   * inherit SCHED_FIFO and CPU affinity from us while it runs.
+   */
+  realtime_spawn_begin();
+  ret = player_init();
+  realtime_spawn_end();
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Player thread failed to start\n");
+
+      ret = -1;
+      goto player_fail;
+    }
+
+  startup_phase_mark("player");
+
+  realtime_memlock();
+
+  if (session->foreground)
+    {
+#ifdef HAVE_SIGNALFD
+      /* Set up signal fd */
+      sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+      if (sigfd < 0)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Could not setup signalfd: %s\n", strerror(errno));
+
+	  ret = -1;
+	  goto signalfd_fail;
+	}
+
+      sig_event = event_new(evbase_main, sigfd, EV_READ, signal_signalfd_cb, NULL);
+#else
+      sigfd = kqueue();
+      if (sigfd < 0)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Could not setup kqueue: %s\n", strerror(errno));
+
+	  ret = -1;
+	  goto signalfd_fail;
+	}
+
+      EV_SET(&ke_sigs[0], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      EV_SET(&ke_sigs[1], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      EV_SET(&ke_sigs[2], SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      EV_SET(&ke_sigs[3], SIGCHLD, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      EV_SET(&ke_sigs[4], SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+
+      ret = kevent(sigfd, ke_sigs, 5, NULL, 0, NULL);
+      if (ret < 0)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Could not register signal events: %s\n", strerror(errno));
+
+	  ret = -1;
+	  goto signalfd_fail;
+	}
+
+      sig_event = event_new(evbase_main, sigfd, EV_READ, signal_kqueue_cb, NULL);
+#endif
+      if (!sig_event)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Could not create signal event\n");
+
+	  ret = -1;
+	  goto sig_event_fail;
+	}
+
+      event_add(sig_event, NULL);
+    }
+
+  /* Run the loop, unless we were stopped while starting up */
+  pthread_mutex_lock(&session->lck);
+  if (session->stop_requested)
+    event_active(session->stop_ev, 0, 0);
+  pthread_mutex_unlock(&session->lck);
+
+  event_base_loop(evbase_main, EVLOOP_NO_EXIT_ON_EMPTY);
+
+  DPRINTF(E_INFO, L_MAIN, "Stopping gracefully\n");
+  ret = 0;
+
+  if (sig_event)
+    event_free(sig_event);
+  sig_event = NULL;
+
+ sig_event_fail:
+  if (sigfd >= 0)
+    close(sigfd);
+ signalfd_fail:
+  DPRINTF(E_INFO, L_MAIN, "Player deinit\n");
+  player_deinit();
+
+ player_fail:
+ crypto_fail:
+  DPRINTF(E_INFO, L_MAIN, "Worker deinit\n");
+  worker_deinit();
+
+ worker_fail:
+  db_deinit();
+
+  pthread_mutex_lock(&session->lck);
+  event_free(session->stop_ev);
+  session->stop_ev = NULL;
+  pthread_mutex_unlock(&session->lck);
+
+  event_free(stats_ev);
+  stats_deinit();
+
+  event_base_free(evbase_main);
+  evbase_main = NULL;
+
+  crypto_init_join();
+
+  return ret;
+}
+
+static void *
+session_thread_run(void *arg)
+{
+  struct cliap2_session *session = arg;
+
+  thread_setname("cliap2");
+
+  session->result = session_run(session);
+
+  return NULL;
+}
+
+/**
+ * Called by mass.c once playback has stopped for good
+ * @note  The CLI exits right away, as it always has. A library session
+ *        breaks its event loop instead, so that the host process survives.
+ */
+void
+session_end(void)
+{
+  if (session_current && session_current->ended)
+    return;
+
+  status_emit(CLIAP2_EVENT_ENDED, 0, -1);
+
+  if (!session_current || session_current->foreground)
+    {
+      stats_deinit();
+      exit(0);
+    }
+
+  session_current->ended = true;
+  cliap2_session_stop(session_current);
+}
+
+/* ---------------------------------- API ----------------------------------- */
+
+/**
+ * Initialise the library: logging, configuration and the codec libraries
+ * @param config_file  configuration file, NULL for none
+ * @param loglevel     log level 0-5, -1 to take it from the configuration
+ * @param logfile      log file, NULL to log to stderr
+ * @param prewarm      initialise the crypto libraries before returning, rather
+ *                     than on a thread that the session start waits for. For
+ *                     servers that fork sessions, see --server.
+ * @returns 0 on success, -1 on failure
+ */
+int
+cliap2_init(const char *config_file, int loglevel, const char *logfile, bool prewarm)
+{
+  const char *av_version;
+  char *logformat;
+  int ret;
+
+  if (lib_initialized)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &startup_ts);
+  startup_last_ts = startup_ts;
+  pthread_atfork(NULL, NULL, startup_atfork_child);
+
+  // Before logger_init() starts the log writer thread
+  net_early_init();
+
+  ret = logger_init(NULL, NULL, (loglevel < 0) ? E_LOG : loglevel, NULL);
+  if (ret != 0) {
+    fprintf(stderr, "Could not initialize log facility\n");
+    return -1;
+  }
+
+  ret = conffile_load((char *)config_file);
+  if (ret != 0) {
+    DPRINTF(E_FATAL, L_MAIN, "Config file errors; please fix your config\n");
+    logger_deinit();
+    return -1;
+  }
+
+  logger_deinit();
+
+  realtime_configured = cfg_getbool(cfg_getsec(cfg, "general"), "realtime");
+
+  /* Reinit log facility with configfile values */
+  if (loglevel < 0)
+    loglevel = cfg_getint(cfg_getsec(cfg, "general"), "loglevel");
+  logformat = cfg_getstr(cfg_getsec(cfg, "general"), "logformat");
+
+  ret = logger_init((char *)logfile, NULL, loglevel, logformat);
+  if (ret != 0) {
+    fprintf(stderr, "Could not reinitialize log facility with config file settings\n");
+    conffile_unload();
+    return -1;
+  }
+
+  /* Set up libevent logging callback */
+  event_set_log_callback(logger_libevent);
+
+  CHECK_ERR(L_MAIN, evthread_use_pthreads());
+
+  DPRINTF(E_INFO, L_MAIN, "%s version %s taking off\n", PACKAGE, VERSION);
+
+#if HAVE_DECL_AV_VERSION_INFO
+  av_version = av_version_info();
+#else
+  av_version = "(unknown version)";
+#endif
+
+#ifdef HAVE_FFMPEG
+  DPRINTF(E_INFO, L_MAIN, "Initialized with ffmpeg %s\n", av_version);
+#else
+  DPRINTF(E_INFO, L_MAIN, "Initialized with libav %s\n", av_version);
+#endif
+
+  /* A server must not have other threads running when it forks, so it waits
+   * for the crypto libraries. Otherwise they initialise alongside the ffmpeg
+   * registration and whatever comes before the session start, and are joined
+   * before the player starts.
+   */
+  if (prewarm)
+    ret = crypto_init();
+  else
+    {
+      crypto_init_start();
+      ret = 0;
+    }
+
+  if (ret == 0)
+    ret = ffmpeg_init();
+  if (ret != 0)
+    {
+      crypto_init_join();
+      conffile_unload();
+      logger_deinit();
+      return -1;
+    }
+
+  startup_phase_mark("init");
+
+  lib_initialized = true;
+  return 0;
+}
+
+/**
+ * Release what cliap2_init() set up. Any session must have been freed.
+ */
+void
+cliap2_deinit(void)
+{
+  if (!lib_initialized)
+    return;
+
+  crypto_init_join();
+  net_lazy_deinit();
+
+#if (LIBAVCODEC_VERSION_MAJOR < 58) || ((LIBAVCODEC_VERSION_MAJOR == 58) && (LIBAVCODEC_VERSION_MINOR < 18))
+  av_lockmgr_register(NULL);
+#endif
+
+  DPRINTF(E_INFO, L_MAIN, "Exiting.\n");
+  conffile_unload();
+  logger_deinit();
+
+  lib_initialized = false;
+}
+
+/**
+ * Get the current time in NTP format, in the time basis used for ntpstart
+ * @param ntp  [out] seconds since 1900 in the upper 32 bits, fraction in the lower
+ * @returns 0 on success, -1 on failure
+ */
+int
+cliap2_ntp_now(uint64_t *ntp)
+{
+  struct ntp_timestamp ns = {0, 0};
+  int ret;
+
+  ret = timing_get_clock_ntp(&ns);
+  *ntp = ((uint64_t)ns.sec << 32) | ns.frac;
+
+  return ret;
+}
+
+/**
+ * Initialise session parameters with their defaults
+ */
+void
+cliap2_params_init(struct cliap2_params *params)
+{
+  memset(params, 0, sizeof(struct cliap2_params));
+
+  params->port = -1;
+  params->pairing_latency_ms = AIRPLAY2_CONNECT_TIME_MS;
+  params->input_write_ms = 15;
+  params->audio_fd = -1;
+  params->status_fd = -1;
+}
+
+/**
+ * Create the session. Only one session can exist at a time.
+ * @param params  session parameters, copied
+ * @returns the session, NULL on invalid parameters or failure
+ */
+struct cliap2_session *
+cliap2_session_new(const struct cliap2_params *params)
+{
+  struct cliap2_session *session;
+  int fds[2];
+  int ret;
+
+  if (!lib_initialized || session_current)
+    {
+      DPRINTF(E_LOG, L_MAIN, "%s\n", session_current ? "A session already exists" : "cliap2_init() has not been called");
+      return NULL;
+    }
+
+  if (params->port < 0 || !params->name || !params->hostname || !params->address || !params->txt)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Session parameters name, hostname, address, port and txt are mandatory\n");
+      return NULL;
+    }
+
+  CHECK_NULL(L_MAIN, session = calloc(1, sizeof(struct cliap2_session)));
+  CHECK_ERR(L_MAIN, mutex_init(&session->lck));
+  session->audio_rfd = session->audio_wfd = -1;
+  session->command_rfd = session->command_wfd = -1;
+  session->wake_rfd = session->wake_wfd = -1;
+
+  if (pipe(fds) < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create session wake pipe: %s\n", strerror(errno));
+      goto fail;
+    }
+  session->wake_rfd = fds[0];
+  session->wake_wfd = fds[1];
+  fcntl(session->wake_rfd, F_SETFD, FD_CLOEXEC);
+  fcntl(session->wake_wfd, F_SETFD, FD_CLOEXEC);
+
+  CHECK_NULL(L_MAIN, session->name = strdup(params->name));
+  CHECK_NULL(L_MAIN, session->hostname = strdup(params->hostname));
+  CHECK_NULL(L_MAIN, session->address = strdup(params->address));
+  CHECK_NULL(L_MAIN, session->txt_kv = keyval_alloc());
+  session->ntpstart = params->ntpstart;
+
+  ret = parse_keyval(params->txt, session->txt_kv);
+  if (ret != 0){
+    DPRINTF(E_FATAL, L_MAIN,
+      "Error: txt keyvals must be in format \"key=value\" \"key=value\" format in '--txt %s'\n",
+      params->txt);
+    goto fail;
+  }
+
+  if (params->dacp_id)
+    {
+      // Parse hex string to uint64 and set libhash
+      ret = safe_hextou64(params->dacp_id, &libhash);
+      if (ret < 0)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Error: dacp_id must be a hex string, not '%s'\n", params->dacp_id);
+	  goto fail;
+	}
+      DPRINTF(E_DBG, L_MAIN, "DACP ID set to: %" PRIX64 "\n", libhash);
+    }
+
+  ap2_device_info.name = session->name;
+  ap2_device_info.hostname = session->hostname;
+  ap2_device_info.address = session->address;
+  ap2_device_info.port = params->port;
+  ap2_device_info.txt = session->txt_kv;
+  ap2_device_info.wants_artwork = txt_wants_artwork(session->txt_kv);
+  if (!ap2_device_info.wants_artwork)
+    DPRINTF(E_INFO, L_MAIN, "Device features show no artwork support, artwork will not be sent\n");
+  ap2_device_info.auth_key = params->auth_key ? strdup(params->auth_key) : NULL;
+  ap2_device_info.password = params->password ? strdup(params->password) : NULL;
+  ap2_device_info.volume = params->volume;
+  ap2_device_info.latency_ms = params->latency_ms;
+  ap2_device_info.input_write_ms = params->input_write_ms;
+  ap2_device_info.pairing_latency_ts.tv_sec = (time_t)(params->pairing_latency_ms / 1000);
+  ap2_device_info.pairing_latency_ts.tv_nsec = (long)((params->pairing_latency_ms % 1000) * 1e6);
+
+  cfg_setbool(cfg_getsec(cfg, "general"), "realtime", params->realtime ? cfg_true : realtime_configured);
+
+  if (params->audio_fd == STDIN_FILENO)
+    CHECK_NULL(L_MAIN, session->audio_path = strdup("-"));
+  else if (params->audio_fd >= 0)
+    CHECK_NULL(L_MAIN, session->audio_path = safe_asprintf("/dev/fd/%d", params->audio_fd));
+  else if (session_pipe_create(&session->audio_rfd, &session->audio_wfd, &session->audio_path) < 0)
+    goto fail;
+
+  if (params->command_pipe)
+    CHECK_NULL(L_MAIN, session->command_path = strdup(params->command_pipe));
+  else if (session_pipe_create(&session->command_rfd, &session->command_wfd, &session->command_path) < 0)
+    goto fail;
+
+  // Check that named pipe exists for metadata/commands
+  ret = check_pipe(session->command_path);
+  if (ret < 0)
+    goto fail;
+
+  mass_named_pipes.audio_pipe = session->audio_path;
+  mass_named_pipes.metadata_pipe = session->command_path;
+
+  if (params->status_fd >= 0 && status_fd_set(params->status_fd) < 0)
+    goto fail;
+
+  session_current = session;
+  return session;
+
+ fail:
+  cliap2_session_free(session);
+  return NULL;
+}
+
+/**
+ * Register a callback for status events. Must be called before the session
+ * is started.
+ */
+void
+cliap2_session_status_cb_set(struct cliap2_session *session, cliap2_status_cb cb, void *ctx)
+{
+  status_cb_set(cb, ctx);
+}
+
+/**
+ * Run the session on the calling thread, taking over SIGINT, SIGTERM, SIGHUP,
+ * SIGCHLD and SIGUSR1, which writes a trace dump. This is what the CLI does:
+ * like the CLI, the process exits when playback stops.
+ * @returns 0 if stopped by a signal, -1 on failure
+ */
+int
+cliap2_session_run(struct cliap2_session *session)
+{
+  session->foreground = true;
+
+  return session_run(session);
+}
+
+/**
+ * Run the session on a new thread. Signals are left to the host, see
+ * libcliap2.h about SIGUSR1.
+ * @returns 0 on success, -1 on failure
+ */
+int
+cliap2_session_start(struct cliap2_session *session)
+{
+  int ret;
+
+  if (session->thread_running)
+    return -1;
+
+  ret = pthread_create(&session->tid, NULL, session_thread_run, session);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not start session thread: %s\n", strerror(ret));
+      return -1;
+    }
+
+  session->thread_running = true;
+  return 0;
+}
+
+/**
+ * Push raw PCM audio to the session. Blocks while the session's input buffer
+ * is full, but returns once the session is stopped. A zero length signals end
+ * of stream.
+ * @returns 0 on success, -1 on failure, if the session has stopped (errno
+ *          ECANCELED) or if the session has its own audio_fd
+ */
+int
+cliap2_session_push_pcm(struct cliap2_session *session, const void *buf, size_t len)
+{
+  if (session->audio_wfd < 0)
+    return -1;
+
+  if (len == 0)
+    {
+      close(session->audio_wfd);
+      session->audio_wfd = -1;
+      return 0;
+    }
+
+  return session_write(session, session->audio_wfd, buf, len);
+}
+
+/**
+ * Send a command or metadata line, e.g. "VOLUME=50" or "ACTION=PAUSE"
+ * @returns 0 on success, -1 on failure or if the session has its own command_pipe
+ */
+int
+cliap2_session_command(struct cliap2_session *session, const char *command)
+{
+  char *line;
+  int ret;
+
+  if (session->command_wfd < 0)
+    return -1;
+
+  // One write per line, so that lines from different threads don't interleave
+  CHECK_NULL(L_MAIN, line = safe_asprintf("%s\n", command));
+  ret = session_write(session, session->command_wfd, line, strlen(line));
+  free(line);
+
+  return ret;
+}
+
+/**
+ * Ask the session to stop. Can be called from any thread, returns right away.
+ */
+void
+cliap2_session_stop(struct cliap2_session *session)
+{
+  pthread_mutex_lock(&session->lck);
+  if (!session->stop_requested && session->wake_wfd >= 0)
+    {
+      // Wakes blocked writers, the byte is never read
+      if (write(session->wake_wfd, "", 1) < 0)
+	DPRINTF(E_LOG, L_MAIN, "Could not wake session writers: %s\n", strerror(errno));
+    }
+  session->stop_requested = true;
+  if (session->stop_ev)
+    event_active(session->stop_ev, 0, 0);
+  pthread_mutex_unlock(&session->lck);
+}
+
+/**
+ * Stop the session if it is running on its own thread, and free it
+ */
+void
+cliap2_session_free(struct cliap2_session *session)
+{
+  if (!session)
+    return;
+
+  if (session->thread_running)
+    {
+      cliap2_session_stop(session);
+      pthread_join(session->tid, NULL);
+      session->thread_running = false;
+    }
+
+  status_cb_set(NULL, NULL);
+  status_fd_set(-1);
+
+  if (session->audio_wfd >= 0)
+    close(session->audio_wfd);
+  if (session->audio_rfd >= 0)
+    close(session->audio_rfd);
+  if (session->command_wfd >= 0)
+    close(session->command_wfd);
+  if (session->command_rfd >= 0)
+    close(session->command_rfd);
+  if (session->wake_wfd >= 0)
+    close(session->wake_wfd);
+  if (session->wake_rfd >= 0)
+    close(session->wake_rfd);
+
+  mass_named_pipes.audio_pipe = "-";
+  mass_named_pipes.metadata_pipe = NULL;
+
+  free(ap2_device_info.auth_key);
+  free(ap2_device_info.password);
+  memset(&ap2_device_info, 0, sizeof(ap2_device_info));
+
+  if (session->txt_kv)
+    keyval_clear(session->txt_kv);
+  free(session->txt_kv);
+  free(session->name);
+  free(session->hostname);
+  free(session->address);
+  free(session->audio_path);
+  free(session->command_path);
+
+  CHECK_ERR(L_MAIN, pthread_mutex_destroy(&session->lck));
+
+  if (session_current == session)
+    session_current = NULL;
+
+  free(session);
+}
@@ -0,0 +1,180 @@
+/*
+ * libcliap2 - stream PCM audio to an AirPlay 2 device from within a process
+ *
+ * Typical use:
+ *
+ *   struct cliap2_params params;
+ *
+ *   cliap2_init(NULL, -1, NULL, false);
+ *   cliap2_params_init(&params);
+ *   params.name = "Kitchen"; ...
+ *   session = cliap2_session_new(&params);
+ *   cliap2_session_status_cb_set(session, my_status_cb, my_ctx);
+ *   cliap2_session_start(session);
+ *   while (...) cliap2_session_push_pcm(session, buf, len);
+ *   cliap2_session_command(session, "ACTION=STOP");
+ *   cliap2_session_free(session);
+ *   cliap2_deinit();
+ *
+ * Only one session can exist per process. Commands use the same "KEY=value"
+ * syntax as the command pipe of the cliap2 CLI.
+ *
+ * The library doesn't change signal dispositions. Only cliap2_session_run()
+ * handles signals, and it writes a trace dump on SIGUSR1. A host that uses
+ * cliap2_session_start() must handle or block SIGUSR1 itself, or the signal
+ * the trace docs tell users to send terminates the process. The cliap2 CLI
+ * blocks it in main().
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __LIBCLIAP2_H__
+#define __LIBCLIAP2_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cliap2_session;
+
+// Parameters of a session, initialise with cliap2_params_init()
+struct cliap2_params
+{
+  // AirPlay 2 device, as advertised over mDNS. All mandatory.
+  const char *name;
+  const char *hostname;
+  const char *address;
+  int port;
+  const char *txt;                // "key=value" "key=value" ...
+
+  // Optional credentials
+  const char *auth_key;
+  const char *password;
+  const char *dacp_id;            // hex string
+
+  // Playback
+  uint64_t ntpstart;              // NTP time of the first sample, 0 to start asap
+  int volume;                     // initial volume 0-100
+  uint64_t latency_ms;            // output buffer, inclusive of the 250ms DAC latency
+  uint64_t pairing_latency_ms;    // anticipated duration of pairing and session setup
+  int64_t input_write_ms;         // margin used to time the first write to the player
+  bool realtime;                  // see --realtime
+
+  // Input. With audio_fd -1, PCM is pushed with cliap2_session_push_pcm().
+  // With command_pipe NULL, commands are sent with cliap2_session_command().
+  int audio_fd;
+  const char *command_pipe;
+
+  // Status events are also written to status_fd as JSON lines (see README),
+  // -1 for none. The fd is made non-blocking and is not closed.
+  int status_fd;
+};
+
+enum cliap2_event
+{
+  // First audio has been handed to the player
+  CLIAP2_EVENT_STARTED,
+  // Playback (re)started from the audio input without a pause
+  CLIAP2_EVENT_RESTARTED,
+  CLIAP2_EVENT_PAUSED,
+  // Playback resumed after a pause
+  CLIAP2_EVENT_RESUMED,
+  CLIAP2_EVENT_STOPPED,
+  // Periodic position report while playing
+  CLIAP2_EVENT_PROGRESS,
+  // The audio input reached end of stream
+  CLIAP2_EVENT_END_OF_STREAM,
+  // Playback has finished and the session is shutting down
+  CLIAP2_EVENT_ENDED,
+  // Periodic latency report while playing, see cliap2_status.latency
+  CLIAP2_EVENT_LATENCY,
+};
+
+// Stages of the path through cliap2 that are timed
+enum cliap2_latency_stage
+{
+  // From reading audio to handing it to the player (held for the start time)
+  CLIAP2_LATENCY_HOLD,
+  // Time spent in the input module write, i.e. waiting for buffer space
+  CLIAP2_LATENCY_INPUT_WRITE,
+  // From reading a command to acting on it
+  CLIAP2_LATENCY_COMMAND,
+  CLIAP2_LATENCY_STAGES,
+};
+
+// Latency of one stage since the previous report, in microseconds
+struct cliap2_latency
+{
+  uint32_t count;
+  uint32_t p50_us;
+  uint32_t p99_us;
+  uint32_t max_us;
+};
+
+struct cliap2_status
+{
+  enum cliap2_event event;
+  uint32_t pos_ms;                // playback position, 0 if not known
+  int volume;                     // -1 if not known
+  // CLIAP2_EVENT_LATENCY only, CLIAP2_LATENCY_STAGES entries, else NULL
+  const struct cliap2_latency *latency;
+};
+
+/*
+ * Called from internal threads. Must return quickly and must not call
+ * cliap2_session_free() or cliap2_deinit().
+ */
+typedef void (*cliap2_status_cb)(const struct cliap2_status *status, void *ctx);
+
+int
+cliap2_init(const char *config_file, int loglevel, const char *logfile, bool prewarm);
+
+void
+cliap2_deinit(void);
+
+int
+cliap2_ntp_now(uint64_t *ntp);
+
+void
+cliap2_params_init(struct cliap2_params *params);
+
+struct cliap2_session *
+cliap2_session_new(const struct cliap2_params *params);
+
+void
+cliap2_session_status_cb_set(struct cliap2_session *session, cliap2_status_cb cb, void *ctx);
+
+int
+cliap2_session_run(struct cliap2_session *session);
+
+int
+cliap2_session_start(struct cliap2_session *session);
+
+int
+cliap2_session_push_pcm(struct cliap2_session *session, const void *buf, size_t len);
+
+int
+cliap2_session_command(struct cliap2_session *session, const char *command);
+
+void
+cliap2_session_stop(struct cliap2_session *session);
+
+void
+cliap2_session_free(struct cliap2_session *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !__LIBCLIAP2_H__ */
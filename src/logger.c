@@ -26,9 +26,13 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <ctype.h> // for isprint()
 
@@ -41,6 +45,22 @@
 
 #define LOGGER_REPEAT_MAX 10
 
+/*
+ * Once initialised, log messages are formatted on the calling thread and
+ * queued on a bounded lock-free ring (Vyukov's MPMC queue, used here with a
+ * single consumer). A writer thread does the timestamp formatting, repeat
+ * suppression and the actual I/O, so that the player, input and mass threads
+ * never block on the log file or on a slow stderr reader. If the ring is full
+ * the message is dropped and counted, and the writer reports the number of
+ * dropped messages. E_FATAL messages wait for the writer to flush them, since
+ * the caller is usually about to exit.
+ */
+#define LOGGER_RING_SIZE    512   // must be a power of two
+#define LOGGER_MSG_SIZE     2048  // same as the direct path, see vlogger_writer()
+#define LOGGER_WAIT_MS      50    // writer poll interval when idle
+#define LOGGER_FLUSH_WAIT   100   // times LOGGER_FLUSH_SLEEP_MS
+#define LOGGER_FLUSH_SLEEP_MS 10
+
 /* We need our own check to avoid nested locking or recursive calls */
 /* Use _exit() instead of abort() because abort() can hang if threads are in a bad state */
 #define LOGGER_CHECK_ERR(f) \
@@ -50,8 +70,39 @@
       _exit(1); \
     } } while(0)
 
+struct logger_record
+{
+  struct timespec ts;
+  int severity;
+  int domain;
+  bool raw;                       // hexdump line, written without a label
+  char thread[32];
+  char msg[LOGGER_MSG_SIZE];
+};
+
+struct logger_cell
+{
+  atomic_size_t seq;
+  struct logger_record rec;
+};
+
+static struct logger_cell logger_ring[LOGGER_RING_SIZE];
+static atomic_size_t logger_enqueue_pos;
+static atomic_size_t logger_dequeue_pos; // only advanced by the writer
+static atomic_uint logger_dropped;
+static atomic_bool logger_reopen;
+static atomic_bool logger_stop;
+static atomic_bool logger_writer_idle;
+static pthread_t logger_tid;
+
+// Only used for the writer's idle wait, never taken by the logging threads
 static pthread_mutex_t logger_lck;
+static pthread_cond_t logger_cond;
 static int logger_initialized;
+
+// Per-thread format buffer and cached "name (tid)" of the calling thread
+static __thread char logger_tls_msg[LOGGER_MSG_SIZE];
+static __thread char logger_tls_thread[32];
 static int logdomains;
 static int threshold;
 static int console = 1;
@@ -157,18 +208,13 @@ logger_write(const char *fmt, ...)
 }
 
 static void
-logger_write_with_label(int severity, int domain, const char *content)
+logger_write_with_label(int severity, int domain, const char *thread_nametid, time_t t, const char *content)
 {
   char stamp[32];
-  char thread_nametid[32];
-  time_t t;
   struct tm timebuf;
   char logfmt_msg[1024];
   int ret;
 
-  thread_getnametid(thread_nametid, sizeof(thread_nametid));
-  t = time(NULL);
-
   if (format == L_FMT_LOGFMT)
     {
       ret = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S%z", localtime_r(&t, &timebuf));
@@ -194,27 +240,62 @@ logger_write_with_label(int severity, int domain, const char *content)
 }
 
 static void
-vlogger_writer(int severity, int domain, const char *fmt, va_list args)
+logger_write_now(int severity, int domain, const char *content)
+{
+  char thread_nametid[32];
+
+  thread_getnametid(thread_nametid, sizeof(thread_nametid));
+
+  logger_write_with_label(severity, domain, thread_nametid, time(NULL), content);
+}
+
+/**
+ * Format a message, truncating it if needed
+ * @returns the length of the formatted message
+ */
+static int
+logger_format(char *content, size_t size, const char *fmt, va_list args)
 {
   va_list ap;
-  char content[2048];
   int ret;
 
   va_copy(ap, args);
-  ret = vsnprintf(content, sizeof(content), fmt, ap);
-  if (ret < 0)
-    strcpy(content, "(LOGGING SKIPPED - error printing log message)\n");
-  else if (ret >= sizeof(content))
-    strcpy(content + sizeof(content) - 8, "...\n");
+  ret = vsnprintf(content, size, fmt, ap);
   va_end(ap);
 
+  if (ret < 0)
+    {
+      strcpy(content, "(LOGGING SKIPPED - error printing log message)\n");
+      return strlen(content);
+    }
+  else if (ret >= size)
+    {
+      strcpy(content + size - 8, "...\n");
+      return size - 4;
+    }
+
+  return ret;
+}
+
+/**
+ * Write a message right away, with repeat suppression. Used before the writer
+ * thread is running, and by the writer thread itself.
+ */
+static void
+vlogger_writer(int severity, int domain, const char *fmt, va_list args)
+{
+  char content[2048];
+  int ret;
+
+  logger_format(content, sizeof(content), fmt, args);
+
   ret = repeat_count(content);
   if (ret == LOGGER_REPEAT_MAX)
     strcpy(content, "(LOGGING SKIPPED - above log message is repeating)\n");
   else if (ret > LOGGER_REPEAT_MAX)
     return;
 
-  logger_write_with_label(severity, domain, content);
+  logger_write_now(severity, domain, content);
 }
 
 static void
@@ -227,13 +308,304 @@ vlogger_fatal(const char *fmt, ...)
   va_end(ap);
 }
 
+/* --------------------------------- RING ----------------------------------- */
+
+static void
+logger_writer_wake(void)
+{
+  // Signalling without the mutex can lose a wakeup, which LOGGER_WAIT_MS bounds
+  if (atomic_load_explicit(&logger_writer_idle, memory_order_acquire))
+    pthread_cond_signal(&logger_cond);
+}
+
+/**
+ * Wait until the writer has written everything up to and including pos
+ */
+static void
+logger_flush_wait(size_t pos)
+{
+  struct timespec ts = { 0, LOGGER_FLUSH_SLEEP_MS * 1000000L };
+  int i;
+
+  if (pthread_equal(pthread_self(), logger_tid))
+    return;
+
+  for (i = 0; i < LOGGER_FLUSH_WAIT && atomic_load_explicit(&logger_dequeue_pos, memory_order_acquire) <= pos; i++)
+    {
+      logger_writer_wake();
+      nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * Queue a message for the writer thread. Never blocks, except for E_FATAL.
+ */
+static void
+logger_enqueue(int severity, int domain, const char *content, size_t len, bool raw)
+{
+  struct logger_cell *cell;
+  size_t pos;
+  size_t seq;
+  intptr_t dif;
+
+  pos = atomic_load_explicit(&logger_enqueue_pos, memory_order_relaxed);
+  for (;;)
+    {
+      cell = &logger_ring[pos & (LOGGER_RING_SIZE - 1)];
+      seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+      dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0)
+	{
+	  if (atomic_compare_exchange_weak_explicit(&logger_enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+	    break;
+	}
+      else if (dif < 0)
+	{
+	  // Full, the writer is behind
+	  atomic_fetch_add_explicit(&logger_dropped, 1, memory_order_relaxed);
+	  return;
+	}
+      else
+	pos = atomic_load_explicit(&logger_enqueue_pos, memory_order_relaxed);
+    }
+
+  if (logger_tls_thread[0] == '\0')
+    thread_getnametid(logger_tls_thread, sizeof(logger_tls_thread));
+
+  clock_gettime(CLOCK_REALTIME, &cell->rec.ts);
+  cell->rec.severity = severity;
+  cell->rec.domain = domain;
+  cell->rec.raw = raw;
+  memcpy(cell->rec.thread, logger_tls_thread, sizeof(cell->rec.thread));
+  if (len >= sizeof(cell->rec.msg))
+    len = sizeof(cell->rec.msg) - 1;
+  memcpy(cell->rec.msg, content, len);
+  cell->rec.msg[len] = '\0';
+
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+  logger_writer_wake();
+
+  if (severity == E_FATAL)
+    logger_flush_wait(pos);
+}
+
+/**
+ * Write out what is queued when called. Records queued meanwhile are left for
+ * the next call, so that busy logging threads can't keep the writer from
+ * stopping. Writer thread only.
+ * @returns the number of records written
+ */
+static int
+logger_drain(void)
+{
+  struct logger_cell *cell;
+  struct logger_record *rec;
+  char dropped_msg[80];
+  unsigned int dropped;
+  size_t pos;
+  size_t end;
+  int count = 0;
+  int ret;
+
+  pos = atomic_load_explicit(&logger_dequeue_pos, memory_order_relaxed);
+  end = atomic_load_explicit(&logger_enqueue_pos, memory_order_relaxed);
+  while (pos != end)
+    {
+      cell = &logger_ring[pos & (LOGGER_RING_SIZE - 1)];
+      if ((intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1) < 0)
+	break;
+
+      rec = &cell->rec;
+
+      dropped = atomic_exchange_explicit(&logger_dropped, 0, memory_order_relaxed);
+      if (dropped > 0)
+	{
+	  snprintf(dropped_msg, sizeof(dropped_msg), "(LOGGING SKIPPED - log buffer full, %u messages dropped)\n", dropped);
+	  logger_write_with_label(E_LOG, L_MISC, rec->thread, rec->ts.tv_sec, dropped_msg);
+	}
+
+      if (rec->raw)
+	logger_write("%s", rec->msg);
+      else
+	{
+	  ret = repeat_count(rec->msg);
+	  if (ret == LOGGER_REPEAT_MAX)
+	    logger_write_with_label(rec->severity, rec->domain, rec->thread, rec->ts.tv_sec, "(LOGGING SKIPPED - above log message is repeating)\n");
+	  else if (ret < LOGGER_REPEAT_MAX)
+	    logger_write_with_label(rec->severity, rec->domain, rec->thread, rec->ts.tv_sec, rec->msg);
+	}
+
+      atomic_store_explicit(&cell->seq, pos + LOGGER_RING_SIZE, memory_order_release);
+      pos++;
+      atomic_store_explicit(&logger_dequeue_pos, pos, memory_order_release);
+      count++;
+    }
+
+  return count;
+}
+
+static void
+logger_logfile_reopen(void)
+{
+  FILE *fp;
+
+  if (!logfile)
+    return;
+
+  fp = fopen(logfilename, "a");
+  if (!fp)
+    {
+      fprintf(logfile, "Could not reopen logfile: %s\n", strerror(errno));
+      return;
+    }
+
+  fclose(logfile);
+  logfile = fp;
+}
+
+static void *
+logger_thread_run(void *arg)
+{
+  struct timespec deadline;
+
+  thread_setname("logger");
+
+  for (;;)
+    {
+      if (atomic_exchange(&logger_reopen, false))
+	logger_logfile_reopen();
+
+      if (atomic_load(&logger_stop))
+	break;
+
+      if (logger_drain() > 0)
+	continue;
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOGGER_WAIT_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+	{
+	  deadline.tv_sec++;
+	  deadline.tv_nsec -= 1000000000L;
+	}
+
+      LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
+      atomic_store_explicit(&logger_writer_idle, true, memory_order_release);
+      pthread_cond_timedwait(&logger_cond, &logger_lck, &deadline);
+      atomic_store_explicit(&logger_writer_idle, false, memory_order_release);
+      LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+    }
+
+  logger_drain();
+
+  pthread_exit(NULL);
+}
+
+// Only while no other thread can log
+static void
+logger_ring_init(void)
+{
+  size_t i;
+
+  for (i = 0; i < LOGGER_RING_SIZE; i++)
+    atomic_init(&logger_ring[i].seq, i);
+  atomic_init(&logger_enqueue_pos, 0);
+  atomic_init(&logger_dequeue_pos, 0);
+  atomic_init(&logger_dropped, 0);
+  atomic_init(&logger_reopen, false);
+}
+
+static int
+logger_thread_start(void)
+{
+  atomic_init(&logger_stop, false);
+  atomic_init(&logger_writer_idle, false);
+
+  LOGGER_CHECK_ERR(mutex_init(&logger_lck));
+  LOGGER_CHECK_ERR(pthread_cond_init(&logger_cond, NULL));
+
+  return pthread_create(&logger_tid, NULL, logger_thread_run, NULL);
+}
+
+static void
+logger_thread_stop(void)
+{
+  atomic_store(&logger_stop, true);
+  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
+  pthread_cond_signal(&logger_cond);
+  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+
+  pthread_join(logger_tid, NULL);
+
+  LOGGER_CHECK_ERR(pthread_cond_destroy(&logger_cond));
+  LOGGER_CHECK_ERR(pthread_mutex_destroy(&logger_lck));
+}
+
+/* The writer thread doesn't survive fork(), see --server. It is stopped before
+ * forking, so no thread is in the middle of writing the log or holds the
+ * writer's mutex while the process is copied. Other threads keep queueing
+ * meanwhile, and the parent and the child each start a new writer.
+ */
+static bool logger_forking;
+
+static void
+logger_atfork_prepare(void)
+{
+  if (!logger_initialized)
+    return;
+
+  logger_thread_stop();
+  logger_forking = true;
+}
+
+static void
+logger_atfork_restart(void)
+{
+  if (!logger_forking)
+    return;
+
+  logger_forking = false;
+
+  // Falls back to writing on the calling thread
+  if (logger_thread_start() != 0)
+    logger_initialized = 0;
+}
+
+static void
+logger_atfork_child(void)
+{
+  // Records of threads that didn't come along would block the ring
+  if (logger_forking)
+    logger_ring_init();
+  logger_tls_thread[0] = '\0';
+
+  logger_atfork_restart();
+}
+
+/* Called by the --server parent, see zygote.c. Not done by logger_init(), so
+ * that a host process of libcliap2 doesn't wait for the log on every fork().
+ */
+void
+logger_atfork_register(void)
+{
+  static bool registered;
+
+  if (registered)
+    return;
+
+  pthread_atfork(logger_atfork_prepare, logger_atfork_restart, logger_atfork_child);
+  registered = true;
+}
+
 static void
 vlogger(int severity, int domain, const char *fmt, va_list args)
 {
+  int len;
 
   if(! logger_initialized)
     {
-      /* lock not initialized, use stderr */
+      /* writer not running, write directly to stderr/logfile */
       vlogger_writer(severity, domain, fmt, args);
       return;
     }
@@ -241,17 +613,12 @@ vlogger(int severity, int domain, const char *fmt, va_list args)
   if (!((1 << domain) & logdomains) || (severity > threshold))
     return;
 
-  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
-
   if (!logfile && !console)
-    {
-      LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
-      return;
-    }
+    return;
 
-  vlogger_writer(severity, domain, fmt, args);
+  len = logger_format(logger_tls_msg, sizeof(logger_tls_msg), fmt, args);
 
-  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+  logger_enqueue(severity, domain, logger_tls_msg, len, false);
 }
 
 static void
@@ -260,26 +627,39 @@ hexdump(int severity, int domain, const unsigned char *data, int len, const char
   int i;
   unsigned char buff[17];
   const unsigned char *pc = data;
+  char line[96];
+  int pos;
 
   if (len <= 0)
     return;
 
-  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
-
-  if (heading)
-    logger_write_with_label(severity, domain, heading);
+  if (!logger_initialized)
+    {
+      if (heading)
+	logger_write_now(severity, domain, heading);
+    }
+  else if (heading)
+    logger_enqueue(severity, domain, heading, strlen(heading), false);
 
+  // Each line is queued as a raw record, so that it is written without a label
+  pos = 0;
   for (i = 0; i < len; i++)
     {
       if ((i % 16) == 0)
 	{
 	  if (i != 0)
-	    logger_write("  %s\n", buff);
+	    {
+	      snprintf(line + pos, sizeof(line) - pos, "  %s\n", buff);
+	      if (logger_initialized)
+		logger_enqueue(severity, domain, line, strlen(line), true);
+	      else
+		logger_write("%s", line);
+	    }
 
-	  logger_write(" %04x ", i);
+	  pos = snprintf(line, sizeof(line), " %04x ", i);
 	}
 
-	logger_write(" %02x", pc[i]);
+	pos += snprintf(line + pos, sizeof(line) - pos, " %02x", pc[i]);
 
 	if (isprint(pc[i]))
 	  buff[i % 16] = pc[i];
@@ -291,13 +671,15 @@ hexdump(int severity, int domain, const unsigned char *data, int len, const char
 
   while ((i % 16) != 0)
     {
-      logger_write("   ");
+      pos += snprintf(line + pos, sizeof(line) - pos, "   ");
       i++;
     }
 
-  logger_write("  %s\n", buff);
-
-  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+  snprintf(line + pos, sizeof(line) - pos, "  %s\n", buff);
+  if (logger_initialized)
+    logger_enqueue(severity, domain, line, strlen(line), true);
+  else
+    logger_write("%s", line);
 }
 
 void
@@ -400,26 +782,18 @@ logger_alsa(const char *file, int line, const char *function, int err, const cha
 void
 logger_reinit(void)
 {
-  FILE *fp;
-
   if (!logfile)
     return;
 
-  LOGGER_CHECK_ERR(pthread_mutex_lock(&logger_lck));
-
-  fp = fopen(logfilename, "a");
-  if (!fp)
+  if (!logger_initialized)
     {
-      fprintf(logfile, "Could not reopen logfile: %s\n", strerror(errno));
-
-      goto out;
+      logger_logfile_reopen();
+      return;
     }
 
-  fclose(logfile);
-  logfile = fp;
-
- out:
-  LOGGER_CHECK_ERR(pthread_mutex_unlock(&logger_lck));
+  // The writer owns the log file, so it does the reopening
+  atomic_store(&logger_reopen, true);
+  logger_writer_wake();
 }
 
 
@@ -475,7 +849,7 @@ logger_init(char *file, char *domains, int severity, char *logformat)
     logdomains = ~0;
 
   if (!file)
-    return 0;
+    goto start;
 
   logfile = fopen(file, "a");
   if (!logfile)
@@ -495,8 +869,15 @@ logger_init(char *file, char *domains, int severity, char *logformat)
 
   logfilename = file;
 
-  /* logging w/o locks before initialized complete */
-  CHECK_ERR(L_MISC, mutex_init(&logger_lck));
+ start:
+  /* logging directly from the calling thread until the writer is running */
+  logger_ring_init();
+  ret = logger_thread_start();
+  if (ret != 0)
+    {
+      fprintf(stderr, "Could not start log writer thread: %s\n", strerror(ret));
+      return 0;
+    }
 
   logger_initialized = 1;
 
@@ -506,17 +887,19 @@ logger_init(char *file, char *domains, int severity, char *logformat)
 void
 logger_deinit(void)
 {
+  if(logger_initialized)
+    {
+      /* writes whatever is still queued, then logging directly to stderr. The
+       * writer must be gone first, since the direct path isn't locked. */
+      logger_thread_stop();
+      logger_initialized = 0;
+    }
+
   if (logfile)
     {
       fclose(logfile);
       logfile = NULL;
     }
 
-  if(logger_initialized)
-    {
-      /* logging w/o locks to stderr now */
-      logger_initialized = 0;
-      console = 1;
-      CHECK_ERR(L_MISC, pthread_mutex_destroy(&logger_lck));
-    }
+  console = 1;
 }
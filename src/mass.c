@@ -54,6 +54,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -61,6 +62,7 @@
 #include <event2/event.h>
 #include <event2/buffer.h>
 
+#include "artcache.h"
 #include "artwork.h"
 #include "cliap2.h"
 #include "commands.h"
@@ -68,30 +70,30 @@
 #include "db.h"
 #include "http.h"
 #include "input.h"
+#include "latency.h"
 #include "limits.h"
 #include "listener.h"
 #include "logger.h"
 #include "mass.h"
+#include "mass_item.h"
 #include "misc.h"
 #include "misc_xml.h"
 #include "player.h"
+#define PROBES_DEFINE
+#include "probes.h"
 #include "worker.h"
 #include "commands.h"
 #include "rtp_common.h"
 #include "mass.h"
+#include "realtime.h"
+#include "stats.h"
+#include "status.h"
+#include "trace.h"
 #include "wrappers.h"
 
-#define MASS_UPDATE_INTERVAL_SEC   1 // every second
-#define MASS_METADATA_KEYVAL_SEP   "="  // Key-value separator in metadata
-#define MASS_METADATA_PROGRESS_KEY "PROGRESS"
-#define MASS_METADATA_VOLUME_KEY   "VOLUME"
-#define MASS_METADATA_ARTWORK_KEY  "ARTWORK"
-#define MASS_METADATA_ALBUM_KEY    "ALBUM"
-#define MASS_METADATA_TITLE_KEY    "TITLE"
-#define MASS_METADATA_ARTIST_KEY   "ARTIST"
-#define MASS_METADATA_DURATION_KEY "DURATION"
-#define MASS_METADATA_ACTION_KEY   "ACTION"
-#define MASS_METADATA_PIN_KEY      "PIN"
+#define MASS_LATENCY_REPORT_SEC    10 // latency report while playing, every 10 seconds
+#define MASS_ARTWORK_TIMEOUT_SEC   10 // artwork that takes longer to fetch is dropped
+#define MASS_BATCH_TIMEOUT_SEC     5  // a batch without COMMIT is committed after this
 
 #define STDIN_FILENAME  "-"
 #define PRIMED_AUDIO_DURATION_MS 4500 // Maximum milliseconds of raw audio to read into input buffer at setup
@@ -101,8 +103,11 @@ extern ap2_device_info_t ap2_device_info;
 extern mass_named_pipes_t mass_named_pipes;
 
  /* mass specific stuff */
-static struct event *mass_timer_event = NULL;
-static struct timeval mass_tv = { MASS_UPDATE_INTERVAL_SEC, 0};
+static struct event *mass_status_event = NULL; // activated by player/volume listener notifications
+static struct event *mass_timer_event = NULL; // progress updates, only pending while playing
+static struct event *mass_batch_event = NULL; // commits a batch whose COMMIT didn't arrive
+static struct timeval mass_tv = { 1, 0 };
+static bool mass_timer_enabled = false;
 // static struct timespec playback_start_ts = {0, 0};
 static struct timespec paused_start_ts = {0, 0};
 static bool player_started = false;
@@ -112,19 +117,52 @@ static pthread_mutex_t audio_command_lock; // for mass_cmd <> mass_aud inter-thr
 static bool pause_flag = false; // we control when to pause and (re)commence reading from the audio pipe
 static bool stop_flag = false; // used to communicate the receipt of a STOP command between mass_cmd and mass_aud threads
 
+// State of play() for the current session, see mass_session_reset()
+struct play_state
+{
+  struct timespec initial_play_ts; // Initial now timespec when play() is first called
+  struct timespec earliest_possible_packet_ts; // Our estimate of the earlist possible time we can commence playback
+  size_t read_count; // Count of read calls made
+  size_t bytes_to_remove; // for when requested playback is too soon to adhere to
+  size_t bytes_removed; // count of bytes removed to adhere to playback commencement time
+  size_t bytes_to_add; // for when we have the luxury of being too early for playback commencement time
+  bool written; // boolean indicator of if we have written any data to the input module
+  size_t bytes_added; // count of bytes added if we have luxury of headroom before playback commencement time
+  struct timespec hold_ts; // when the oldest audio in source->evbuf was read
+};
+
+static struct play_state play_state;
+
+// Artwork is fetched by the worker thread. Each ARTWORK item bumps the generation,
+// which makes fetches of older items stale. Results are handed back to mass_cmd
+// while artwork_accept is set (protected by artwork_lock).
+static atomic_uint artwork_generation;
+static pthread_mutex_t artwork_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool artwork_accept = false;
+
+struct artwork_job
+{
+  unsigned int generation;
+  struct timespec deadline; // CLOCK_MONOTONIC
+  char *url;
+  struct evbuffer *raw;
+  int format;
+};
+
 // Max number of bytes to read from stdin at a time
 #define STDIN_READ_MAX 65536
 // Maximum number of pipes to watch for data
 #define PIPE_MAX_WATCH 4
 // Max number of bytes to read from the audio pipe at a time
 #define PIPE_READ_MAX 65536
-// Max number of bytes to buffer from the command/metadata pipe
-#define PIPE_METADATA_BUFLEN_MAX 1048576
+// Max number of bytes to buffer from the command/metadata pipe, leaves room
+// for an ARTWORK_DATA picture and the items around it
+#define PIPE_METADATA_BUFLEN_MAX 2097152
 // Ignore pictures with larger size than this
 #define PIPE_PICTURE_SIZE_MAX 1048576
-// Where we store pictures for the artwork module to read
-#define PIPE_TMPFILE_TEMPLATE "/tmp/" PACKAGE_NAME ".XXXXXX.ext"
-#define PIPE_TMPFILE_TEMPLATE_EXTLEN 4
+// Item header of artwork sent inline, "ARTWORK_DATA=<jpeg|png> <length>\n"
+// followed by <length> bytes of image
+#define PIPE_ARTWORK_DATA_KEY "ARTWORK_DATA="
 
 struct mass_ctx
 {
@@ -149,8 +187,17 @@ enum pipe_metadata_msg
   PIPE_METADATA_MSG_PAUSE            = (1 << 7),
   PIPE_METADATA_MSG_PLAY             = (1 << 8),
   PIPE_METADATA_MSG_PIN              = (1 << 9),
+  PIPE_METADATA_MSG_BEGIN            = (1 << 10),
+  PIPE_METADATA_MSG_COMMIT           = (1 << 11),
 };
 
+// Actions that act on the player state
+#define PIPE_METADATA_MSG_CONTROL \
+  (PIPE_METADATA_MSG_FLUSH | PIPE_METADATA_MSG_STOP | PIPE_METADATA_MSG_PAUSE | PIPE_METADATA_MSG_PLAY)
+// Items that wait for ACTION=COMMIT in a batch, everything else takes effect right away
+#define PIPE_METADATA_MSG_BATCHED \
+  (PIPE_METADATA_MSG_METADATA | PIPE_METADATA_MSG_PROGRESS | PIPE_METADATA_MSG_PICTURE | PIPE_METADATA_MSG_PARTIAL_METADATA)
+
 struct pipe
 {
   int id;               // The mfi id of the pipe
@@ -163,18 +210,35 @@ struct pipe
   struct pipe *next;
 };
 
-// struct for storing the data received via a metadata/command pipe
-// We will never receive the artwok as a file, it will always be
-// via a URL, which is handled in input_metadata struct.
+struct mass_action_map
+{
+  const char *name;
+  enum pipe_metadata_msg message;
+};
+
+static const struct mass_action_map mass_actions[] =
+{
+  { "SENDMETA", PIPE_METADATA_MSG_METADATA },
+  { "STOP",     PIPE_METADATA_MSG_STOP },
+  { "PAUSE",    PIPE_METADATA_MSG_PAUSE },
+  { "PLAY",     PIPE_METADATA_MSG_PLAY },
+  { "BEGIN",    PIPE_METADATA_MSG_BEGIN },
+  { "COMMIT",   PIPE_METADATA_MSG_COMMIT },
+};
+
 struct pipe_metadata_prepared
 {
   // Progress, artist etc goes here
   struct input_metadata input_metadata;
-  // Picture (artwork) data
-  int pict_tmpfile_fd;
-  char pict_tmpfile_path[sizeof(PIPE_TMPFILE_TEMPLATE)];
+  // Items of the batch being parsed, moved to input_metadata in one go when the
+  // batch is committed. This and the fields below are only used by mass_cmd.
+  struct input_metadata staged;
+  enum pipe_metadata_msg staged_msg;
+  // True between ACTION=BEGIN and ACTION=COMMIT, which can span reads
+  bool batch_open;
   // Volume
   int volume;
+  int volume_applied; // last volume given to the player, -1 if none
   // PIN
   char *pin; // 4 digit PIN
   // Mutex to share the prepared metadata
@@ -217,6 +281,19 @@ static struct pipe *pipe_watch_list;
 // Pipe + extra fields that we start watching for metadata after playback starts
 static struct pipe_metadata pipe_metadata;
 
+// Last player status seen by mass_cmd, so that other threads and the command
+// handlers don't need a synchronous call into the player thread. Written by
+// mass_cmd only, read through a seqlock.
+struct status_snapshot
+{
+  atomic_uint seq;  // odd while being written
+  bool valid;
+  struct player_status status;
+  struct timespec ts; // CLOCK_MONOTONIC of status
+};
+
+static struct status_snapshot status_snapshot;
+
 /* -------------------------------- HELPERS --------------------------------- */
 
 /** Player status is human readable format
@@ -239,6 +316,98 @@ static const char *play_status_str(enum play_status status)
     }
 }
 
+/**
+ * Publish a player status to the snapshot
+ * @param status  status just received from the player
+ * @note  Must only be called from the mass_cmd thread
+ */
+static void
+status_snapshot_publish(const struct player_status *status)
+{
+  unsigned int seq;
+
+  seq = atomic_load_explicit(&status_snapshot.seq, memory_order_relaxed);
+  atomic_store_explicit(&status_snapshot.seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  status_snapshot.status = *status;
+  clock_gettime(CLOCK_MONOTONIC, &status_snapshot.ts);
+  status_snapshot.valid = true;
+
+  atomic_store_explicit(&status_snapshot.seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Read the player status snapshot without blocking. While playing, the
+ * position is extrapolated from the time the snapshot was taken.
+ * @param status  [out] the player status
+ * @returns 0 on success, -1 if no status has been published yet
+ */
+static int
+status_snapshot_get(struct player_status *status)
+{
+  struct timespec ts;
+  struct timespec now;
+  unsigned int seq;
+  bool valid;
+  int64_t elapsed_ms;
+
+  do {
+    seq = atomic_load_explicit(&status_snapshot.seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
+
+    valid = status_snapshot.valid;
+    memcpy(status, &status_snapshot.status, sizeof(struct player_status));
+    ts = status_snapshot.ts;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) || atomic_load_explicit(&status_snapshot.seq, memory_order_relaxed) != seq);
+
+  if (!valid)
+    return -1;
+
+  if (status->status == PLAY_PLAYING) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (int64_t)(now.tv_sec - ts.tv_sec) * 1000 + (now.tv_nsec - ts.tv_nsec) / 1000000;
+    if (elapsed_ms > 0)
+      status->pos_ms += elapsed_ms;
+  }
+
+  return 0;
+}
+
+/**
+ * Forget the published status, e.g. of a previous session
+ * @note  Must only be called while the mass_cmd thread is not running
+ */
+static void
+status_snapshot_reset(void)
+{
+  unsigned int seq;
+
+  seq = atomic_load_explicit(&status_snapshot.seq, memory_order_relaxed);
+  atomic_store_explicit(&status_snapshot.seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  status_snapshot.valid = false;
+
+  atomic_store_explicit(&status_snapshot.seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Get the player status, from the snapshot if there is one, else from the player
+ * @param status  [out] the player status
+ * @returns 0 on success, -1 on failure
+ */
+static int
+status_get(struct player_status *status)
+{
+  if (status_snapshot_get(status) == 0)
+    return 0;
+
+  return player_get_status(status);
+}
+
 /**
  * Create a pipe data structure. Allocates memory for the data structure.
  * @param path  filename path
@@ -457,404 +626,479 @@ pipelist_find(struct pipe *list, int id)
   return NULL;
 }
 
-/** Close a temporary artwork file and remove it
- * @param fd  file descriptor of the temporary artwork file
- * @param path  the pathname of the temporary artwork file
- */
 static void
-pict_tmpfile_close(int fd, const char *path)
+artwork_job_free(struct artwork_job *job)
 {
-  if (fd < 0)
-    return;
-
-  close(fd);
-  unlink(path);
+  if (job->raw)
+    evbuffer_free(job->raw);
+  free(job->url);
+  free(job);
 }
 
-/** Recreates a tmpfile to store metadata artwork in.
- * @param path      pathname of the temporary artwork file
- * @param path_size length of the pathanme
- * @param fd        file descriptor for the tmpfile. If non-negative, then the file will be 
- *                  closed and deleted (using unlink, so path must be valid).
- * @param ext       extension to use for the tmpfile, eg .jpg or .png. Extension cannot 
- *                  be longer than PIPE_TMPFILE_TEMPLATE_EXTLEN.
- * @returns file descriptor of the tmpfile on success, -1 on failure. path will be updated
- *          with the new tmpfile name
+/** Attach artwork to the prepared metadata and tell the player about it
+ * @param raw     the image, ownership is taken
+ * @param format  ART_FMT_* of the image
+ * @note  This function runs in the mass_cmd thread
  */
-static int
-pict_tmpfile_recreate(char *path, size_t path_size, int fd, const char *ext)
+static void
+artwork_attach(struct evbuffer *raw, int format)
 {
-  int offset = strlen(PIPE_TMPFILE_TEMPLATE) - PIPE_TMPFILE_TEMPLATE_EXTLEN;
-
-  if (strlen(ext) > PIPE_TMPFILE_TEMPLATE_EXTLEN)
-    {
-      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid extension provided to pict_tmpfile_recreate: '%s'\n", __func__, ap2_device_info.name, ext);
-      return -1;
-    }
-
-  if (path_size < sizeof(PIPE_TMPFILE_TEMPLATE))
-    {
-      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid path buffer provided to pict_tmpfile_recreate\n", __func__, ap2_device_info.name);
-      return -1;
-    }
+  struct input_metadata *m = &pipe_metadata.prepared.input_metadata;
+  char *url;
 
-  pict_tmpfile_close(fd, path);
+  // The image is handed over as is, the output module gets it by reference
+  url = artwork_mem_add(raw, format);
 
-  strcpy(path, PIPE_TMPFILE_TEMPLATE);
-  strcpy(path + offset, ext);
-
-  fd = mkstemps(path, PIPE_TMPFILE_TEMPLATE_EXTLEN);
+  pthread_mutex_lock(&pipe_metadata.prepared.lock);
+  free(m->artwork_url);
+  m->artwork_url = url;
+  pthread_mutex_unlock(&pipe_metadata.prepared.lock);
 
-  return fd;
+  pipe_metadata.is_new = 1; // Trigger notification to player in playback loop
 }
 
-/** Retrieves artwork from a URL and writes the artwork to a tmpfile.
- * The tmpfile path is stored in prepared->pict_tmpfile_path and can be 
- * used by the output module.
- * The artwork URL is freed and updated to reference the tmpfile 
- * 
- * @param prepared   Prepared metadata struct containing the artwork URL and tmpfile path
- * @return        ART_FMT_* on success, ART_E_NONE or ART_E_ERROR on error
-*/
-static int
-parse_artwork_url(struct pipe_metadata_prepared *prepared)
+/** Attach fetched artwork to the prepared metadata and tell the player about it
+ * @param fd    Not used
+ * @param what  Not used
+ * @param arg   the artwork job, freed here
+ * @note  This function runs in the mass_cmd thread
+ */
+static void
+artwork_ready_cb(evutil_socket_t fd, short what, void *arg)
 {
-  struct input_metadata *m = &prepared->input_metadata;
-  const char *ext;
-  ssize_t ret;
-  int format = ART_E_ERROR;
-  struct evbuffer *raw;
-  size_t artwork_image_size = 0;
-  char *artwork_image = NULL;
+  struct artwork_job *job = arg;
+  struct timespec now;
 
-  CHECK_NULL(L_FIFO, raw = evbuffer_new());
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  format = artwork_read_byurl(raw, m->artwork_url);
-  if (format <= 0) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not read artwork from URL '%s'\n", __func__, ap2_device_info.name, m->artwork_url);
-    goto error;
+  if (job->generation != atomic_load(&artwork_generation)) {
+    DPRINTF(E_DBG, L_FIFO, "%s:%s:Dropping artwork from '%s', superseded by newer artwork\n", __func__, ap2_device_info.name, job->url);
+    goto out;
   }
-
-  artwork_image_size = evbuffer_get_length(raw);
-  artwork_image = malloc(artwork_image_size);
-  if (!artwork_image) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not allocate memory for artwork from URL '%s'\n", __func__, ap2_device_info.name, m->artwork_url);
-    goto error;
+  if (now.tv_sec > job->deadline.tv_sec || (now.tv_sec == job->deadline.tv_sec && now.tv_nsec > job->deadline.tv_nsec)) {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Dropping artwork from '%s', fetch took longer than %d seconds\n",
+      __func__, ap2_device_info.name, job->url, MASS_ARTWORK_TIMEOUT_SEC
+    );
+    goto out;
   }
-  ret = evbuffer_remove(raw, artwork_image, artwork_image_size);
-  if (ret < 0 || (size_t)ret != artwork_image_size) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not extract artwork from evbuffer for URL '%s'\n", __func__, ap2_device_info.name, m->artwork_url);
-    goto error;
+  if (job->format <= 0) {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not read artwork from URL '%s'\n", __func__, ap2_device_info.name, job->url);
+    goto out;
   }
-  evbuffer_free(raw);
-  raw = NULL;
 
-  if (format == ART_FMT_JPEG)
-    ext = ".jpg";
-  else if (format == ART_FMT_PNG)
-    ext = ".png";
-  else {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Unsupported picture format from artwork URL '%s'\n", __func__, ap2_device_info.name, m->artwork_url);
-    goto error;
-  }
+  artwork_attach(job->raw, job->format);
+  job->raw = NULL;
 
-  free(m->artwork_url);
-  m->artwork_url = NULL;
+ out:
+  artwork_job_free(job);
+}
 
-  prepared->pict_tmpfile_fd = pict_tmpfile_recreate(
-    prepared->pict_tmpfile_path, sizeof(prepared->pict_tmpfile_path), prepared->pict_tmpfile_fd, ext
-  );
-  if (prepared->pict_tmpfile_fd < 0) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not open tmpfile for pipe artwork '%s': %s\n",
-      __func__, ap2_device_info.name, prepared->pict_tmpfile_path, strerror(errno)
-    );
-    goto error;
+/** Fetch artwork for the mass_cmd thread
+ * @param arg   the artwork job
+ * @note  This function runs in the worker thread. The fetch blocks it, so the
+ *        request is aborted at the deadline. Cancellation takes effect when
+ *        the fetch returns.
+ */
+static void
+artwork_fetch_cb(void *arg)
+{
+  struct artwork_job *job;
+  struct timespec now;
+  long timeout_ms;
+  int ret = -1;
+
+  // Superseded while queued, don't fetch at all
+  if (((struct artwork_job *)arg)->generation != atomic_load(&artwork_generation)) {
+    free(((struct artwork_job *)arg)->url);
+    return;
   }
 
-  ret = write(prepared->pict_tmpfile_fd, artwork_image, artwork_image_size);
-  if (ret < 0) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Error writing artwork from metadata pipe to '%s': %s\n",
-      __func__, ap2_device_info.name, prepared->pict_tmpfile_path, strerror(errno)
-    );
-    goto error;
+  // arg is freed by the worker when we return
+  job = malloc(sizeof(struct artwork_job));
+  if (!job) {
+    free(((struct artwork_job *)arg)->url);
+    return;
   }
-  else if (ret != artwork_image_size) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Incomplete write of artwork to '%s' (%zd/%ld)\n",
-      __func__, ap2_device_info.name, prepared->pict_tmpfile_path, ret, artwork_image_size
-    );
-    goto error;
+  memcpy(job, arg, sizeof(struct artwork_job));
+
+  job->raw = evbuffer_new();
+  if (job->raw) {
+    // Other sessions have often fetched the same artwork already
+    job->format = artcache_get(job->url, job->raw);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout_ms = (job->deadline.tv_sec - now.tv_sec) * 1000 + (job->deadline.tv_nsec - now.tv_nsec) / 1000000;
+    // Not fetched if the deadline passed while queued, artwork_ready_cb() drops it
+    if (job->format <= 0 && timeout_ms > 0) {
+      job->format = artwork_read_byurl(job->raw, job->url, timeout_ms);
+      if (job->format > 0)
+        artcache_put(job->url, job->raw, job->format);
+    }
   }
 
-  DPRINTF(E_SPAM, L_FIFO, "%s:%s:Wrote pipe artwork to '%s'\n", __func__, ap2_device_info.name, prepared->pict_tmpfile_path);
-
-  m->artwork_url = safe_asprintf("file:%s", prepared->pict_tmpfile_path);
-  free(artwork_image);
-
-  return 0;
+  pthread_mutex_lock(&artwork_lock);
+  if (artwork_accept)
+    ret = event_base_once(evbase_command_pipe, -1, EV_TIMEOUT, artwork_ready_cb, job, NULL);
+  pthread_mutex_unlock(&artwork_lock);
 
- error:
-  if (m->artwork_url) free(m->artwork_url);
-  m->artwork_url = NULL;
-  if (raw) evbuffer_free(raw);
-  if (artwork_image) free(artwork_image);
-  return -1;
+  if (ret < 0)
+    artwork_job_free(job);
 }
 
-/** Extract key and value from an input string and allocate memory.
- * e.g. key=value
- * @param input_string  string containing `=` delimited key and value
- * @param key           key is returned after memory allocated for it
- * @param value         value is returned after memory allocated for it.
- * @note The delimiter between the key and value is '='
- * @note  The consumer of the key and value must free the allocated memory once consumed.
+/** Start fetching artwork in the background, superseding any fetch in progress
+ * @param url  the artwork URL
+ * @returns 0 on success, -1 on failure
  */
-static
-void extract_key_value(const char *input_string, char **key, char **value) 
+static int
+artwork_fetch(const char *url)
 {
-    char *delimiter_pos = strchr(input_string, '='); // Find the '=' delimiter
-
-    if (delimiter_pos == NULL) {
-        // Handle cases where the delimiter is not found
-        *key = NULL;
-        *value = NULL;
-        return;
-    }
-
-    // Calculate lengths
-    size_t key_len = delimiter_pos - input_string;
-    size_t value_len = strlen(delimiter_pos + 1);
-
-    // Allocate memory for key and value
-    *key = (char *)malloc(key_len + 1);
-    *value = (char *)malloc(value_len + 1);
-
-    if (*key == NULL || *value == NULL) {
-        // Handle memory allocation failure
-        free(*key); // Free if one was allocated
-        free(*value);
-        *key = NULL;
-        *value = NULL;
-        return;
-    }
+  struct artwork_job job;
+
+  memset(&job, 0, sizeof(job));
+  job.generation = atomic_fetch_add(&artwork_generation, 1) + 1;
+  clock_gettime(CLOCK_MONOTONIC, &job.deadline);
+  job.deadline.tv_sec += MASS_ARTWORK_TIMEOUT_SEC;
+  job.format = ART_E_ERROR;
+  job.url = strdup(url);
+  if (!job.url)
+    return -1;
 
-    // Copy the key
-    strncpy(*key, input_string, key_len);
-    (*key)[key_len] = '\0'; // Null-terminate the key
+  worker_execute(artwork_fetch_cb, &job, sizeof(job), 0);
 
-    // Copy the value
-    strcpy(*value, delimiter_pos + 1); // Copy from after the delimiter
+  return 0;
 }
 
 /** Parse one metadata/command item from Music Assistant
  * @param out_msg   the type of metadata or command received is returned in out_msg
- * @param prepared  updated metadata information is returned in prepared 
- * @param item      the metadata or command item received from Music Assistant to be parsed
- * @note  prepared is a shared with the input thread and this function exists within a mutex lock.
- *        This means we must not do anything that could cause a deadlock (e.g. make a sync call to the player thread).
- * @note  Memory is allocated for various metadata attributes such as album, artist etc. The consumer of these attributes
- *        is responsible for freeing the allocated memory.
+ * @param prepared  updated metadata information is staged in prepared->staged
+ * @param item      the metadata or command item received from Music Assistant to be parsed, NUL terminated
+ * @param len       length of the item
+ * @note  Only touches the parts of prepared that are private to mass_cmd, so no lock is needed.
+ * @note  item is not copied, except for the values that are handed on in prepared (album, artist etc).
+ *        The consumer of these attributes is responsible for freeing the allocated memory.
  */
 static int
-parse_mass_item(enum pipe_metadata_msg *out_msg, struct pipe_metadata_prepared *prepared, const char *item)
+parse_mass_item(enum pipe_metadata_msg *out_msg, struct pipe_metadata_prepared *prepared, const char *item, size_t len)
 {
   enum pipe_metadata_msg message;
-  int ret;
-  char *key, *value = NULL;
+  enum mass_key key;
+  const char *value;
+  const char *sep;
   int duration_sec = 0;
   int progress_sec = 0;
+  int64_t value_num = 0;
+  uint32_t pin;
+  int ret;
+  int i;
 
-  extract_key_value(item, &key, &value);
-  if (!key || !value) {
-      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid key-value pair in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, item);
-      if (key) free(key);
-      if (value) free(value);
-      return -1;
+  sep = memchr(item, MASS_ITEM_KEYVAL_SEP, len);
+  if (!sep) {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid key-value pair in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, item);
+    return -1;
   }
+  value = sep + 1;
 
-  DPRINTF(E_SPAM, L_FIFO, "%s:%s:Parsed Music Assistant metadata key='%s' value='%s'\n", __func__, ap2_device_info.name, key, value);
+  DPRINTF(E_SPAM, L_FIFO, "%s:%s:Parsed Music Assistant metadata key='%.*s' value='%s'\n", __func__, ap2_device_info.name, (int)(sep - item), item, value);
 
-  if (!strncmp(key,MASS_METADATA_ALBUM_KEY, strlen(MASS_METADATA_ALBUM_KEY))) {
-      message = PIPE_METADATA_MSG_PARTIAL_METADATA;
-      prepared->input_metadata.album = value; // The consumer must free value
-      free(key);
-  }
-  else if (!strncmp(key,MASS_METADATA_ARTIST_KEY, strlen(MASS_METADATA_ARTIST_KEY))) {
-      message = PIPE_METADATA_MSG_PARTIAL_METADATA;
-      prepared->input_metadata.artist = value; // The consumer must free value
-      free(key);
-  }
-  else if (!strncmp(key,MASS_METADATA_TITLE_KEY, strlen(MASS_METADATA_TITLE_KEY))) {
-      message = PIPE_METADATA_MSG_PARTIAL_METADATA;
-      prepared->input_metadata.title = value; // The consumer must free value
-      free(key);
-  }
-  else if (!strncmp(key,MASS_METADATA_DURATION_KEY, strlen(MASS_METADATA_DURATION_KEY))) {
-      message = PIPE_METADATA_MSG_PARTIAL_METADATA;
-      ret = safe_atoi32(value, &duration_sec);
-      if (ret < 0) {
-          DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid duration value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
-          free(key);
-          free(value);
-          return -1;
-      }
-      prepared->input_metadata.len_ms = duration_sec * 1000;
-      free(key);
-      free(value);
-  }
-  else if (!strncmp(key,MASS_METADATA_PROGRESS_KEY, strlen(MASS_METADATA_PROGRESS_KEY))) {
-      message = PIPE_METADATA_MSG_PROGRESS;
-      ret = safe_atoi32(value, &progress_sec);
-      if (ret < 0) {
-          DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid progress value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
-          free(key);
-          free(value);
-          return -1;
-      }
-      prepared->input_metadata.pos_ms = progress_sec * 1000;
-      prepared->input_metadata.pos_is_updated = true;
-      DPRINTF(E_DBG, L_FIFO, "%s:%s:Progress metadata value of %s s received and processed as %d ms.\n", 
-        __func__, ap2_device_info.name, value, prepared->input_metadata.pos_ms
-      );
-      free(key);
-      free(value);
-  }
-  else if (!strncmp(key,MASS_METADATA_ARTWORK_KEY, strlen(MASS_METADATA_ARTWORK_KEY))) {
-      message = PIPE_METADATA_MSG_PARTIAL_METADATA;
-      prepared->input_metadata.artwork_url = value; // The consumer must free value
-      free(key);
-      ret = parse_artwork_url(prepared);
-      if (ret < 0) {
-          DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid artwork URL in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
-          return -1;
-      }
-      message = PIPE_METADATA_MSG_PICTURE;
+  // Keys must match exactly, e.g. TITLEX is not TITLE
+  ret = mass_item_key(&key, item, sep - item);
+  if (ret < 0) {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Unknown key in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, item);
+    return -1;
   }
-  else if (!strncmp(key,MASS_METADATA_VOLUME_KEY, strlen(MASS_METADATA_VOLUME_KEY))) {
+
+  switch (key) {
+  case MASS_KEY_ALBUM:
+    message = PIPE_METADATA_MSG_PARTIAL_METADATA;
+    free(prepared->staged.album);
+    prepared->staged.album = strdup(value); // The consumer must free
+    break;
+  case MASS_KEY_ARTIST:
+    message = PIPE_METADATA_MSG_PARTIAL_METADATA;
+    free(prepared->staged.artist);
+    prepared->staged.artist = strdup(value); // The consumer must free
+    break;
+  case MASS_KEY_TITLE:
+    message = PIPE_METADATA_MSG_PARTIAL_METADATA;
+    free(prepared->staged.title);
+    prepared->staged.title = strdup(value); // The consumer must free
+    break;
+  case MASS_KEY_DURATION:
+    message = PIPE_METADATA_MSG_PARTIAL_METADATA;
+    ret = safe_atoi32(value, &duration_sec);
+    if (ret < 0) {
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid duration value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
+      return -1;
+    }
+    prepared->staged.len_ms = duration_sec * 1000;
+    break;
+  case MASS_KEY_PROGRESS:
+    message = PIPE_METADATA_MSG_PROGRESS;
+    ret = safe_atoi32(value, &progress_sec);
+    if (ret < 0) {
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid progress value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
+      return -1;
+    }
+    prepared->staged.pos_ms = progress_sec * 1000;
+    prepared->staged.pos_is_updated = true;
+    DPRINTF(E_DBG, L_FIFO, "%s:%s:Progress metadata value of %s s received and processed as %d ms.\n", 
+      __func__, ap2_device_info.name, value, prepared->staged.pos_ms
+    );
+    break;
+  case MASS_KEY_ARTWORK:
+    // The text metadata doesn't wait for the artwork, which is attached when it has been fetched
+    message = PIPE_METADATA_MSG_PARTIAL_METADATA;
+    if (!ap2_device_info.wants_artwork) {
+      DPRINTF(E_SPAM, L_FIFO, "%s:%s:Device has no display for artwork, not fetching '%s'\n", __func__, ap2_device_info.name, value);
+      break;
+    }
+    ret = artwork_fetch(value);
+    if (ret < 0) {
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not queue artwork fetch for '%s'\n", __func__, ap2_device_info.name, value);
+      return -1;
+    }
+    break;
+  case MASS_KEY_VOLUME:
     message = PIPE_METADATA_MSG_VOLUME;
     ret = safe_atoi32(value, &prepared->volume);
     if (ret < 0) {
-        DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid volume value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
-        free(key);
-        free(value);
-        return -1;
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid volume value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
+      return -1;
     }
-    free(key);
-    free(value);
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Parsed Music Assistant volume: %d\n", __func__, ap2_device_info.name, prepared->volume);
-  }
-  else if (!strncmp(key,MASS_METADATA_PIN_KEY, strlen(MASS_METADATA_PIN_KEY))) {
+    break;
+  case MASS_KEY_PIN:
     message = PIPE_METADATA_MSG_PIN;
-    uint32_t pin;
     ret = safe_atou32(value, &pin);
-    if (ret < 0 || ret > 9999) { // PIN's limited to 4 digits
-        DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid PIN value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
-        free(key);
-        free(value);
-        return -1;
+    if (ret < 0 || pin > 9999) { // PIN's limited to 4 digits
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid PIN value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
+      return -1;
     }
+    free(prepared->pin);
     ret = asprintf(&prepared->pin, "%.4u", pin);
-    free(key);
-    free(value);
+    if (ret < 0) {
+      prepared->pin = NULL;
+      return -1;
+    }
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Parsed Music Assistant PIN: %.4s\n", __func__, ap2_device_info.name, prepared->pin);
-  }
-  else if (!strncmp(key,MASS_METADATA_ACTION_KEY, strlen(MASS_METADATA_ACTION_KEY))) {
-      if (strncmp(value, "SENDMETA", strlen("SENDMETA")) == 0) {
-         message = PIPE_METADATA_MSG_METADATA;
-         free(key);
-         free(value);
-      }
-      else if (strncmp(value, "STOP", strlen("STOP")) == 0) {
-         message = PIPE_METADATA_MSG_STOP;
-         free(key);
-         free(value);
-      }
-      else if (strncmp(value, "PAUSE", strlen("PAUSE")) == 0) {
-         message = PIPE_METADATA_MSG_PAUSE;
-         free(key);
-         free(value);
-      }
-      else if (strncmp(value, "PLAY", strlen("PLAY")) == 0) {
-         message = PIPE_METADATA_MSG_PLAY;
-         free(key);
-         free(value);
-      }
-      else {
-          DPRINTF(E_LOG, L_FIFO, "%s:%s:Unsupported action value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
-          free(key);
-          free(value);
-          return -1;
-      }
-  }
-  else {
-      DPRINTF(E_LOG, L_FIFO, "%s:%s:Unknown key in Music Assistant metadata: '%s=%s'\n", __func__, ap2_device_info.name, key, value);
-      free(key);
-      free(value);
+    break;
+  case MASS_KEY_ACTION:
+    for (i = 0; i < ARRAY_SIZE(mass_actions); i++) {
+      if (strcmp(value, mass_actions[i].name) == 0)
+        break;
+    }
+    if (i == ARRAY_SIZE(mass_actions)) {
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Unsupported action value in Music Assistant metadata: '%s'\n", __func__, ap2_device_info.name, value);
       return -1;
+    }
+    message = mass_actions[i].message;
+    break;
+  default:
+    return -1;
   }
+
+  if (message == PIPE_METADATA_MSG_VOLUME)
+    value_num = prepared->volume;
+  else if (message == PIPE_METADATA_MSG_PROGRESS)
+    value_num = prepared->staged.pos_ms;
+  trace_event(TRACE_CMD_ITEM, message, value_num, 0);
+  stats_add(STATS_COMMAND_ITEMS, 1);
+  CLIAP2_PROBE3(cmd_item, message, value_num, probe_now_ns());
+
   *out_msg = message;
   return 0;
 }
 
-/** Extract one metadata/command item from the event buffer and allocate memory for it
- * @param evbuf theevent buffer to extract the item from
- * @returns     the extracted item, or NULL if unable to extract an item
- * @note  Music Assistant terminates commands/metadata items with a newline. The newline
- *        is stripped from the item upon extraction
- * @note  The consumer of the item is responsible to free the allocated memory upon consumption.
+/** Parse the header of an inline artwork item, "ARTWORK_DATA=<jpeg|png> <length>"
+ * @param format  [out] ART_FMT_* of the image
+ * @param size    [out] number of bytes of image following the header line
+ * @param item    the header line, NUL terminated
+ * @param len     length of the header line
+ * @returns 1 if item is an inline artwork header, 0 if it is some other item, -1 if the header is invalid
  */
-static char *
-extract_item(struct evbuffer *evbuf)
+static int
+artwork_data_header(int *format, size_t *size, const char *item, size_t len)
 {
-  struct evbuffer_ptr evptr;
-  size_t size;
-  char *item;
+  const char *value;
+  const char *sep;
+  uint32_t n;
 
-  evptr = evbuffer_search(evbuf, "\n", strlen("\n"), NULL);
-  if (evptr.pos < 0)
-    return NULL;
+  if (len < strlen(PIPE_ARTWORK_DATA_KEY) || memcmp(item, PIPE_ARTWORK_DATA_KEY, strlen(PIPE_ARTWORK_DATA_KEY)) != 0)
+    return 0;
 
-  size = evptr.pos + strlen("\n") + 1;
-  item = malloc(size);
-  if (!item)
-    return NULL;
+  value = item + strlen(PIPE_ARTWORK_DATA_KEY);
+  sep = strchr(value, ' ');
+  if (!sep || safe_atou32(sep + 1, &n) < 0 || n == 0 || n > PIPE_PICTURE_SIZE_MAX) {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Invalid inline artwork header '%s'\n", __func__, ap2_device_info.name, item);
+    return -1;
+  }
 
-  evbuffer_remove(evbuf, item, size - 1);
-  item[size - 2] = '\0'; // Replace newline with null terminator
+  if ((sep - value == 4 && strncmp(value, "jpeg", 4) == 0) || (sep - value == 3 && strncmp(value, "jpg", 3) == 0))
+    *format = ART_FMT_JPEG;
+  else if (sep - value == 3 && strncmp(value, "png", 3) == 0)
+    *format = ART_FMT_PNG;
+  else {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Unsupported inline artwork format in '%s'\n", __func__, ap2_device_info.name, item);
+    return -1;
+  }
 
-  return item;
+  *size = n;
+  return 1;
 }
 
-/** Parses the metadata/command content of an event buffer
- * @param out_msg   Bitmask describing all the item types found during parsing.
- *                  e.g. PIPE_METADATA_MSG_VOLUME & PIPE_METADATA_MSG_METADATA
- * @param prepared  Prepares the structure with validated metadata
- * @param evbuf     The event buffer to parse
- * @note  The prepared strucutre contains pointers to allocated memory for the metadata attributes. The end consumer
- *        of these attributes is responsible for freeing the allocated memory.
- * @note  prepared is a shared with the input thread and this function exists within a mutex lock.
- *        This means we must not do anything that could cause a deadlock (e.g. make a sync call to the player thread).
+/** Take the image of an inline artwork item out of the event buffer
+ * @param evbuf   positioned at the first byte of the image, which must be complete
+ * @param format  ART_FMT_* of the image
+ * @param size    number of bytes of image
+ * @note  Supersedes any ARTWORK URL that is still being fetched. Like fetched
+ *        artwork, it isn't staged with the batch but attached right away.
  */
 static int
-pipe_metadata_parse(enum pipe_metadata_msg *out_msg, struct pipe_metadata_prepared *prepared, struct evbuffer *evbuf)
+artwork_data_take(struct evbuffer *evbuf, int format, size_t size)
+{
+  struct evbuffer *raw;
+
+  if (!ap2_device_info.wants_artwork) {
+    DPRINTF(E_SPAM, L_FIFO, "%s:%s:Device has no display for artwork, discarding inline artwork\n", __func__, ap2_device_info.name);
+    evbuffer_drain(evbuf, size);
+    return 0;
+  }
+
+  atomic_fetch_add(&artwork_generation, 1);
+
+  // Moves the chains of evbuf where possible, so the image is not copied
+  raw = evbuffer_new();
+  if (!raw || evbuffer_remove_buffer(evbuf, raw, size) != (int)size) {
+    DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not take %zu bytes of inline artwork\n", __func__, ap2_device_info.name, size);
+    if (raw)
+      evbuffer_free(raw);
+    return -1;
+  }
+
+  DPRINTF(E_SPAM, L_FIFO, "%s:%s:Received %zu bytes of inline artwork\n", __func__, ap2_device_info.name, size);
+
+  artwork_attach(raw, format);
+
+  return 0;
+}
+
+/** Parses the metadata/command content of an event buffer into the current batch
+ * @param prepared  The items are staged in prepared, and the bitmask of all the item types found
+ *                  is added to prepared->staged_msg, e.g. PIPE_METADATA_MSG_VOLUME | PIPE_METADATA_MSG_METADATA
+ * @param evbuf     The event buffer to parse
+ * @note  Repeated items within a batch coalesce, i.e. only the last VOLUME, PROGRESS etc is kept.
+ * @note  Does not touch anything shared with the input thread, see pipe_metadata_commit().
+ * @note  Items that can't be parsed are logged, counted in STATS_COMMAND_ERRORS and skipped.
+ */
+static void
+pipe_metadata_parse(struct pipe_metadata_prepared *prepared, struct evbuffer *evbuf)
 {
   enum pipe_metadata_msg message;
   char *item;
+  size_t len;
+  size_t size;
+  int format;
   int ret;
 
-  *out_msg = 0;
-  while ((item = extract_item(evbuf))) {
+  while ((item = mass_item_next(evbuf, &len))) {
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Parsed pipe metadata item: '%s'\n", __func__, ap2_device_info.name, item);
-    ret = parse_mass_item(&message, prepared, item);
-    free(item);
+
+    // Inline artwork is binary, the image after the header is not tokenized
+    ret = artwork_data_header(&format, &size, item, len);
+    if (ret > 0) {
+      if (evbuffer_get_length(evbuf) < len + 1 + size) {
+        item[len] = '\n'; // Restore, so the header is found again when the rest of the image has arrived
+        break;
+      }
+      evbuffer_drain(evbuf, len + 1);
+      message = PIPE_METADATA_MSG_PARTIAL_METADATA;
+      ret = artwork_data_take(evbuf, format, size);
+    }
+    else if (ret == 0) {
+      ret = parse_mass_item(&message, prepared, item, len);
+      evbuffer_drain(evbuf, len + 1);
+    }
+    else
+      evbuffer_drain(evbuf, len + 1);
+
+    // One bad item, e.g. an unknown key or a trailing \r, must not cost us the
+    // command channel, so it is skipped
     if (ret < 0) {
-      DPRINTF(E_LOG, L_FIFO, "%s:%s:parse_mass_item() failed to parse Music Assistant metadata item\n", __func__, ap2_device_info.name);
-      return -1;
+      stats_add(STATS_COMMAND_ERRORS, 1);
+      DPRINTF(E_LOG, L_FIFO, "%s:%s:Skipping Music Assistant metadata item that could not be parsed\n", __func__, ap2_device_info.name);
+      continue;
     }
 
-      *out_msg |= message;
+    if (message == PIPE_METADATA_MSG_BEGIN) {
+      if (prepared->batch_open)
+        DPRINTF(E_WARN, L_FIFO, "%s:%s:BEGIN received while a batch is already open, ignoring\n", __func__, ap2_device_info.name);
+      prepared->batch_open = true;
+    }
+    else if (message == PIPE_METADATA_MSG_COMMIT)
+      prepared->batch_open = false;
+    else
+      prepared->staged_msg |= message;
   }
+}
 
-  return 0;
+/** Moves a staged string to the metadata handed to the input thread
+ * @param dst  the string in prepared->input_metadata
+ * @param src  the staged string, NULL if not received in the batch
+ */
+static void
+metadata_str_move(char **dst, char **src)
+{
+  if (!*src)
+    return;
+
+  free(*dst);
+  *dst = *src;
+  *src = NULL;
+}
+
+/** Commit the current batch, so that the input thread sees all of its metadata fields at once
+ * @param prepared  prepared metadata with the staged batch
+ * @returns         bitmask of the item types in the batch
+ */
+static enum pipe_metadata_msg
+pipe_metadata_commit(struct pipe_metadata_prepared *prepared)
+{
+  struct input_metadata *m = &prepared->input_metadata;
+  struct input_metadata *staged = &prepared->staged;
+  enum pipe_metadata_msg message;
+
+  pthread_mutex_lock(&prepared->lock);
+
+  metadata_str_move(&m->album, &staged->album);
+  metadata_str_move(&m->artist, &staged->artist);
+  metadata_str_move(&m->title, &staged->title);
+  if (staged->len_ms)
+    m->len_ms = staged->len_ms;
+  if (staged->pos_is_updated) {
+    m->pos_ms = staged->pos_ms;
+    m->pos_is_updated = true;
+  }
+
+  pthread_mutex_unlock(&prepared->lock);
+
+  memset(staged, 0, sizeof(struct input_metadata));
+  message = prepared->staged_msg;
+  prepared->staged_msg = 0;
+
+  return message;
+}
+
+/** Drop a batch that will not be committed
+ * @param prepared  prepared metadata with the staged batch
+ */
+static void
+pipe_metadata_discard(struct pipe_metadata_prepared *prepared)
+{
+  free(prepared->staged.album);
+  free(prepared->staged.artist);
+  free(prepared->staged.title);
+  memset(&prepared->staged, 0, sizeof(struct input_metadata));
+  prepared->staged_msg = 0;
+  prepared->batch_open = false;
 }
 
 
@@ -883,7 +1127,12 @@ pipe_read_cb(evutil_socket_t fd, short event, void *arg)
     DPRINTF(E_DBG, L_FIFO, "%s:%s:Initialised global pipe_id to %d\n", __func__, ap2_device_info.name, pipe_id);
   }
 
-  ret = player_get_status(&status);
+  // The snapshot is enough to tell that we are already playing, which is the
+  // common case. Anything else is confirmed with the player, since the snapshot
+  // lags behind a playback start we just requested.
+  ret = status_snapshot_get(&status);
+  if (ret < 0 || status.id != pipe->id)
+    ret = player_get_status(&status);
   if (status.id == pipe->id) {
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Pipe '%s' already playing with status %s\n",
       __func__, ap2_device_info.name, pipe->path, play_status_str(status.status)
@@ -911,6 +1160,7 @@ pipe_read_cb(evutil_socket_t fd, short event, void *arg)
 
   /* Music Assistant looks for "restarting w/o pause" */
   DPRINTF(E_INFO, L_FIFO, "%s:%s: restarting w/o pause\n", __func__, ap2_device_info.name);
+  status_emit(CLIAP2_EVENT_RESTARTED, 0, -1);
 
 }
 
@@ -983,7 +1233,10 @@ pipe_watch_update(void *arg, int *retval)
 	          if (ret < 0)
 	            DPRINTF(E_LOG, L_FIFO, "%s:%s: Failed to start playback for stdin\n", __func__, ap2_device_info.name);
 	          else
-	            DPRINTF(E_INFO, L_FIFO, "%s:%s: restarting w/o pause\n", __func__, ap2_device_info.name);
+	            {
+	              DPRINTF(E_INFO, L_FIFO, "%s:%s: restarting w/o pause\n", __func__, ap2_device_info.name);
+	              status_emit(CLIAP2_EVENT_RESTARTED, 0, -1);
+	            }
 	        }
 	    }
 	  else
@@ -1010,6 +1263,7 @@ pipe_thread_run(void *arg)
 
   thread_setname("mass_aud");
   thread_getnametid(my_thread, sizeof(my_thread));
+  realtime_thread_apply(REALTIME_CLASS_AUDIO);
   event_base_dispatch(evbase_audio_pipe);
 
   pthread_exit(NULL);
@@ -1133,39 +1387,94 @@ pipe_listener_cb(short event_mask, void *ctx)
 /*                      Thread: mass_cmd                                           */
 
 /**
- * Callback function to report player status to Music Assistant
- * @param fd    File descriptor not used
- * @param what  Not used
- * @param arg   Not used
+ * Report the latency of the stages timed since the previous report
  */
 static void
-mass_timer_cb(int fd, short what, void *arg)
+mass_latency_report(void)
+{
+  struct cliap2_latency latency[CLIAP2_LATENCY_STAGES];
+  int i;
+
+  latency_report(latency);
+
+  for (i = 0; i < CLIAP2_LATENCY_STAGES; i++) {
+    DPRINTF(E_DBG, L_FIFO, "%s:%s:latency %s: count:%" PRIu32 " p50:%" PRIu32 " us p99:%" PRIu32 " us max:%" PRIu32 " us\n",
+      __func__, ap2_device_info.name, latency_stage_name(i), latency[i].count, latency[i].p50_us, latency[i].p99_us, latency[i].max_us
+    );
+  }
+
+  status_emit_latency(latency);
+}
+
+/**
+ * Start or stop the periodic progress updates, which are only sent while playing
+ */
+static void
+mass_timer_set(bool playing)
+{
+  if (!mass_timer_enabled)
+    return;
+
+  if (playing && !evtimer_pending(mass_timer_event, NULL))
+    evtimer_add(mass_timer_event, &mass_tv);
+  else if (!playing && evtimer_pending(mass_timer_event, NULL))
+    evtimer_del(mass_timer_event);
+}
+
+/**
+ * Get the player status and report state transitions to Music Assistant
+ * @param tick  true when called from the progress timer
+ */
+static void
+mass_status_update(bool tick)
 {
+  static struct timespec latency_report_ts = {0, 0};
   struct timespec now;
   uint64_t elapsed_ms = 0;
   uint64_t begin_ms, now_ms = 0;
   struct player_status status;
   int ret;
 
-  ret = player_get_status(&status);
+  // Progress ticks only need the extrapolated position, a notification means
+  // the player state changed and the snapshot must be refreshed
+  if (tick)
+    ret = status_get(&status);
+  else {
+    ret = player_get_status(&status);
+    if (ret == 0)
+      status_snapshot_publish(&status);
+  }
   if (ret < 0) {
     DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not get player status\n", __func__, ap2_device_info.name);
     return;
   }
 
   DPRINTF(E_SPAM, L_FIFO,
-    "%s:%s: player status:%s, volume:%d, pos_ms:%" PRIu32 "\n", 
-    __func__, ap2_device_info.name, play_status_str(status.status), status.volume, status.pos_ms
+    "%s:%s: player status:%s, volume:%d, pos_ms:%" PRIu32 ", tick:%d\n", 
+    __func__, ap2_device_info.name, play_status_str(status.status), status.volume, status.pos_ms, tick
   );
+  trace_event(TRACE_PLAYER_STATUS, status.status, status.pos_ms, status.volume);
+
+  mass_timer_set(status.status == PLAY_PLAYING);
 
   if (status.status == PLAY_PLAYING) {
     if (!player_started) {
       player_started = true;
+      clock_gettime(CLOCK_MONOTONIC, &latency_report_ts);
     }
+    player_paused = false;
     DPRINTF(E_SPAM, L_FIFO, 
       "%s:%s: volume:%d state:%s, position:%" PRIu32 " ms. \n",
       __func__, ap2_device_info.name, status.volume, play_status_str(status.status), status.pos_ms
     );
+    // Also sent on notifications, so that seeks and volume changes are reported right away
+    status_emit(CLIAP2_EVENT_PROGRESS, status.pos_ms, status.volume);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - latency_report_ts.tv_sec >= MASS_LATENCY_REPORT_SEC) {
+      latency_report_ts = now;
+      mass_latency_report();
+    }
   }
   else if (player_started && status.status == PLAY_PAUSED) {
     if (!player_paused) {
@@ -1175,6 +1484,7 @@ mass_timer_cb(int fd, short what, void *arg)
       DPRINTF(E_INFO, L_FIFO, "%s:%s:Pause at %" PRIu32 " ms\n",
         __func__, ap2_device_info.name, status.pos_ms
       );
+      status_emit(CLIAP2_EVENT_PAUSED, status.pos_ms, status.volume);
     }
     else {
       clock_gettime(CLOCK_REALTIME, &now);
@@ -1190,7 +1500,7 @@ mass_timer_cb(int fd, short what, void *arg)
   }
   else if (player_started && status.status == PLAY_STOPPED) {
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Time to exit gracefully\n", __func__, ap2_device_info.name);
-    exit(0);
+    session_end();
   }
   else { // this state can happen when audio has not yet been received on the named pipe
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Player %sstarted. status:%s\n", __func__, ap2_device_info.name,
@@ -1203,6 +1513,68 @@ mass_timer_cb(int fd, short what, void *arg)
   }
 }
 
+/**
+ * Callback of mass_batch_event, a batch was opened with ACTION=BEGIN but no
+ * ACTION=COMMIT followed. The batch is committed, so that a lost COMMIT only
+ * delays the metadata.
+ * @param fd    File descriptor not used
+ * @param what  Not used
+ * @param arg   Not used
+ */
+static void
+mass_batch_timeout_cb(int fd, short what, void *arg)
+{
+  enum pipe_metadata_msg message;
+
+  if (!pipe_metadata.prepared.batch_open)
+    return;
+
+  DPRINTF(E_WARN, L_FIFO, "%s:%s:No COMMIT within %d seconds of BEGIN, committing the open batch\n",
+    __func__, ap2_device_info.name, MASS_BATCH_TIMEOUT_SEC
+  );
+
+  pipe_metadata.prepared.batch_open = false;
+  message = pipe_metadata_commit(&pipe_metadata.prepared);
+  if (message & (PIPE_METADATA_MSG_METADATA | PIPE_METADATA_MSG_PICTURE))
+    pipe_metadata.is_new = 1; // Trigger notification to player in playback loop
+}
+
+/**
+ * Callback of the progress timer
+ * @param fd    File descriptor not used
+ * @param what  Not used
+ * @param arg   Not used
+ */
+static void
+mass_timer_cb(int fd, short what, void *arg)
+{
+  mass_status_update(true);
+}
+
+/**
+ * Callback of mass_status_event, i.e. a player or volume notification
+ * @param fd    File descriptor not used
+ * @param what  Not used
+ * @param arg   Not used
+ */
+static void
+mass_status_cb(int fd, short what, void *arg)
+{
+  mass_status_update(false);
+}
+
+/**
+ * Listener callback for player and volume changes
+ * @note  This runs in the thread that made the change, usually the player thread,
+ *        so it must not call player_get_status() itself. Several notifications
+ *        before mass_cmd gets to run result in a single status update.
+ */
+static void
+mass_player_listener_cb(short event_mask, void *ctx)
+{
+  event_active(mass_status_event, 0, 0);
+}
+
 /**
  * Sets the stop flag
  * @note  This function runs in the mass_cmd thread and shares the stop flag with the
@@ -1260,8 +1632,7 @@ pipe_metadata_watch_del(void *arg)
   pipe_free(pipe_metadata.pipe);
   pipe_metadata.pipe = NULL;
 
-  pict_tmpfile_close(pipe_metadata.prepared.pict_tmpfile_fd, pipe_metadata.prepared.pict_tmpfile_path);
-  pipe_metadata.prepared.pict_tmpfile_fd = -1;
+  pipe_metadata_discard(&pipe_metadata.prepared);
 }
 
 /**
@@ -1297,6 +1668,7 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
   enum pipe_metadata_msg message;
   size_t len;
   struct player_status status;
+  struct timespec read_ts;
   int ret;
 
   ret = evbuffer_read(pipe_metadata.evbuf, pipe_metadata.pipe->fd, PIPE_READ_MAX);
@@ -1315,7 +1687,11 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
       goto readd;
     }
 
+  latency_start(&read_ts);
+
   len = evbuffer_get_length(pipe_metadata.evbuf);
+  trace_event(TRACE_CMD_READ, ret, len, 0);
+  CLIAP2_PROBE3(cmd_read, ret, len, probe_now_ns());
   if (len > PIPE_METADATA_BUFLEN_MAX)
     {
       DPRINTF(E_LOG, L_FIFO, "%s:%s:Buffer for command pipe '%s' is full, discarding %zu bytes\n", __func__, ap2_device_info.name, pipe_metadata.pipe->path, len);
@@ -1325,26 +1701,49 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
   
   DPRINTF(E_SPAM, L_FIFO, "%s:%s:Received %zu bytes of metadata\n", __func__, ap2_device_info.name, len);
 
-  // .parsed is shared with the input thread (see metadata_get), so use mutex.
-  // Note that this means _parse() must not do anything that could cause a
-  // deadlock (e.g. make a sync call to the player thread).
-  pthread_mutex_lock(&pipe_metadata.prepared.lock);
-  ret = pipe_metadata_parse(&message, &pipe_metadata.prepared, pipe_metadata.evbuf);
-  pthread_mutex_unlock(&pipe_metadata.prepared.lock);
-  if (ret < 0) {
-    DPRINTF(E_LOG, L_FIFO, "%s:%s:Error parsing incoming data on command pipe '%s', will stop reading\n",
-      __func__, ap2_device_info.name, pipe_metadata.pipe->path
+  // Parsing only stages the items, the input thread sees them when the batch is
+  // committed (see metadata_get), so the lock isn't held while parsing.
+  pipe_metadata_parse(&pipe_metadata.prepared, pipe_metadata.evbuf);
+
+  // A batch is a read, or everything between ACTION=BEGIN and ACTION=COMMIT.
+  // Only metadata waits for the COMMIT, commands and volume are not held back.
+  if (pipe_metadata.prepared.batch_open) {
+    message = pipe_metadata.prepared.staged_msg & ~PIPE_METADATA_MSG_BATCHED;
+    pipe_metadata.prepared.staged_msg &= PIPE_METADATA_MSG_BATCHED;
+    DPRINTF(E_SPAM, L_FIFO, "%s:%s:Batch open, waiting for COMMIT (message mask so far: 0x%x)\n",
+      __func__, ap2_device_info.name, pipe_metadata.prepared.staged_msg
     );
-    pipe_metadata_watch_del(NULL);
-    return;
+    if (!evtimer_pending(mass_batch_event, NULL)) {
+      struct timeval tv = { MASS_BATCH_TIMEOUT_SEC, 0 };
+      evtimer_add(mass_batch_event, &tv);
+    }
+    if (!message)
+      goto readd;
+  }
+  else {
+    evtimer_del(mass_batch_event);
+    message = pipe_metadata_commit(&pipe_metadata.prepared);
   }
 
   DPRINTF(E_SPAM, L_FIFO, "%s:%s:Parsed command pipe message mask: 0x%x\n", __func__, ap2_device_info.name, message);
 
-  ret = player_get_status(&status);
-  if (ret != COMMAND_END) {
+  // Control actions are judged against the player's current state, as the
+  // snapshot lags behind state changes until their notification has run
+  if (message & PIPE_METADATA_MSG_CONTROL) {
+    ret = player_get_status(&status);
+    if (ret == 0)
+      status_snapshot_publish(&status);
+  }
+  else
+    ret = status_get(&status);
+  if (ret < 0) {
     DPRINTF(E_LOG, L_FIFO, "%s:%s: Unable to obtain player status\n", __func__, ap2_device_info.name);
+    // Act on the commands as if stopped rather than on stack garbage
+    memset(&status, 0, sizeof(status));
+    status.status = PLAY_STOPPED;
   }
+  trace_event(TRACE_CMD_DISPATCH, message, status.status, status.pos_ms);
+  CLIAP2_PROBE2(cmd_dispatch, message, probe_now_ns());
   if (message & (PIPE_METADATA_MSG_METADATA | PIPE_METADATA_MSG_PICTURE)) {
     pipe_metadata.is_new = 1; // Trigger notification to player in playback loop
     DPRINTF(E_SPAM, L_FIFO, 
@@ -1352,8 +1751,12 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
       __func__, ap2_device_info.name, message
     );
   }
-  if (message & PIPE_METADATA_MSG_VOLUME) {
+  // Only the last volume of the batch was kept, and it needs no RTSP request if it is unchanged
+  if ((message & PIPE_METADATA_MSG_VOLUME) && pipe_metadata.prepared.volume != pipe_metadata.prepared.volume_applied) {
+    pipe_metadata.prepared.volume_applied = pipe_metadata.prepared.volume;
     DPRINTF(E_SPAM, L_FIFO, "%s:Setting volume from command pipe to %d\n", __func__, pipe_metadata.prepared.volume);
+    CLIAP2_PROBE2(volume_set, pipe_metadata.prepared.volume, probe_now_ns());
+    stats_gauge_set(STATS_VOLUME, pipe_metadata.prepared.volume);
     player_volume_set(pipe_metadata.prepared.volume);
   }
   if (message & PIPE_METADATA_MSG_PIN) {
@@ -1361,6 +1764,7 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
     strncpy(ap2_device_info.pin, pipe_metadata.prepared.pin, sizeof(ap2_device_info.pin) - 1);
     mass_speaker_authorize();
     free(pipe_metadata.prepared.pin);
+    pipe_metadata.prepared.pin = NULL;
 
   }
   if (message & PIPE_METADATA_MSG_FLUSH) {
@@ -1380,6 +1784,7 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
       self_pause();
       // Report status to Music Assistant
       DPRINTF(E_INFO, L_FIFO, "%s:%s:Pause at %" PRIu32 "\n", __func__, ap2_device_info.name, status.pos_ms);
+      status_emit(CLIAP2_EVENT_PAUSED, status.pos_ms, status.volume);
     }
     else {
       DPRINTF(E_WARN, L_FIFO, "%s:%s:Command received to PAUSE playback, but current state is %s. Ignoring command.\n",
@@ -1396,6 +1801,7 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
       self_resume();
       // Report status to Music Assistant. MA looks for "Restarted at"
       DPRINTF(E_INFO, L_FIFO, "%s:%s:Restarted at %" PRIu32 "\n", __func__, ap2_device_info.name, status.pos_ms);
+      status_emit(CLIAP2_EVENT_RESUMED, status.pos_ms, status.volume);
     }
     else {
       DPRINTF(E_WARN, L_FIFO, "%s:%s:Command received to PLAY, but current state is %s. Ignoring command.\n",
@@ -1409,8 +1815,11 @@ pipe_metadata_read_cb(evutil_socket_t fd, short event, void *arg)
     input_flush(NULL); // we don't care about losing data for the input_buffer on stop.
     // Report status to Music Assistant
     DPRINTF(E_INFO, L_FIFO, "%s:%s:Stop at %" PRIu32 "\n", __func__, ap2_device_info.name, status.pos_ms);
+    status_emit(CLIAP2_EVENT_STOPPED, status.pos_ms, status.volume);
   }
 
+  latency_record(CLIAP2_LATENCY_COMMAND, &read_ts);
+
  readd:
   if (pipe_metadata.pipe && pipe_metadata.pipe->ev) {
     DPRINTF(E_SPAM, L_FIFO, "%s:%s:Re-adding event for command pipe '%s'\n", __func__, ap2_device_info.name, pipe_metadata.pipe->path);
@@ -1463,10 +1872,10 @@ command_pipe_thread_run(void *arg)
 
   thread_setname("mass_cmd");
   thread_getnametid(my_thread, sizeof(my_thread));
+  realtime_thread_apply(REALTIME_CLASS_CONTROL);
   pipe_metadata_watch_add(mass_named_pipes.metadata_pipe);
-  // Create a persistent event timer to monitor and report playback status for logging and debugging purposes
-  mass_timer_event = event_new(evbase_command_pipe, -1, EV_PERSIST | EV_TIMEOUT, mass_timer_cb, NULL);
-  evtimer_add(mass_timer_event, &mass_tv);
+  // Pick up a state that was reached before the listener was added
+  event_active(mass_status_event, 0, 0);
   event_base_dispatch(evbase_command_pipe);
 
   pthread_exit(NULL);
@@ -1478,15 +1887,27 @@ command_pipe_thread_run(void *arg)
 static void
 command_pipe_thread_stop(void)
 {
-  // int ret; 
-
   if (!tid_command_pipe)
     return;
 
-  pipe_metadata_watch_del(NULL);
+  listener_remove(mass_player_listener_cb);
+
+  // Drop artwork that is still being fetched
+  pthread_mutex_lock(&artwork_lock);
+  artwork_accept = false;
+  atomic_fetch_add(&artwork_generation, 1);
+  pthread_mutex_unlock(&artwork_lock);
 
+  // mass_cmd may still be in a callback, e.g. the one that ended the session,
+  // so nothing on its base can be freed until it has returned
   event_base_loopbreak(evbase_command_pipe);
+  if (!pthread_equal(tid_command_pipe, pthread_self()))
+    pthread_join(tid_command_pipe, NULL);
+
+  pipe_metadata_watch_del(NULL);
+  event_free(mass_status_event);
   event_free(mass_timer_event);
+  event_free(mass_batch_event);
   event_base_free(evbase_command_pipe);
   tid_command_pipe = 0;
 }
@@ -1601,14 +2022,7 @@ play(struct input_source *source)
   int ret, bytes_read;
   struct timespec now_ts; // current time
   struct timespec output_buffer_latency_ts; // combination of player output buffer and the inherence DAC latency of device
-  static struct timespec initial_play_ts; // Initial now timespec when play() is first called
-  static struct timespec earliest_possible_packet_ts; // Our estimate of the earlist possible time we can commence playback
-  static size_t read_count = 0; // Count of read calls made
-  static size_t bytes_to_remove = 0; // for when requested playback is too soon to adhere to
-  static size_t bytes_removed = 0; // count of bytes removed to adhere to playback commencement time
-  static size_t bytes_to_add = 0; // for when we have the luxury of being too early for playback commencement time
-  static bool written = false; // boolean indicator of if we have written any data to the input module
-  static size_t bytes_added = 0; // count of bytes added if we have luxury of headroom before playback commencement time
+  struct timespec write_ts;
 
   pthread_mutex_lock(&audio_command_lock);
   if (pause_flag) {
@@ -1617,6 +2031,8 @@ play(struct input_source *source)
     return 0; // loop
   }
   if (stop_flag) {
+    trace_event(TRACE_AUDIO_EOF, TRACE_EOF_STOP, 0, 0);
+    CLIAP2_PROBE2(audio_eof, TRACE_EOF_STOP, probe_now_ns());
     input_write(source->evbuf, NULL, INPUT_FLAG_EOF);
     stop(source);
     pthread_mutex_unlock(&audio_command_lock);
@@ -1627,17 +2043,24 @@ play(struct input_source *source)
 
   bytes_read = evbuffer_read(source->evbuf, ctx->pipe->fd, STDIN_READ_MAX); // read from the audio named pipe
   if (bytes_read == 0) {
+    trace_event(TRACE_AUDIO_EOF, TRACE_EOF_END, 0, 0);
+    CLIAP2_PROBE2(audio_eof, TRACE_EOF_END, probe_now_ns());
     input_write(source->evbuf, NULL, INPUT_FLAG_EOF); // Autostop
     stop(source);
     // MA looks for "end of stream reached"
     DPRINTF(E_INFO, L_FIFO, "%s:%s:end of stream reached\n", __func__, ap2_device_info.name);
+    status_emit(CLIAP2_EVENT_END_OF_STREAM, 0, -1);
     return -1;
   }
   else if ((bytes_read < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+    if (play_state.written)
+      stats_add(STATS_READ_STARVED, 1);
     input_wait();
     return 0; // Loop
   }
   else if (bytes_read < 0) {
+    trace_event(TRACE_AUDIO_EOF, TRACE_EOF_ERROR, errno, 0);
+    CLIAP2_PROBE2(audio_eof, TRACE_EOF_ERROR, probe_now_ns());
     DPRINTF(E_LOG, L_FIFO, "%s:%s:Could not read from pipe '%s' with fd %d: %s\n",
       __func__, ap2_device_info.name, source->path, ctx->pipe->fd, strerror(errno)
   );
@@ -1647,11 +2070,21 @@ play(struct input_source *source)
   }
 
   // Update Music Assistant that playback is commencing. MA looks for "Starting at"
-  if (read_count == 0) {
+  if (play_state.read_count == 0) {
     DPRINTF(E_INFO, L_FIFO, "%s:%s:Starting at 0ms\n", __func__, ap2_device_info.name);
+    status_emit(CLIAP2_EVENT_STARTED, 0, -1);
   }
 
-  read_count++;
+  // Time the oldest data in the buffer, which is what we read now if the buffer was empty
+  if (evbuffer_get_length(source->evbuf) == (size_t)bytes_read)
+    latency_start(&play_state.hold_ts);
+
+  play_state.read_count++;
+  stats_add(STATS_BYTES_INGESTED, bytes_read);
+  stats_add(STATS_AUDIO_READS, 1);
+  stats_gauge_set(STATS_SOURCE_BUFFERED, evbuffer_get_length(source->evbuf));
+  trace_event(TRACE_AUDIO_READ, bytes_read, evbuffer_get_length(source->evbuf), play_state.read_count);
+  CLIAP2_PROBE3(stdin_read, bytes_read, evbuffer_get_length(source->evbuf), probe_now_ns());
 
   flags = (pipe_metadata.is_new ? INPUT_FLAG_METADATA : 0);
   pipe_metadata.is_new = 0;
@@ -1663,8 +2096,8 @@ play(struct input_source *source)
   // the input buffer, we cannot be sure of the rate at which we can read more audio - it might
   // be constrained to align with the rate of playback. In which case, we cannot build up a data 
   // buffer
-  if (read_count == 1 && ap2_device_info.start_ts.tv_sec != 0) {
-    ret = clock_gettime(CLOCK_MONOTONIC,&initial_play_ts);
+  if (play_state.read_count == 1 && ap2_device_info.start_ts.tv_sec != 0) {
+    ret = clock_gettime(CLOCK_MONOTONIC,&play_state.initial_play_ts);
     if (ret < 0) {
       DPRINTF(E_LOG, L_FIFO, "%s:%s:Error obtaining initial_play_ts timespec. %s\n", __func__, ap2_device_info.name, strerror(errno));
       return -1;
@@ -1684,7 +2117,7 @@ play(struct input_source *source)
       DPRINTF(E_SPAM, L_FIFO, "%s:%s:We already have sufficient audio data to satisfy the output buffer requirements.\n",
         __func__, ap2_device_info.name
       );
-      earliest_possible_packet_ts = timespec_add(initial_play_ts, ap2_device_info.pairing_latency_ts);
+      play_state.earliest_possible_packet_ts = timespec_add(play_state.initial_play_ts, ap2_device_info.pairing_latency_ts);
     }
     else {
       DPRINTF(E_SPAM, L_FIFO, "%s:%s:We need to consider the output buffer requirements when "
@@ -1692,83 +2125,85 @@ play(struct input_source *source)
         __func__, ap2_device_info.name
       );
       get_output_buffer_ts(&output_buffer_latency_ts);
-      earliest_possible_packet_ts = timespec_add(initial_play_ts, output_buffer_latency_ts);
-      earliest_possible_packet_ts = timespec_add(earliest_possible_packet_ts, ap2_device_info.pairing_latency_ts);
+      play_state.earliest_possible_packet_ts = timespec_add(play_state.initial_play_ts, output_buffer_latency_ts);
+      play_state.earliest_possible_packet_ts = timespec_add(play_state.earliest_possible_packet_ts, ap2_device_info.pairing_latency_ts);
     }
 
-    if (timespec_cmp(earliest_possible_packet_ts, ap2_device_info.start_ts) > 0) {
+    if (timespec_cmp(play_state.earliest_possible_packet_ts, ap2_device_info.start_ts) > 0) {
       // Determine how much data we need to ignore
       uint64_t samples_to_remove = 0;
       uint64_t nsec_to_remove = 0;
-      struct timespec duration_to_remove = timespec_sub(earliest_possible_packet_ts, ap2_device_info.start_ts);
+      struct timespec duration_to_remove = timespec_sub(play_state.earliest_possible_packet_ts, ap2_device_info.start_ts);
       nsec_to_remove = duration_to_remove.tv_sec * 1e9 + duration_to_remove.tv_nsec;
       samples_to_remove = source->quality.sample_rate * nsec_to_remove / 1e9;
-      bytes_to_remove = (size_t)STOB(samples_to_remove, source->quality.bits_per_sample, source->quality.channels);
+      play_state.bytes_to_remove = (size_t)STOB(samples_to_remove, source->quality.bits_per_sample, source->quality.channels);
       DPRINTF(E_WARN, L_FIFO, 
         "%s:%s:Audio data received too late to play on time. Attempting to ignore %ld.%09ld secs, %" PRIu64 " samples, %zu bytes\n",
-        __func__, ap2_device_info.name, duration_to_remove.tv_sec, duration_to_remove.tv_nsec, samples_to_remove, bytes_to_remove
+        __func__, ap2_device_info.name, duration_to_remove.tv_sec, duration_to_remove.tv_nsec, samples_to_remove, play_state.bytes_to_remove
       );
     }
-    else if (timespec_cmp(earliest_possible_packet_ts, ap2_device_info.start_ts) < 0) {
+    else if (timespec_cmp(play_state.earliest_possible_packet_ts, ap2_device_info.start_ts) < 0) {
       // We might have spare time before playback required. If we are using realtime RTP
       // then we can't send the audio too early, else we risk non-adherence to the start_ts or
       // no audio, but we can use the excess time to keep building the source evbuffer
       // However, we cannot assume what the read rate will be, so ultimately we must check the
       // current time against the start_ts value to determine when to call input_write()
       struct timespec early_ts; // timespec for how early we are
-      early_ts = timespec_sub(ap2_device_info.start_ts, earliest_possible_packet_ts);
-      bytes_to_add = early_ts.tv_sec * STOB(source->quality.sample_rate, source->quality.bits_per_sample, source->quality.channels);
-      bytes_to_add += early_ts.tv_nsec * STOB(source->quality.sample_rate, source->quality.bits_per_sample, source->quality.channels) / 1e9;
+      early_ts = timespec_sub(ap2_device_info.start_ts, play_state.earliest_possible_packet_ts);
+      play_state.bytes_to_add = early_ts.tv_sec * STOB(source->quality.sample_rate, source->quality.bits_per_sample, source->quality.channels);
+      play_state.bytes_to_add += early_ts.tv_nsec * STOB(source->quality.sample_rate, source->quality.bits_per_sample, source->quality.channels) / 1e9;
       DPRINTF(E_DBG, L_FIFO, "%s:%s:We have early headroom of %ld.%09ld seconds, equating to %zu bytes.\n", __func__, ap2_device_info.name,
-        early_ts.tv_sec, early_ts.tv_nsec, bytes_to_add
+        early_ts.tv_sec, early_ts.tv_nsec, play_state.bytes_to_add
       );
     }
   }
 
-  if (written == false && ap2_device_info.start_ts.tv_sec != 0) {
+  if (play_state.written == false && ap2_device_info.start_ts.tv_sec != 0) {
     // This block of code is executed on each call to play() until such time as we have met the
     // requirement to commence playback.
     DPRINTF(E_SPAM, L_FIFO, 
       "%s:%s:bytes_read (this read):%d, bytes_to_remove:%zu, bytes_removed:%zu, bytes_to_add:%zu, bytes_added:%zu, "
       "evbuffer: length:%zu, duration:%.3f\n",
-      __func__, ap2_device_info.name, bytes_read, bytes_to_remove, bytes_removed, bytes_to_add, bytes_added, evbuffer_get_length(source->evbuf),
+      __func__, ap2_device_info.name, bytes_read, play_state.bytes_to_remove, play_state.bytes_removed, play_state.bytes_to_add, play_state.bytes_added, evbuffer_get_length(source->evbuf),
       (double)evbuffer_get_length(source->evbuf) / (double)STOB(source->quality.sample_rate, source->quality.bits_per_sample, source->quality.channels)
     );
-    if (bytes_to_remove > 0 && bytes_to_remove > bytes_removed) {
+    if (play_state.bytes_to_remove > 0 && play_state.bytes_to_remove > play_state.bytes_removed) {
       // We have audio data that is too early to be played on time and need to ignore it
       size_t buflen = evbuffer_get_length(source->evbuf);
-      if ((bytes_to_remove - bytes_removed) > buflen) {
+      if ((play_state.bytes_to_remove - play_state.bytes_removed) > buflen) {
         if (evbuffer_drain(source->evbuf, buflen) < 0) {
           DPRINTF(E_LOG, L_FIFO, "%s:%s:Error draining %zu bytes from source evbuffer. %s\n",
             __func__, ap2_device_info.name, buflen, strerror(errno)
           );
           return -1;
         }
-        bytes_removed += buflen;
+        play_state.bytes_removed += buflen;
+        trace_event(TRACE_AUDIO_DRAIN, buflen, play_state.bytes_removed, play_state.bytes_to_remove);
         return 0; // We have no data to write yet, so return
       }
       else {
-        if (evbuffer_drain(source->evbuf, bytes_to_remove - bytes_removed) < 0) {
+        if (evbuffer_drain(source->evbuf, play_state.bytes_to_remove - play_state.bytes_removed) < 0) {
           DPRINTF(E_LOG, L_FIFO, "%s:%s:Error draining %zu bytes from source evbuffer. %s\n",
-            __func__, ap2_device_info.name, bytes_to_remove - bytes_removed, strerror(errno)
+            __func__, ap2_device_info.name, play_state.bytes_to_remove - play_state.bytes_removed, strerror(errno)
           );
           return -1;
         }
-        bytes_removed += (bytes_to_remove - bytes_removed);
+        trace_event(TRACE_AUDIO_DRAIN, play_state.bytes_to_remove - play_state.bytes_removed, play_state.bytes_to_remove, play_state.bytes_to_remove);
+        play_state.bytes_removed += (play_state.bytes_to_remove - play_state.bytes_removed);
         if (evbuffer_get_length(source->evbuf) == 0) {
           // bytes_to_remove was exactly the bytes in the evbuffer, so it is now empty
           return 0;
         }
       }
       DPRINTF(E_DBG, L_FIFO, "%s:%s:bytes_removed=%zu, bytes_to_remove = %zu\n",
-        __func__, ap2_device_info.name, bytes_removed, bytes_to_remove
+        __func__, ap2_device_info.name, play_state.bytes_removed, play_state.bytes_to_remove
       );
 
       // Finally, adjust the start time to reflect actual audio we now have
-      ap2_device_info.start_ts = earliest_possible_packet_ts;
+      ap2_device_info.start_ts = play_state.earliest_possible_packet_ts;
     }
     else {
-      bytes_added += bytes_read;
+      play_state.bytes_added += bytes_read;
       // We are on the verge of calling input_write() for the first time, but let's check to ensure we are
       // not going to call it too early and issue a warning if we are too late
       ret = clock_gettime(CLOCK_MONOTONIC,&now_ts);
@@ -1781,11 +2216,13 @@ play(struct input_source *source)
       DPRINTF(E_SPAM, L_FIFO, "%s:%s delta_ms = %" PRId64 " ms, latency_ms=%" PRIu64 " ms, delta_ts=%ld.%09ld\n", __func__, 
         ap2_device_info.name, delta_ms, ap2_device_info.latency_ms, delta_ts.tv_sec, delta_ts.tv_nsec
       );
+      trace_event(TRACE_AUDIO_WAIT, delta_ms, ap2_device_info.latency_ms + ap2_device_info.input_write_ms, 0);
       if (delta_ms > (ap2_device_info.latency_ms + ap2_device_info.input_write_ms)) {
         input_wait();
         return 0;
       }
       else if (delta_ms < ap2_device_info.latency_ms) {
+        stats_add(STATS_LATE_STARTS, 1);
         DPRINTF(E_WARN, L_FIFO, "%s:%s is late to commence playback. Sync or playback is unlikely. delta_ms = %" PRId64 " ms.\n",
           __func__, ap2_device_info.name, delta_ms
         );
@@ -1796,8 +2233,17 @@ play(struct input_source *source)
     flags |= INPUT_FLAG_SYNC;
   }
 
+  trace_event(TRACE_INPUT_WRITE, evbuffer_get_length(source->evbuf), flags, 0);
+  CLIAP2_PROBE3(input_write, evbuffer_get_length(source->evbuf), flags, probe_now_ns());
+  latency_record(CLIAP2_LATENCY_HOLD, &play_state.hold_ts);
+  latency_start(&write_ts);
   input_write(source->evbuf, &source->quality, flags);
-  written = true;
+  latency_record(CLIAP2_LATENCY_INPUT_WRITE, &write_ts);
+  stats_add(STATS_INPUT_WRITES, 1);
+  stats_gauge_set(STATS_SOURCE_BUFFERED, evbuffer_get_length(source->evbuf));
+  if (!play_state.written)
+    startup_phase_mark("first input_write");
+  play_state.written = true;
 
   return 0;
 }
@@ -1823,6 +2269,8 @@ metadata_get(struct input_metadata *metadata, struct input_source *source)
 
   pthread_mutex_unlock(&pipe_metadata.prepared.lock);
 
+  CLIAP2_PROBE3(metadata_push, metadata->len_ms, metadata->pos_ms, probe_now_ns());
+
   return 0;
 }
 
@@ -1850,9 +2298,27 @@ ts_get(struct timespec *ts, struct input_source *source)
 static int
 command_pipe_init(void)
 {
+  int interval_ms;
   int ret;
 
   evbase_command_pipe = event_base_new();
+
+  // Player state changes are pushed to us, the timer only sends progress updates while playing
+  interval_ms = cfg_getint(cfg_getsec(cfg, "mass"), "progress_interval_ms");
+  mass_timer_enabled = (interval_ms > 0);
+  if (mass_timer_enabled) {
+    mass_tv.tv_sec = interval_ms / 1000;
+    mass_tv.tv_usec = (interval_ms % 1000) * 1000;
+  }
+  mass_status_event = event_new(evbase_command_pipe, -1, 0, mass_status_cb, NULL);
+  mass_timer_event = event_new(evbase_command_pipe, -1, EV_PERSIST | EV_TIMEOUT, mass_timer_cb, NULL);
+  mass_batch_event = evtimer_new(evbase_command_pipe, mass_batch_timeout_cb, NULL);
+  CHECK_ERR(L_FIFO, listener_add(mass_player_listener_cb, LISTENER_PLAYER | LISTENER_VOLUME, NULL));
+
+  pthread_mutex_lock(&artwork_lock);
+  artwork_accept = true;
+  pthread_mutex_unlock(&artwork_lock);
+
   ret = pthread_create(&tid_command_pipe, NULL, command_pipe_thread_run, NULL);
   if (ret !=0) {
     DPRINTF(E_LOG, L_FIFO, "%s:%s:Unable to create command thread. %s\n", __func__, ap2_device_info.name, strerror(errno));
@@ -1871,6 +2337,25 @@ command_pipe_deinit()
   command_pipe_thread_stop();
 }
 
+/**
+ * Reset the state that is kept per session. The library can run one session
+ * after another in the same process, and each must start like the first.
+ */
+static void
+mass_session_reset(void)
+{
+  player_started = false;
+  player_paused = false;
+  paused_start_ts.tv_sec = 0;
+  paused_start_ts.tv_nsec = 0;
+  pause_flag = false;
+  stop_flag = false;
+  pipe_metadata.is_new = 0;
+
+  memset(&play_state, 0, sizeof(struct play_state));
+  status_snapshot_reset();
+}
+
 /**
  * Initialise the mass (Music Assistant) module.
  * @returns 0 on success, -1 on failure
@@ -1885,10 +2370,12 @@ mass_init(void)
   // audio is streamed to the named pipe. Currently, device connection is initiatied on receipt of data on the 
   // audio named pipe.
 
-  CHECK_ERR(L_FIFO, mutex_init(&pipe_metadata.prepared.lock));
-  CHECK_ERR(L_FIFO, mutex_init(&audio_command_lock));
+  // Priority inheritance in realtime mode, as both are taken by mass_aud/input and mass_cmd
+  CHECK_ERR(L_FIFO, realtime_mutex_init(&pipe_metadata.prepared.lock));
+  CHECK_ERR(L_FIFO, realtime_mutex_init(&audio_command_lock));
 
-  pipe_metadata.prepared.pict_tmpfile_fd = -1;
+  mass_session_reset();
+  pipe_metadata.prepared.volume_applied = -1;
 
   pipe_listener_cb(0, NULL); // We will be in the pipe thread once this returns
   CHECK_ERR(L_FIFO, listener_add(pipe_listener_cb, LISTENER_DATABASE, NULL));
@@ -1909,6 +2396,10 @@ mass_init(void)
     return -1;
   }
   
+  artcache_init(cfg_getstr(cfg_getsec(cfg, "mass"), "artwork_cache_dir"),
+    (size_t)cfg_getint(cfg_getsec(cfg, "mass"), "artwork_cache_size_mb") * 1024 * 1024
+  );
+
   command_pipe_init();
 
   return 0;
@@ -1924,6 +2415,8 @@ mass_deinit(void)
 
   listener_remove(pipe_listener_cb);
   pipe_thread_stop();
+  artcache_deinit();
+  artwork_mem_clear();
 
   CHECK_ERR(L_FIFO, pthread_mutex_destroy(&pipe_metadata.prepared.lock));
   CHECK_ERR(L_FIFO, pthread_mutex_destroy(&audio_command_lock));
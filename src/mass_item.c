@@ -0,0 +1,101 @@
+/*
+ * Tokenizer and key lookup for the metadata/command items from Music Assistant
+ *
+ * Items are "KEY=value" lines, which are found and split inside the evbuffer
+ * they were read into, without copying them. Keys are looked up in a gperf
+ * perfect hash generated from mass_keys.gperf. This is kept apart from mass.c
+ * so that cliap2-cmd-bench can measure it, see cmd_bench.c.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#include "mass_item.h"
+
+struct mass_key_map
+{
+  const char *name;
+  enum mass_key key;
+};
+
+#include "mass_keys_hash.h"
+
+/** Find the next metadata/command item in the event buffer, without copying it
+ * @param evbuf the event buffer to get the item from
+ * @param len   [out] length of the item, without the newline
+ * @returns     the item, or NULL if there is no complete item yet
+ * @note  Music Assistant terminates commands/metadata items with a newline, which
+ *        is replaced with a NUL terminator in the buffer. The item is only valid
+ *        until the caller drains len + 1 bytes from the buffer.
+ * @note  Items are normally in the first segment of the buffer. Only an item that
+ *        spans segments is made contiguous, which copies it once.
+ */
+char *
+mass_item_next(struct evbuffer *evbuf, size_t *len)
+{
+  struct evbuffer_iovec v;
+  struct evbuffer_ptr evptr;
+  char *item;
+  char *nl;
+
+  if (evbuffer_peek(evbuf, -1, NULL, &v, 1) < 1 || v.iov_len == 0)
+    return NULL;
+
+  item = v.iov_base;
+  nl = memchr(item, '\n', v.iov_len);
+  if (!nl) {
+    if (evbuffer_get_length(evbuf) == v.iov_len)
+      return NULL;
+
+    // Continue the search after the first segment
+    if (evbuffer_ptr_set(evbuf, &evptr, v.iov_len, EVBUFFER_PTR_SET) < 0)
+      return NULL;
+    evptr = evbuffer_search(evbuf, "\n", 1, &evptr);
+    if (evptr.pos < 0)
+      return NULL;
+
+    item = (char *)evbuffer_pullup(evbuf, evptr.pos + 1);
+    if (!item)
+      return NULL;
+    nl = item + evptr.pos;
+  }
+
+  *nl = '\0';
+  *len = nl - item;
+
+  return item;
+}
+
+/** Look up the key of a metadata/command item
+ * @param key   [out] the key
+ * @param name  the key as received, not necessarily NUL terminated
+ * @param len   length of name
+ * @returns 0 on success, -1 if the key is unknown
+ * @note  Keys must match exactly, e.g. TITLEX is not TITLE
+ */
+int
+mass_item_key(enum mass_key *key, const char *name, size_t len)
+{
+  const struct mass_key_map *map;
+
+  map = mass_find_key(name, len);
+  if (!map)
+    return -1;
+
+  *key = map->key;
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __MASS_ITEM_H__
+#define __MASS_ITEM_H__
+
+#include <stddef.h>
+#include <event2/buffer.h>
+
+// Key-value separator in metadata/command items, keys are in mass_keys.gperf
+#define MASS_ITEM_KEYVAL_SEP '='
+
+// Keys of the metadata/command items from Music Assistant
+enum mass_key
+{
+  MASS_KEY_ALBUM,
+  MASS_KEY_ARTIST,
+  MASS_KEY_TITLE,
+  MASS_KEY_DURATION,
+  MASS_KEY_PROGRESS,
+  MASS_KEY_ARTWORK,
+  MASS_KEY_VOLUME,
+  MASS_KEY_PIN,
+  MASS_KEY_ACTION,
+};
+
+char *
+mass_item_next(struct evbuffer *evbuf, size_t *len);
+
+int
+mass_item_key(enum mass_key *key, const char *name, size_t len);
+
+#endif /* !__MASS_ITEM_H__ */
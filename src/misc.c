@@ -64,6 +64,7 @@
 #include "logger.h"
 #include "conffile.h"
 #include "misc.h"
+#include "trace.h"
 
 
 static char *buildopts[] =
@@ -2036,6 +2037,8 @@ void
 log_fatal_err(int domain, const char *func, int line, int err)
 {
   DPRINTF(E_FATAL, domain, "%s failed at line %d, error %d (%s)\n", func, line, err, strerror(err));
+  trace_event(TRACE_FATAL, domain, line, err);
+  trace_dump("fatal");
   _exit(1);
 }
 
@@ -2043,6 +2046,8 @@ void
 log_fatal_errno(int domain, const char *func, int line)
 {
   DPRINTF(E_FATAL, domain, "%s failed at line %d, error %d (%s)\n", func, line, errno, strerror(errno));
+  trace_event(TRACE_FATAL, domain, line, errno);
+  trace_dump("fatal");
   _exit(1);
 }
 
@@ -2050,6 +2055,8 @@ void
 log_fatal_null(int domain, const char *func, int line)
 {
   DPRINTF(E_FATAL, domain, "%s returned NULL at line %d\n", func, line);
+  trace_event(TRACE_FATAL, domain, line, 0);
+  trace_dump("fatal");
   _exit(1);
 }
 
@@ -0,0 +1,83 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * USDT probes on the cliap2 audio and command paths, for use with perf and
+ * bpftrace without rebuilding, e.g.
+ *
+ *   bpftrace -e 'usdt:./cliap2:cliap2:input_write { @[arg1] = hist(arg0); }'
+ *   perf probe -x ./cliap2 sdt_cliap2:stdin_read
+ *
+ * Each probe has an SDT semaphore, which perf and bpftrace increment while they
+ * are attached. Until then a probe site costs a load and a not taken branch,
+ * and its arguments, timestamp included, are not evaluated. Without
+ * <sys/sdt.h> (systemtap-sdt-dev) the probes are compiled out. Probe names and
+ * argument order are stable, new arguments are only added at the end.
+ * Timestamps are CLOCK_MONOTONIC in ns.
+ *
+ * The semaphores are defined in mass.c, which defines PROBES_DEFINE before
+ * including this header. A new probe needs a CLIAP2_PROBE_SEMAPHORE() below.
+ *
+ *   stdin_read      (bytes, buffered, ts_ns)      audio read completed
+ *   input_write     (bytes, flags, ts_ns)         audio handed to the input module
+ *   audio_eof       (reason, ts_ns)               see enum trace_eof_reason
+ *   cmd_read        (bytes, buffered, ts_ns)      command pipe read completed
+ *   cmd_item        (msg, value, ts_ns)           command item parsed
+ *   cmd_dispatch    (msg_mask, ts_ns)             command items of one read acted on
+ *   metadata_push   (len_ms, pos_ms, ts_ns)       metadata handed to the player
+ *   volume_set      (volume, ts_ns)
+ *   status          (event, pos_ms, volume)       status event, see libcliap2.h
+ */
+
+#if defined(HAVE_SYS_SDT_H) && defined(__linux__)
+# include <stdint.h>
+# include <time.h>
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+
+# ifdef PROBES_DEFINE
+#  define CLIAP2_PROBE_SEMAPHORE(name) \
+     volatile unsigned short cliap2_##name##_semaphore __attribute__((section(".probes"), used))
+# else
+#  define CLIAP2_PROBE_SEMAPHORE(name) \
+     extern volatile unsigned short cliap2_##name##_semaphore
+# endif
+
+CLIAP2_PROBE_SEMAPHORE(stdin_read);
+CLIAP2_PROBE_SEMAPHORE(input_write);
+CLIAP2_PROBE_SEMAPHORE(audio_eof);
+CLIAP2_PROBE_SEMAPHORE(cmd_read);
+CLIAP2_PROBE_SEMAPHORE(cmd_item);
+CLIAP2_PROBE_SEMAPHORE(cmd_dispatch);
+CLIAP2_PROBE_SEMAPHORE(metadata_push);
+CLIAP2_PROBE_SEMAPHORE(volume_set);
+CLIAP2_PROBE_SEMAPHORE(status);
+
+static inline uint64_t
+probe_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+# define CLIAP2_PROBE_ENABLED(name)          __builtin_expect(cliap2_##name##_semaphore != 0, 0)
+# define CLIAP2_PROBE1(name, a1) \
+    do { if (CLIAP2_PROBE_ENABLED(name)) DTRACE_PROBE1(cliap2, name, a1); } while (0)
+# define CLIAP2_PROBE2(name, a1, a2) \
+    do { if (CLIAP2_PROBE_ENABLED(name)) DTRACE_PROBE2(cliap2, name, a1, a2); } while (0)
+# define CLIAP2_PROBE3(name, a1, a2, a3) \
+    do { if (CLIAP2_PROBE_ENABLED(name)) DTRACE_PROBE3(cliap2, name, a1, a2, a3); } while (0)
+
+#else
+
+# define probe_now_ns()                      0
+# define CLIAP2_PROBE_ENABLED(name)          0
+# define CLIAP2_PROBE1(name, a1)             do { } while (0)
+# define CLIAP2_PROBE2(name, a1, a2)         do { } while (0)
+# define CLIAP2_PROBE3(name, a1, a2, a3)     do { } while (0)
+
+#endif
+
+#endif /* !__PROBES_H__ */
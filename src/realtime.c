@@ -0,0 +1,321 @@
+/*
+ * Realtime scheduling support for the cliap2 audio threads.
+ *
+ * When enabled (--realtime or general { realtime = true }), the threads that
+ * sit on the packet path are given SCHED_FIFO priorities and can be pinned to
+ * a set of cores, the process memory is locked and the mutexes shared between
+ * the audio and command threads use priority inheritance.
+ *
+ * The player, input and output threads are created by the OwnTone codebase
+ * with default thread attributes, which means they inherit the scheduling
+ * policy and CPU affinity of the creating thread. We therefore apply the audio
+ * policy to the main thread for the duration of player_init() (see
+ * realtime_spawn_begin/end) rather than patching OwnTone.
+ *
+ * Every step falls back to default scheduling with a warning if the process
+ * lacks the required capabilities (CAP_SYS_NICE/RLIMIT_RTPRIO, CAP_IPC_LOCK).
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef HAVE_MLOCKALL
+# include <sys/mman.h>
+# include <sys/resource.h>
+#endif
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "realtime.h"
+
+// Priority distance between the audio threads and the control threads
+#define REALTIME_CONTROL_PRIO_OFFSET 10
+
+static bool rt_enabled;
+static bool rt_mlock;
+static int rt_prio_audio;
+static int rt_prio_control;
+static bool rt_warned;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+static cpu_set_t rt_cpus;
+static bool rt_cpus_set;
+static cpu_set_t saved_cpus;
+static bool saved_cpus_valid;
+#endif
+
+// Scheduling of the main thread, restored by realtime_spawn_end()
+static int saved_policy;
+static struct sched_param saved_param;
+static bool saved_valid;
+
+/* -------------------------------- HELPERS --------------------------------- */
+
+/**
+ * Log a missing capability once, so that every thread doesn't repeat it
+ * @param what  description of what could not be applied
+ * @param err   the error returned by the failing call
+ */
+static void
+realtime_warn(const char *what, int err)
+{
+  if (rt_warned)
+    {
+      DPRINTF(E_DBG, L_MAIN, "%s: Could not apply %s: %s\n", __func__, what, strerror(err));
+      return;
+    }
+
+  rt_warned = true;
+  DPRINTF(E_WARN, L_MAIN, "Realtime mode: could not apply %s (%s), continuing with default scheduling. "
+    "Grant CAP_SYS_NICE/CAP_IPC_LOCK or raise RLIMIT_RTPRIO/RLIMIT_MEMLOCK to enable it.\n", what, strerror(err));
+}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+static int
+realtime_affinity_set(cpu_set_t *cpus)
+{
+  int ret;
+
+  ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+  if (ret != 0)
+    {
+      realtime_warn("CPU affinity", ret);
+      return -1;
+    }
+
+  return 0;
+}
+#endif
+
+/* ---------------------------------- API ----------------------------------- */
+
+/**
+ * Read the realtime configuration. Must be called after conffile_load() and
+ * before any of the audio threads are spawned.
+ * @returns 0 on success, -1 on invalid configuration
+ */
+int
+realtime_init(void)
+{
+  cfg_t *general = cfg_getsec(cfg, "general");
+  int prio_min;
+  int prio_max;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  unsigned int i;
+  long cpu;
+#endif
+
+  rt_enabled = cfg_getbool(general, "realtime");
+  if (!rt_enabled)
+    return 0;
+
+  prio_min = sched_get_priority_min(SCHED_FIFO);
+  prio_max = sched_get_priority_max(SCHED_FIFO);
+
+  rt_prio_audio = cfg_getint(general, "realtime_priority");
+  if (rt_prio_audio < prio_min || rt_prio_audio > prio_max)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "realtime_priority must be between %d and %d, not %d\n", prio_min, prio_max, rt_prio_audio);
+      return -1;
+    }
+
+  rt_prio_control = rt_prio_audio - REALTIME_CONTROL_PRIO_OFFSET;
+  if (rt_prio_control < prio_min)
+    rt_prio_control = prio_min;
+
+  rt_mlock = cfg_getbool(general, "realtime_mlock");
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  CPU_ZERO(&rt_cpus);
+  for (i = 0; i < cfg_size(general, "realtime_cpus"); i++)
+    {
+      cpu = cfg_getnint(general, "realtime_cpus", i);
+      if (cpu < 0 || cpu >= CPU_SETSIZE)
+	{
+	  DPRINTF(E_FATAL, L_MAIN, "Invalid core %ld in realtime_cpus\n", cpu);
+	  return -1;
+	}
+
+      CPU_SET(cpu, &rt_cpus);
+      rt_cpus_set = true;
+    }
+#else
+  if (cfg_size(general, "realtime_cpus") > 0)
+    DPRINTF(E_WARN, L_MAIN, "realtime_cpus is not supported on this platform, ignoring\n");
+#endif
+
+  DPRINTF(E_INFO, L_MAIN, "Realtime mode enabled: SCHED_FIFO priority %d (control threads %d), mlockall %s\n",
+    rt_prio_audio, rt_prio_control, rt_mlock ? "on" : "off");
+
+  return 0;
+}
+
+bool
+realtime_enabled(void)
+{
+  return rt_enabled;
+}
+
+/**
+ * Apply the realtime policy of the given class to the calling thread
+ * @param rt_class  scheduling class of the calling thread
+ * @returns 0 on success or if realtime mode is disabled, -1 if the policy could not be applied
+ */
+int
+realtime_thread_apply(enum realtime_class rt_class)
+{
+  struct sched_param param = { 0 };
+  int ret;
+
+  if (!rt_enabled)
+    return 0;
+
+  param.sched_priority = (rt_class == REALTIME_CLASS_AUDIO) ? rt_prio_audio : rt_prio_control;
+
+  ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (ret != 0)
+    {
+      realtime_warn("SCHED_FIFO", ret);
+      return -1;
+    }
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  if (rt_cpus_set && realtime_affinity_set(&rt_cpus) < 0)
+    return -1;
+#endif
+
+  return 0;
+}
+
+/**
+ * Give the calling (main) thread the audio policy, so that threads created
+ * until realtime_spawn_end() inherit it. Used around player_init(), which
+ * spawns the player, input and mass threads.
+ * @returns 0 on success or if realtime mode is disabled, -1 on failure
+ */
+int
+realtime_spawn_begin(void)
+{
+  int ret;
+
+  if (!rt_enabled)
+    return 0;
+
+  ret = pthread_getschedparam(pthread_self(), &saved_policy, &saved_param);
+  if (ret != 0)
+    {
+      realtime_warn("SCHED_FIFO", ret);
+      return -1;
+    }
+  saved_valid = true;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  saved_cpus_valid = (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &saved_cpus) == 0);
+#endif
+
+  return realtime_thread_apply(REALTIME_CLASS_AUDIO);
+}
+
+/**
+ * Restore the scheduling of the calling (main) thread saved by realtime_spawn_begin()
+ */
+void
+realtime_spawn_end(void)
+{
+  if (!saved_valid)
+    return;
+
+  pthread_setschedparam(pthread_self(), saved_policy, &saved_param);
+  saved_valid = false;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  if (saved_cpus_valid)
+    realtime_affinity_set(&saved_cpus);
+  saved_cpus_valid = false;
+#endif
+}
+
+/**
+ * Lock the process memory, including the audio buffers allocated during
+ * startup, so that page faults cannot delay a packet tick.
+ * @returns 0 on success or if disabled, -1 on failure
+ * @note  MCL_FUTURE is only requested when RLIMIT_MEMLOCK is unlimited, since
+ *        otherwise later allocations could fail once the limit is reached.
+ */
+int
+realtime_memlock(void)
+{
+#ifdef HAVE_MLOCKALL
+  struct rlimit rlim;
+  int flags = MCL_CURRENT;
+
+  if (!rt_enabled || !rt_mlock)
+    return 0;
+
+  if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0 && rlim.rlim_cur == RLIM_INFINITY)
+    flags |= MCL_FUTURE;
+
+  if (mlockall(flags) < 0)
+    {
+      realtime_warn("mlockall", errno);
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_MAIN, "Locked process memory%s\n", (flags & MCL_FUTURE) ? " (current and future)" : "");
+#endif
+  return 0;
+}
+
+/**
+ * Initialise a mutex that is shared with an audio thread. In realtime mode the
+ * mutex uses priority inheritance, so a control thread holding it is boosted
+ * while an audio thread waits. Otherwise it is equivalent to mutex_init().
+ * @param mutex  the mutex to initialise
+ * @returns 0 on success, error number on failure
+ */
+int
+realtime_mutex_init(pthread_mutex_t *mutex)
+{
+#if defined(HAVE_PTHREAD_MUTEXATTR_SETPROTOCOL) && defined(_POSIX_THREAD_PRIO_INHERIT)
+  pthread_mutexattr_t mattr;
+  int err;
+
+  if (!rt_enabled)
+    return mutex_init(mutex);
+
+  CHECK_ERR(L_MAIN, pthread_mutexattr_init(&mattr));
+  CHECK_ERR(L_MAIN, pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK));
+  err = pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+  if (err != 0)
+    {
+      realtime_warn("priority inheritance", err);
+      CHECK_ERR(L_MAIN, pthread_mutexattr_destroy(&mattr));
+      return mutex_init(mutex);
+    }
+  err = pthread_mutex_init(mutex, &mattr);
+  CHECK_ERR(L_MAIN, pthread_mutexattr_destroy(&mattr));
+
+  return err;
+#else
+  return mutex_init(mutex);
+#endif
+}
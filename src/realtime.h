@@ -0,0 +1,37 @@
+#ifndef __REALTIME_H__
+#define __REALTIME_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+
+// Scheduling class of a thread when realtime mode is enabled
+enum realtime_class
+{
+  // Threads on the packet path (player, input, outputs, mass_aud)
+  REALTIME_CLASS_AUDIO,
+  // Threads that must stay responsive, but not at the expense of audio (mass_cmd)
+  REALTIME_CLASS_CONTROL,
+};
+
+int
+realtime_init(void);
+
+bool
+realtime_enabled(void);
+
+int
+realtime_thread_apply(enum realtime_class rt_class);
+
+int
+realtime_spawn_begin(void);
+
+void
+realtime_spawn_end(void);
+
+int
+realtime_memlock(void);
+
+int
+realtime_mutex_init(pthread_mutex_t *mutex);
+
+#endif /* !__REALTIME_H__ */
@@ -0,0 +1,413 @@
+/*
+ * cliap2-spawn-bench - spawn-to-RTSP-connect latency of cold starts and of
+ * sessions forked by --server
+ *
+ * Usage: cliap2-spawn-bench [-n <runs>] [-s <socket>] <cliap2> [<option>...]
+ *
+ *   -n  number of sessions to start in each mode, default 20
+ *   -s  also start sessions through a running "cliap2 --server <socket>"
+ *
+ * The benchmark plays the AirPlay device itself: it listens on a loopback TCP
+ * port and gives that as --address/--port to each session. A session connects
+ * once it has audio, so a little silence is written right after the spawn, and
+ * the time until the connection is accepted is what gets measured. The session
+ * is then killed, it never gets further than the connect. Any <option> is
+ * added to the session options, e.g. --loglevel, or --txt with the features of
+ * a real device.
+ *
+ * Not installed, build with "make cliap2-spawn-bench".
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "zygote.h"
+
+#define BENCH_RUNS_DEFAULT  20
+#define BENCH_OPTS_MAX      64
+// A session that hasn't connected by then counts as failed
+#define BENCH_CONNECT_MS    10000
+// 16 bit stereo silence, enough for the session to start playback
+#define BENCH_SILENCE_BYTES 8192
+
+struct bench_session
+{
+  pid_t pid;
+  bool reaped;
+  int audio_wfd;
+  int command_wfd;
+};
+
+static int device_fd;
+static char device_port[8];
+static char *session_opts[BENCH_OPTS_MAX];
+static int session_nopts;
+
+static double
+ms_since(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int
+device_listen(void)
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET };
+  socklen_t len = sizeof(addr);
+  int fd;
+
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+    {
+      perror("Could not listen on loopback");
+      return -1;
+    }
+
+  device_fd = fd;
+  snprintf(device_port, sizeof(device_port), "%d", ntohs(addr.sin_port));
+  return 0;
+}
+
+/**
+ * Wait for the session to connect to the fake device
+ * @returns 0 on connect, -1 on timeout
+ */
+static int
+device_accept(void)
+{
+  struct pollfd pfd = { .fd = device_fd, .events = POLLIN };
+  int conn;
+
+  if (poll(&pfd, 1, BENCH_CONNECT_MS) <= 0)
+    return -1;
+
+  conn = accept(device_fd, NULL, NULL);
+  if (conn < 0)
+    return -1;
+
+  close(conn);
+  return 0;
+}
+
+static void
+session_opts_set(int argc, char **argv)
+{
+  static char *device_opts[] = {
+    "--name", "bench", "--hostname", "localhost", "--address", "127.0.0.1",
+    "--txt", "\"features=0x0,0x0\"", "--port", device_port,
+  };
+  int i;
+
+  session_nopts = 0;
+  for (i = 0; i < (int)(sizeof(device_opts) / sizeof(device_opts[0])); i++)
+    session_opts[session_nopts++] = device_opts[i];
+  for (i = 0; i < argc && session_nopts < BENCH_OPTS_MAX - 4; i++)
+    session_opts[session_nopts++] = argv[i];
+}
+
+static int
+session_pipes(int audio[2], int command[2])
+{
+  if (pipe(audio) < 0)
+    return -1;
+  if (pipe(command) < 0)
+    {
+      close(audio[0]);
+      close(audio[1]);
+      return -1;
+    }
+
+  fcntl(audio[1], F_SETFD, FD_CLOEXEC);
+  fcntl(command[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+static int
+session_cold_start(struct bench_session *s, const char *program)
+{
+  char command_path[32];
+  char *argv[BENCH_OPTS_MAX + 4];
+  int audio[2];
+  int command[2];
+  int devnull;
+  int n = 0;
+  int i;
+
+  if (session_pipes(audio, command) < 0)
+    return -1;
+
+  s->pid = fork();
+  if (s->pid == 0)
+    {
+      devnull = open("/dev/null", O_WRONLY);
+      dup2(audio[0], STDIN_FILENO);
+      dup2(devnull, STDERR_FILENO);
+      snprintf(command_path, sizeof(command_path), "/dev/fd/%d", command[0]);
+
+      argv[n++] = (char *)program;
+      for (i = 0; i < session_nopts; i++)
+	argv[n++] = session_opts[i];
+      argv[n++] = "--command_pipe";
+      argv[n++] = command_path;
+      argv[n] = NULL;
+
+      execv(program, argv);
+      _exit(127);
+    }
+
+  close(audio[0]);
+  close(command[0]);
+  s->audio_wfd = audio[1];
+  s->command_wfd = command[1];
+  s->reaped = false;
+
+  return (s->pid < 0) ? -1 : 0;
+}
+
+/**
+ * Start a session through the server, see zygote.c for the request format
+ */
+static int
+session_server_start(struct bench_session *s, const char *socket_path)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FD_STATUS)];
+  } control;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct msghdr msg = { 0 };
+  struct cmsghdr *cmsg;
+  struct iovec iov[2];
+  char payload[1024];
+  char reply[64];
+  uint32_t len_be;
+  size_t len = 0;
+  ssize_t got;
+  int fds[ZYGOTE_FD_STATUS];
+  int audio[2];
+  int command[2];
+  int conn;
+  int i;
+
+  for (i = 0; i < session_nopts; i++)
+    {
+      if (len + strlen(session_opts[i]) + 1 > sizeof(payload))
+	return -1;
+      strcpy(payload + len, session_opts[i]);
+      len += strlen(session_opts[i]) + 1;
+    }
+
+  if (session_pipes(audio, command) < 0)
+    return -1;
+
+  conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  if (conn < 0 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    goto error;
+
+  fds[ZYGOTE_FD_AUDIO] = audio[0];
+  fds[ZYGOTE_FD_COMMAND] = command[0];
+  fds[ZYGOTE_FD_STDERR] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+  len_be = htonl(len);
+  iov[0].iov_base = &len_be;
+  iov[0].iov_len = sizeof(len_be);
+  iov[1].iov_base = payload;
+  iov[1].iov_len = len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  got = sendmsg(conn, &msg, 0);
+  close(fds[ZYGOTE_FD_STDERR]);
+  if (got != (ssize_t)(sizeof(len_be) + len))
+    goto error;
+
+  got = read(conn, reply, sizeof(reply) - 1);
+  if (got <= 0)
+    goto error;
+  reply[got] = '\0';
+
+  s->pid = atoi(reply);
+  if (s->pid <= 0)
+    {
+      fprintf(stderr, "Server refused session: %s", reply);
+      goto error;
+    }
+
+  close(conn);
+  close(audio[0]);
+  close(command[0]);
+  s->audio_wfd = audio[1];
+  s->command_wfd = command[1];
+  // The server reaps its own children
+  s->reaped = true;
+  return 0;
+
+ error:
+  if (conn >= 0)
+    close(conn);
+  close(audio[0]);
+  close(audio[1]);
+  close(command[0]);
+  close(command[1]);
+  return -1;
+}
+
+static void
+session_kill(struct bench_session *s)
+{
+  kill(s->pid, SIGKILL);
+  if (!s->reaped)
+    waitpid(s->pid, NULL, 0);
+
+  close(s->audio_wfd);
+  close(s->command_wfd);
+}
+
+static int
+bench_run(const char *mode, const char *program, const char *socket_path, int runs)
+{
+  static const char silence[BENCH_SILENCE_BYTES];
+  struct bench_session s;
+  struct timespec start;
+  double *ms;
+  int failed = 0;
+  int ok = 0;
+  int ret;
+  int i;
+
+  ms = calloc(runs, sizeof(double));
+  if (!ms)
+    return -1;
+
+  for (i = 0; i < runs; i++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      if (socket_path)
+	ret = session_server_start(&s, socket_path);
+      else
+	ret = session_cold_start(&s, program);
+      if (ret < 0)
+	{
+	  fprintf(stderr, "Could not start %s session: %s\n", mode, strerror(errno));
+	  free(ms);
+	  return -1;
+	}
+
+      if (write(s.audio_wfd, silence, sizeof(silence)) < 0 || device_accept() < 0)
+	failed++;
+      else
+	ms[ok++] = ms_since(&start);
+
+      session_kill(&s);
+    }
+
+  qsort(ms, ok, sizeof(double), double_cmp);
+
+  if (ok > 0)
+    printf("%-6s %3d runs  min %8.2f ms  median %8.2f ms  max %8.2f ms  failed %d\n",
+	   mode, runs, ms[0], ms[ok / 2], ms[ok - 1], failed);
+  else
+    printf("%-6s %3d runs  no session connected within %d ms\n", mode, runs, BENCH_CONNECT_MS);
+
+  free(ms);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *socket_path = NULL;
+  int runs = BENCH_RUNS_DEFAULT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "+n:s:")) != -1)
+    {
+      switch (opt)
+	{
+	  case 'n':
+	    runs = atoi(optarg);
+	    break;
+
+	  case 's':
+	    socket_path = optarg;
+	    break;
+
+	  default:
+	    fprintf(stderr, "Usage: %s [-n <runs>] [-s <socket>] <cliap2> [<option>...]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+  if (optind >= argc || runs <= 0)
+    {
+      fprintf(stderr, "Usage: %s [-n <runs>] [-s <socket>] <cliap2> [<option>...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (device_listen() < 0)
+    return EXIT_FAILURE;
+
+  session_opts_set(argc - optind - 1, argv + optind + 1);
+
+  if (bench_run("cold", argv[optind], NULL, runs) < 0)
+    return EXIT_FAILURE;
+  if (socket_path && bench_run("server", argv[optind], socket_path, runs) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
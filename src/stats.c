@@ -0,0 +1,311 @@
+/*
+ * Shared memory stats page for external monitoring
+ *
+ * Each session publishes a struct stats_page (see stats.h) in the POSIX shm
+ * segment "/cliap2.<pid>", readable by the user and group of the process. The
+ * hot paths update process local counters and gauges with relaxed atomics, and
+ * stats_publish() copies them to the page once per second from the main
+ * thread, together with the resource usage of the process. The page is written under a seqlock: readers retry if the
+ * sequence number is odd or changed while they copied the page, so they never
+ * block the writer and need no syscalls once the segment is mapped.
+ *
+ * cliap2-stats reads and aggregates the pages of all running instances.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "stats.h"
+
+static atomic_uint_fast64_t stats_counters[STATS_COUNTERS];
+static atomic_int_fast64_t stats_gauges[STATS_GAUGES];
+
+static struct stats_page *stats_page;
+static char stats_shm_name[32];
+
+static int64_t
+clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifdef __linux__
+static uint64_t
+rss_get(void)
+{
+  unsigned long size;
+  unsigned long resident;
+  FILE *fp;
+  int ret;
+
+  fp = fopen("/proc/self/statm", "r");
+  if (!fp)
+    return 0;
+
+  ret = fscanf(fp, "%lu %lu", &size, &resident);
+  fclose(fp);
+  if (ret != 2)
+    return 0;
+
+  return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Read the name and CPU time of each thread from /proc/self/task
+ * @returns number of threads written to threads
+ */
+static uint32_t
+threads_get(struct stats_thread *threads, uint32_t max)
+{
+  char path[300];
+  char buf[512];
+  struct dirent *de;
+  unsigned long utime;
+  unsigned long stime;
+  long ticks;
+  char *name;
+  char *end;
+  DIR *dir;
+  FILE *fp;
+  uint32_t n = 0;
+  size_t len;
+
+  ticks = sysconf(_SC_CLK_TCK);
+  if (ticks <= 0)
+    return 0;
+
+  dir = opendir("/proc/self/task");
+  if (!dir)
+    return 0;
+
+  while (n < max && (de = readdir(dir)))
+    {
+      if (de->d_name[0] == '.')
+	continue;
+
+      snprintf(path, sizeof(path), "/proc/self/task/%s/stat", de->d_name);
+      fp = fopen(path, "r");
+      if (!fp)
+	continue;
+
+      len = fread(buf, 1, sizeof(buf) - 1, fp);
+      fclose(fp);
+      buf[len] = '\0';
+
+      // "tid (comm) state ppid ..." - comm can contain spaces and parentheses
+      name = strchr(buf, '(');
+      end = strrchr(buf, ')');
+      if (!name || !end || end < name)
+	continue;
+
+      // utime and stime are fields 14 and 15, i.e. 11 and 12 after state
+      if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+	continue;
+
+      threads[n].tid = atoi(buf);
+      len = end - name - 1;
+      if (len >= sizeof(threads[n].name))
+	len = sizeof(threads[n].name) - 1;
+      memcpy(threads[n].name, name + 1, len);
+      threads[n].name[len] = '\0';
+      threads[n].cpu_ns = (uint64_t)(utime + stime) * (1000000000ULL / ticks);
+      n++;
+    }
+
+  closedir(dir);
+
+  return n;
+}
+#else
+static uint64_t
+rss_get(void)
+{
+  struct rusage usage;
+
+  // Peak rather than current RSS, in KB on most BSDs and bytes on macOS
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+static uint32_t
+threads_get(struct stats_thread *threads, uint32_t max)
+{
+  return 0;
+}
+#endif
+
+static uint64_t
+cpu_get(void)
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+
+  return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+         ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+/**
+ * Add to a counter. Safe to call from any thread.
+ */
+void
+stats_add(enum stats_counter counter, uint64_t n)
+{
+  atomic_fetch_add_explicit(&stats_counters[counter], n, memory_order_relaxed);
+}
+
+/**
+ * Set a gauge. Safe to call from any thread.
+ */
+void
+stats_gauge_set(enum stats_gauge gauge, int64_t value)
+{
+  atomic_store_explicit(&stats_gauges[gauge], value, memory_order_relaxed);
+}
+
+/**
+ * Update the shared memory page. Must only be called from one thread.
+ */
+void
+stats_publish(void)
+{
+  struct stats_thread threads[STATS_THREADS_MAX];
+  uint32_t nthreads;
+  uint64_t rss;
+  uint64_t cpu;
+  unsigned int seq;
+  int i;
+
+  if (!stats_page)
+    return;
+
+  // Collect outside of the write section, which should be as short as possible
+  rss = rss_get();
+  cpu = cpu_get();
+  nthreads = threads_get(threads, STATS_THREADS_MAX);
+
+  seq = atomic_load_explicit(&stats_page->seq, memory_order_relaxed);
+  atomic_store_explicit(&stats_page->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (i = 0; i < STATS_COUNTERS; i++)
+    stats_page->counters[i] = atomic_load_explicit(&stats_counters[i], memory_order_relaxed);
+  for (i = 0; i < STATS_GAUGES; i++)
+    stats_page->gauges[i] = atomic_load_explicit(&stats_gauges[i], memory_order_relaxed);
+
+  stats_page->updated_ns = clock_ns(CLOCK_REALTIME);
+  stats_page->realtime_offset_ns = stats_page->updated_ns - clock_ns(CLOCK_MONOTONIC);
+  stats_page->rss_bytes = rss;
+  stats_page->cpu_ns = cpu;
+  stats_page->nthreads = nthreads;
+  memcpy(stats_page->threads, threads, nthreads * sizeof(struct stats_thread));
+
+  atomic_store_explicit(&stats_page->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Create the stats page of this process
+ * @param name  AirPlay device name, shown by cliap2-stats
+ * @returns 0 on success, -1 on failure. Failure is not fatal, the stats are
+ *          then not published.
+ */
+int
+stats_init(const char *name)
+{
+  void *page;
+  int fd;
+
+  snprintf(stats_shm_name, sizeof(stats_shm_name), "/" STATS_SHM_PREFIX "%d", (int)getpid());
+
+  // The name is predictable, so never take over a segment that already
+  // exists. One left behind by an earlier process with our pid is removed
+  // first, which only works if it belongs to our user.
+  shm_unlink(stats_shm_name);
+  fd = shm_open(stats_shm_name, O_RDWR | O_CREAT | O_EXCL, 0640);
+  if (fd < 0)
+    {
+      DPRINTF(E_WARN, L_MAIN, "Could not create stats page '%s': %s\n", stats_shm_name, strerror(errno));
+      return -1;
+    }
+
+  if (ftruncate(fd, sizeof(struct stats_page)) < 0)
+    {
+      DPRINTF(E_WARN, L_MAIN, "Could not size stats page '%s': %s\n", stats_shm_name, strerror(errno));
+      goto error;
+    }
+
+  page = mmap(NULL, sizeof(struct stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED)
+    {
+      DPRINTF(E_WARN, L_MAIN, "Could not map stats page '%s': %s\n", stats_shm_name, strerror(errno));
+      goto error;
+    }
+
+  close(fd);
+
+  stats_page = page;
+  stats_page->version = STATS_VERSION;
+  stats_page->size = sizeof(struct stats_page);
+  stats_page->pid = getpid();
+  snprintf(stats_page->name, sizeof(stats_page->name), "%s", name ? name : "");
+  stats_page->started_ns = clock_ns(CLOCK_REALTIME);
+  atomic_init(&stats_page->seq, 0);
+
+  stats_publish();
+
+  // Readers ignore the page until the magic is set
+  atomic_thread_fence(memory_order_release);
+  stats_page->magic = STATS_MAGIC;
+
+  return 0;
+
+ error:
+  close(fd);
+  shm_unlink(stats_shm_name);
+  return -1;
+}
+
+void
+stats_deinit(void)
+{
+  if (!stats_page)
+    return;
+
+  munmap(stats_page, sizeof(struct stats_page));
+  stats_page = NULL;
+
+  shm_unlink(stats_shm_name);
+}
@@ -0,0 +1,85 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Layout of the shared memory stats page, also used by cliap2-stats. Fields
+ * are only added at the end, anything else bumps STATS_VERSION.
+ */
+#define STATS_MAGIC        0x32504143 // "CAP2"
+#define STATS_VERSION      2
+#define STATS_SHM_PREFIX   "cliap2."  // shm name is "/" STATS_SHM_PREFIX "<pid>"
+#define STATS_THREADS_MAX  32
+
+enum stats_counter
+{
+  STATS_BYTES_INGESTED,           // audio bytes read from the input
+  STATS_AUDIO_READS,
+  STATS_READ_STARVED,             // reads with no data after playback started
+  STATS_INPUT_WRITES,
+  STATS_LATE_STARTS,              // first write too late to start on time
+  STATS_COMMAND_ITEMS,
+  STATS_COMMAND_ERRORS,
+  STATS_ARTWORK_HITS,             // artwork found in the shared cache
+  STATS_ARTWORK_MISSES,
+  STATS_COUNTERS,
+};
+
+enum stats_gauge
+{
+  STATS_SOURCE_BUFFERED,          // audio bytes read, but not written to the player
+  STATS_VOLUME,
+  STATS_GAUGES,
+};
+
+struct stats_thread
+{
+  uint32_t tid;
+  char name[20];
+  uint64_t cpu_ns;
+};
+
+struct stats_page
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;                  // sizeof(struct stats_page)
+  atomic_uint seq;                // seqlock, odd while the page is being updated
+
+  int32_t pid;
+  char name[64];                  // AirPlay device name
+  int64_t started_ns;             // CLOCK_REALTIME
+  int64_t updated_ns;             // CLOCK_REALTIME of the last update
+
+  uint64_t counters[STATS_COUNTERS];
+  int64_t gauges[STATS_GAUGES];
+
+  int64_t realtime_offset_ns;     // CLOCK_REALTIME - CLOCK_MONOTONIC
+  uint64_t rss_bytes;
+  uint64_t cpu_ns;                // user + system, whole process
+  uint32_t nthreads;
+  struct stats_thread threads[STATS_THREADS_MAX];
+};
+
+#ifndef STATS_READER
+
+int
+stats_init(const char *name);
+
+void
+stats_deinit(void);
+
+void
+stats_add(enum stats_counter counter, uint64_t n);
+
+void
+stats_gauge_set(enum stats_gauge gauge, int64_t value);
+
+void
+stats_publish(void);
+
+#endif
+
+#endif /* !__STATS_H__ */
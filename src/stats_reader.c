@@ -0,0 +1,202 @@
+/*
+ * cliap2-stats - show the stats pages of all running cliap2 sessions
+ *
+ * Usage: cliap2-stats [-t]
+ *
+ *   -t  also show the CPU time of each thread
+ *
+ * The pages are found by listing /dev/shm, so this is Linux only. The pages
+ * are read through their seqlock, see stats.c.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#define STATS_READER
+#include "stats.h"
+
+#define STATS_SHM_DIR     "/dev/shm"
+#define STATS_READ_TRIES  1000
+
+/**
+ * Take a consistent copy of a page
+ * @returns 0 on success, -1 if the writer kept updating the page
+ */
+static int
+page_read(struct stats_page *dst, struct stats_page *src)
+{
+  unsigned int seq;
+  int i;
+
+  for (i = 0; i < STATS_READ_TRIES; i++)
+    {
+      seq = atomic_load_explicit(&src->seq, memory_order_acquire);
+      if (seq & 1)
+	continue;
+
+      memcpy(dst, src, sizeof(struct stats_page));
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&src->seq, memory_order_relaxed) == seq)
+	return 0;
+    }
+
+  return -1;
+}
+
+static int
+page_open(const char *name, struct stats_page *page)
+{
+  char shm_name[300];
+  struct stats_page *mapped;
+  int ret;
+  int fd;
+
+  snprintf(shm_name, sizeof(shm_name), "/%s", name);
+
+  fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0)
+    return -1;
+
+  mapped = mmap(NULL, sizeof(struct stats_page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return -1;
+
+  if (mapped->magic != STATS_MAGIC || mapped->version != STATS_VERSION || mapped->size != sizeof(struct stats_page))
+    ret = -1;
+  else
+    ret = page_read(page, mapped);
+
+  munmap(mapped, sizeof(struct stats_page));
+
+  return ret;
+}
+
+static bool
+pid_alive(pid_t pid)
+{
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static void
+page_print(const struct stats_page *page, int64_t now_ns, bool show_threads)
+{
+  double uptime;
+  double art_hits;
+  uint64_t art_lookups;
+  uint32_t i;
+
+  uptime = (double)(now_ns - page->started_ns) / 1e9;
+  art_lookups = page->counters[STATS_ARTWORK_HITS] + page->counters[STATS_ARTWORK_MISSES];
+  art_hits = art_lookups ? 100.0 * page->counters[STATS_ARTWORK_HITS] / art_lookups : 0.0;
+
+  printf("%7" PRId32 " %-24.24s %9.0f %10.1f %9" PRIu64 " %8" PRIu64 " %6" PRIu64 " %8" PRIu64 " %6" PRIu64 " %9" PRId64 " %4" PRId64 " %7.1f %8.2f %7.1f %6.1f\n",
+    page->pid, page->name, uptime,
+    (double)page->counters[STATS_BYTES_INGESTED] / (1024 * 1024),
+    page->counters[STATS_AUDIO_READS], page->counters[STATS_READ_STARVED],
+    page->counters[STATS_LATE_STARTS], page->counters[STATS_COMMAND_ITEMS], page->counters[STATS_COMMAND_ERRORS],
+    page->gauges[STATS_SOURCE_BUFFERED], page->gauges[STATS_VOLUME],
+    (double)page->rss_bytes / (1024 * 1024), (double)page->cpu_ns / 1e9, art_hits,
+    (double)(now_ns - page->updated_ns) / 1e9);
+
+  if (!show_threads)
+    return;
+
+  for (i = 0; i < page->nthreads && i < STATS_THREADS_MAX; i++)
+    printf("        %7" PRIu32 " %-20.20s %10.2f s\n", page->threads[i].tid, page->threads[i].name, (double)page->threads[i].cpu_ns / 1e9);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct stats_page page;
+  struct stats_page total;
+  struct timespec ts;
+  struct dirent *de;
+  bool show_threads = false;
+  int64_t now_ns;
+  int count = 0;
+  DIR *dir;
+  int i;
+
+  if (argc == 2 && strcmp(argv[1], "-t") == 0)
+    show_threads = true;
+  else if (argc != 1)
+    {
+      fprintf(stderr, "Usage: %s [-t]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  dir = opendir(STATS_SHM_DIR);
+  if (!dir)
+    {
+      perror(STATS_SHM_DIR);
+      return EXIT_FAILURE;
+    }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+  printf("%7s %-24s %9s %10s %9s %8s %6s %8s %6s %9s %4s %7s %8s %7s %6s\n",
+    "pid", "name", "uptime_s", "in_mb", "reads", "starved", "late", "cmds", "errs", "buffered", "vol", "rss_mb", "cpu_s", "art_hit", "age_s");
+
+  memset(&total, 0, sizeof(total));
+  while ((de = readdir(dir)))
+    {
+      if (strncmp(de->d_name, STATS_SHM_PREFIX, strlen(STATS_SHM_PREFIX)) != 0)
+	continue;
+
+      if (page_open(de->d_name, &page) < 0)
+	continue;
+
+      // Pages of sessions that crashed are left behind
+      if (!pid_alive(page.pid))
+	continue;
+
+      page_print(&page, now_ns, show_threads);
+
+      for (i = 0; i < STATS_COUNTERS; i++)
+	total.counters[i] += page.counters[i];
+      total.gauges[STATS_SOURCE_BUFFERED] += page.gauges[STATS_SOURCE_BUFFERED];
+      total.rss_bytes += page.rss_bytes;
+      total.cpu_ns += page.cpu_ns;
+      count++;
+    }
+
+  closedir(dir);
+
+  if (count > 1)
+    {
+      snprintf(total.name, sizeof(total.name), "total (%d)", count);
+      total.started_ns = now_ns;
+      total.updated_ns = now_ns;
+      total.gauges[STATS_VOLUME] = -1;
+      page_print(&total, now_ns, false);
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+/*
+ * Status reporting of a cliap2 session
+ *
+ * The events mirror the log lines that Music Assistant looks for on stderr
+ * ("Starting at", "Pause at", ...), which are still written for the CLI.
+ * Library users register a callback instead of parsing the log, and the CLI
+ * can write the events as JSON lines to a dedicated fd (--status_fd), so that
+ * state changes don't depend on the log level or the wording of log lines.
+ * The JSON schema is documented in the README.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "latency.h"
+#include "logger.h"
+#include "probes.h"
+#include "status.h"
+#include "trace.h"
+
+#define STATUS_SCHEMA_VERSION 1
+// Below PIPE_BUF, so that a line is written atomically to a pipe
+#define STATUS_LINE_MAX       512
+
+static cliap2_status_cb status_cb;
+static void *status_ctx;
+
+static int status_fd = -1;
+static uint64_t status_seq;
+static uint64_t status_dropped;
+static pthread_mutex_t status_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *status_event_names[] =
+{
+  [CLIAP2_EVENT_STARTED] = "started",
+  [CLIAP2_EVENT_RESTARTED] = "restarted",
+  [CLIAP2_EVENT_PAUSED] = "paused",
+  [CLIAP2_EVENT_RESUMED] = "resumed",
+  [CLIAP2_EVENT_STOPPED] = "stopped",
+  [CLIAP2_EVENT_PROGRESS] = "progress",
+  [CLIAP2_EVENT_END_OF_STREAM] = "end_of_stream",
+  [CLIAP2_EVENT_ENDED] = "ended",
+  [CLIAP2_EVENT_LATENCY] = "latency",
+};
+
+static int64_t
+clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Write an event as one JSON line to the status fd
+ * @note  Never blocks the calling thread. If the reader falls behind, lines
+ *        are dropped and the number dropped is reported in the next line.
+ */
+static void
+status_fd_write(const struct cliap2_status *status)
+{
+  char line[STATUS_LINE_MAX];
+  int64_t time_ns;
+  int64_t mono_ns;
+  ssize_t written;
+  size_t len;
+  int i;
+
+  time_ns = clock_ns(CLOCK_REALTIME);
+  mono_ns = clock_ns(CLOCK_MONOTONIC);
+
+  pthread_mutex_lock(&status_lck);
+
+  if (status_fd < 0)
+    goto out;
+
+  len = snprintf(line, sizeof(line), "{\"v\":%d,\"seq\":%" PRIu64 ",\"time_ns\":%" PRId64 ",\"mono_ns\":%" PRId64 ",\"event\":\"%s\",\"pos_ms\":%" PRIu32 ",\"volume\":%d",
+    STATUS_SCHEMA_VERSION, ++status_seq, time_ns, mono_ns, status_event_names[status->event], status->pos_ms, status->volume);
+
+  if (status_dropped > 0 && len < sizeof(line))
+    len += snprintf(line + len, sizeof(line) - len, ",\"dropped\":%" PRIu64, status_dropped);
+
+  if (status->latency && len < sizeof(line))
+    {
+      len += snprintf(line + len, sizeof(line) - len, ",\"latency\":{");
+      for (i = 0; i < CLIAP2_LATENCY_STAGES && len < sizeof(line); i++)
+	len += snprintf(line + len, sizeof(line) - len, "%s\"%s\":{\"count\":%" PRIu32 ",\"p50_us\":%" PRIu32 ",\"p99_us\":%" PRIu32 ",\"max_us\":%" PRIu32 "}",
+	  i ? "," : "", latency_stage_name(i), status->latency[i].count, status->latency[i].p50_us, status->latency[i].p99_us, status->latency[i].max_us);
+      if (len < sizeof(line))
+	len += snprintf(line + len, sizeof(line) - len, "}");
+    }
+
+  if (len < sizeof(line))
+    len += snprintf(line + len, sizeof(line) - len, "}\n");
+
+  if (len >= sizeof(line))
+    {
+      DPRINTF(E_LOG, L_MAIN, "Status event '%s' too long for the status fd\n", status_event_names[status->event]);
+      goto out;
+    }
+
+  do
+    written = write(status_fd, line, len);
+  while (written < 0 && errno == EINTR);
+
+  if (written == len)
+    status_dropped = 0;
+  else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    status_dropped++;
+  else
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not write to status fd %d, disabling it: %s\n", status_fd, written < 0 ? strerror(errno) : "short write");
+      status_fd = -1;
+    }
+
+ out:
+  pthread_mutex_unlock(&status_lck);
+}
+
+static void
+status_deliver(const struct cliap2_status *status)
+{
+  trace_event(TRACE_STATUS_EMIT, status->event, status->pos_ms, status->volume);
+  CLIAP2_PROBE3(status, status->event, status->pos_ms, status->volume);
+
+  if (status_fd >= 0)
+    status_fd_write(status);
+
+  if (status_cb)
+    status_cb(status, status_ctx);
+}
+
+/**
+ * Register the status callback. Must be called before the session starts,
+ * since the callback is read without locking from the session threads.
+ * @param cb   the callback, NULL to disable
+ * @param ctx  passed to the callback
+ */
+void
+status_cb_set(cliap2_status_cb cb, void *ctx)
+{
+  status_ctx = ctx;
+  status_cb = cb;
+}
+
+/**
+ * Set the fd that status events are written to as JSON lines
+ * @param fd  the fd, -1 to disable. Made non-blocking, never closed.
+ * @returns 0 on success, -1 if fd is not a valid descriptor
+ */
+int
+status_fd_set(int fd)
+{
+  int flags;
+
+  if (fd >= 0)
+    {
+      flags = fcntl(fd, F_GETFL);
+      if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Invalid status fd %d: %s\n", fd, strerror(errno));
+	  return -1;
+	}
+    }
+
+  pthread_mutex_lock(&status_lck);
+  status_fd = fd;
+  status_seq = 0;
+  status_dropped = 0;
+  pthread_mutex_unlock(&status_lck);
+
+  return 0;
+}
+
+/**
+ * Report a status event
+ * @param event   the event
+ * @param pos_ms  playback position, 0 if not known
+ * @param volume  current volume, -1 if not known
+ */
+void
+status_emit(enum cliap2_event event, uint32_t pos_ms, int volume)
+{
+  struct cliap2_status status;
+
+  status.event = event;
+  status.pos_ms = pos_ms;
+  status.volume = volume;
+  status.latency = NULL;
+
+  status_deliver(&status);
+}
+
+/**
+ * Report the latency of the timed stages
+ * @param latency  CLIAP2_LATENCY_STAGES entries
+ */
+void
+status_emit_latency(const struct cliap2_latency *latency)
+{
+  struct cliap2_status status;
+
+  status.event = CLIAP2_EVENT_LATENCY;
+  status.pos_ms = 0;
+  status.volume = -1;
+  status.latency = latency;
+
+  status_deliver(&status);
+}
@@ -0,0 +1,20 @@
+#ifndef __STATUS_H__
+#define __STATUS_H__
+
+#include <stdint.h>
+
+#include "libcliap2.h"
+
+void
+status_cb_set(cliap2_status_cb cb, void *ctx);
+
+int
+status_fd_set(int fd);
+
+void
+status_emit(enum cliap2_event event, uint32_t pos_ms, int volume);
+
+void
+status_emit_latency(const struct cliap2_latency *latency);
+
+#endif /* !__STATUS_H__ */
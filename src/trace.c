@@ -0,0 +1,199 @@
+/*
+ * Flight recorder for the cliap2 audio and command paths
+ *
+ * The log level in production is usually LOG, so the DEBUG and SPAM context
+ * around a glitch is not available afterwards. Instead, the hot paths always
+ * record small binary events (timestamp, event id and three integer
+ * arguments) in a fixed size ring. Recording is lock-free and costs a
+ * clock_gettime() and an atomic increment, so it stays enabled at all times.
+ *
+ * The ring is written to /tmp/cliap2.<pid>.<n>.trace on SIGUSR1 and on fatal
+ * errors (see log_fatal_err() in misc.c). Only sessions run in the foreground,
+ * i.e. the CLI, dump on SIGUSR1, see cliap2_session_run(). Dumps are readable
+ * by their owner only and are decoded with cliap2-trace.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
+#include "logger.h"
+#include "trace.h"
+
+#define TRACE_DUMP_TEMPLATE "/tmp/" PACKAGE_NAME ".%d.%u.trace"
+// Number of records copied and written per write()
+#define TRACE_DUMP_CHUNK    256
+// Names tried before giving up, if dumps of an earlier process with our pid exist
+#define TRACE_DUMP_TRIES    16
+
+struct trace_slot
+{
+  atomic_uint seq;
+  struct trace_record rec;
+};
+
+static struct trace_slot trace_ring[TRACE_RING_SIZE];
+static atomic_uint trace_pos;
+static atomic_uint trace_dumps;
+
+static __thread uint32_t trace_tid;
+
+static uint32_t
+trace_tid_get(void)
+{
+  if (trace_tid == 0)
+    {
+#ifdef __linux__
+      trace_tid = (uint32_t)syscall(SYS_gettid);
+#else
+      trace_tid = (uint32_t)(uintptr_t)pthread_self();
+#endif
+    }
+
+  return trace_tid;
+}
+
+static int64_t
+timespec_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/**
+ * Record an event in the ring. Safe to call from any thread.
+ * @param event  the event id
+ * @param a0     first argument, see TRACE_EVENTS for the meaning
+ * @param a1     second argument
+ * @param a2     third argument
+ */
+void
+trace_event(enum trace_event event, int64_t a0, int64_t a1, int64_t a2)
+{
+  struct trace_slot *slot;
+  struct timespec ts;
+  unsigned int pos;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  pos = atomic_fetch_add_explicit(&trace_pos, 1, memory_order_relaxed);
+  slot = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+
+  // Mark the slot as being written, so a concurrent dump skips it
+  atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  slot->rec.ts_ns = timespec_ns(&ts);
+  slot->rec.tid = trace_tid_get();
+  slot->rec.event = event;
+  slot->rec.args[0] = a0;
+  slot->rec.args[1] = a1;
+  slot->rec.args[2] = a2;
+
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * Write the ring to a new file in /tmp
+ * @param reason  short description of why the dump was made, stored in the dump
+ * @returns 0 on success, -1 on failure
+ * @note  Does not allocate and does not take any locks, so it can be used on
+ *        the fatal error path. Records that are being written at the time of
+ *        the dump are marked unused.
+ */
+int
+trace_dump(const char *reason)
+{
+  struct trace_record chunk[TRACE_DUMP_CHUNK];
+  struct trace_header header;
+  struct timespec mono;
+  struct timespec real;
+  char path[64];
+  unsigned int seq;
+  size_t i;
+  size_t n;
+  int tries;
+  int fd;
+
+  // The name is predictable and /tmp is shared, so never follow or reuse a
+  // file that is already there
+  for (tries = 0, fd = -1; fd < 0 && tries < TRACE_DUMP_TRIES; tries++)
+    {
+      snprintf(path, sizeof(path), TRACE_DUMP_TEMPLATE, (int)getpid(), atomic_fetch_add(&trace_dumps, 1));
+      fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+      if (fd < 0 && errno != EEXIST)
+	break;
+    }
+
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_MAIN, "Could not create trace dump '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(struct trace_record);
+  header.ring_size = TRACE_RING_SIZE;
+  header.pid = getpid();
+  header.next_seq = atomic_load(&trace_pos);
+  header.realtime_offset_ns = timespec_ns(&real) - timespec_ns(&mono);
+  snprintf(header.reason, sizeof(header.reason), "%s", reason ? reason : "");
+
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+    goto error;
+
+  for (i = 0; i < TRACE_RING_SIZE; i += n)
+    {
+      for (n = 0; n < TRACE_DUMP_CHUNK && i + n < TRACE_RING_SIZE; n++)
+	{
+	  seq = atomic_load_explicit(&trace_ring[i + n].seq, memory_order_acquire);
+	  chunk[n] = trace_ring[i + n].rec;
+	  atomic_thread_fence(memory_order_acquire);
+	  if (atomic_load_explicit(&trace_ring[i + n].seq, memory_order_relaxed) != seq)
+	    seq = 0; // Overwritten while we copied it
+
+	  chunk[n].seq = seq;
+	}
+
+      if (write(fd, chunk, n * sizeof(struct trace_record)) != (ssize_t)(n * sizeof(struct trace_record)))
+	goto error;
+    }
+
+  close(fd);
+
+  DPRINTF(E_LOG, L_MAIN, "Wrote trace dump (%s) to '%s'\n", header.reason, path);
+  return 0;
+
+ error:
+  DPRINTF(E_LOG, L_MAIN, "Could not write trace dump '%s': %s\n", path, strerror(errno));
+  close(fd);
+  unlink(path);
+  return -1;
+}
@@ -0,0 +1,76 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#define TRACE_MAGIC        "CAP2TRC"
+#define TRACE_VERSION      1
+#define TRACE_RING_SIZE    8192 // records, must be a power of two
+
+/*
+ * Trace events, with a label for each of the three arguments. The labels are
+ * used by the cliap2-trace decoder, an empty label means the argument is not
+ * used. New events must be added at the end, since the id is in the dumps.
+ */
+#define TRACE_EVENTS(X) \
+  X(TRACE_AUDIO_READ,      "audio_read",      "bytes",    "buffered", "read_count") \
+  X(TRACE_AUDIO_WAIT,      "audio_wait",      "delta_ms", "limit_ms", "")           \
+  X(TRACE_AUDIO_DRAIN,     "audio_drain",     "bytes",    "removed",  "to_remove")  \
+  X(TRACE_AUDIO_EOF,       "audio_eof",       "reason",   "err",      "")           \
+  X(TRACE_INPUT_WRITE,     "input_write",     "bytes",    "flags",    "")           \
+  X(TRACE_CMD_READ,        "cmd_read",        "bytes",    "buffered", "")           \
+  X(TRACE_CMD_ITEM,        "cmd_item",        "msg",      "value",    "")           \
+  X(TRACE_CMD_DISPATCH,    "cmd_dispatch",    "msg_mask", "status",   "pos_ms")     \
+  X(TRACE_PLAYER_STATUS,   "player_status",   "status",   "pos_ms",   "volume")     \
+  X(TRACE_STATUS_EMIT,     "status_emit",     "event",    "pos_ms",   "volume")     \
+  X(TRACE_SIGNAL,          "signal",          "signo",    "",         "")           \
+  X(TRACE_FATAL,           "fatal",           "domain",   "line",     "err")
+
+#define TRACE_ENUM(id, name, a0, a1, a2) id,
+
+enum trace_event
+{
+  TRACE_NONE = 0,
+  TRACE_EVENTS(TRACE_ENUM)
+  TRACE_EVENT_MAX,
+};
+
+// Reasons for TRACE_AUDIO_EOF
+enum trace_eof_reason
+{
+  TRACE_EOF_END,
+  TRACE_EOF_STOP,
+  TRACE_EOF_ERROR,
+};
+
+// One record, as kept in the ring and written to dumps (host byte order)
+struct trace_record
+{
+  uint64_t ts_ns;                 // CLOCK_MONOTONIC
+  uint32_t seq;                   // low 32 bits of the sequence number + 1, 0 if unused
+  uint32_t tid;
+  uint16_t event;
+  uint16_t reserved[3];
+  int64_t args[3];
+};
+
+// Dump file header, followed by ring_size records in ring order
+struct trace_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t ring_size;
+  uint32_t pid;
+  uint64_t next_seq;              // sequence number of the next record to be written
+  int64_t realtime_offset_ns;     // CLOCK_REALTIME - CLOCK_MONOTONIC at the time of the dump
+  char reason[32];
+};
+
+void
+trace_event(enum trace_event event, int64_t a0, int64_t a1, int64_t a2);
+
+int
+trace_dump(const char *reason);
+
+#endif /* !__TRACE_H__ */
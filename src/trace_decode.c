@@ -0,0 +1,203 @@
+/*
+ * cliap2-trace - decode flight recorder dumps of cliap2 into a timeline
+ *
+ * Usage: cliap2-trace <dump> [<dump> ...]
+ *
+ * Each record is printed on one line, oldest first, with wall clock time,
+ * the time since the previous record, the thread id, the event and its
+ * arguments. Dumps must be decoded on a host with the same byte order as the
+ * one that wrote them.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_NAME(id, name, a0, a1, a2) [id] = name,
+#define TRACE_ARGS(id, name, a0, a1, a2) [id] = { a0, a1, a2 },
+
+static const char *trace_names[TRACE_EVENT_MAX] =
+{
+  [TRACE_NONE] = "none",
+  TRACE_EVENTS(TRACE_NAME)
+};
+
+static const char *trace_args[TRACE_EVENT_MAX][3] =
+{
+  TRACE_EVENTS(TRACE_ARGS)
+};
+
+struct decoded
+{
+  uint64_t seq;
+  struct trace_record *rec;
+};
+
+static int
+decoded_cmp(const void *a, const void *b)
+{
+  const struct decoded *da = a;
+  const struct decoded *db = b;
+
+  return (da->seq > db->seq) - (da->seq < db->seq);
+}
+
+static void
+record_print(const struct trace_header *header, const struct trace_record *rec, uint64_t prev_ns)
+{
+  char stamp[32];
+  struct tm tm;
+  time_t t;
+  int64_t real_ns;
+  const char *name;
+  int i;
+
+  real_ns = (int64_t)rec->ts_ns + header->realtime_offset_ns;
+  t = real_ns / 1000000000LL;
+  localtime_r(&t, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+  if (rec->event < TRACE_EVENT_MAX && trace_names[rec->event])
+    name = trace_names[rec->event];
+  else
+    name = "unknown";
+
+  printf("%s.%06" PRId64 " %+12.6f %7" PRIu32 " %-14s", stamp, (int64_t)((real_ns % 1000000000LL) / 1000),
+    prev_ns ? (double)(rec->ts_ns - prev_ns) / 1e9 : 0.0, rec->tid, name);
+
+  for (i = 0; i < 3; i++)
+    {
+      if (rec->event < TRACE_EVENT_MAX && trace_args[rec->event][i])
+	{
+	  if (trace_args[rec->event][i][0] != '\0')
+	    printf(" %s=%" PRId64, trace_args[rec->event][i], rec->args[i]);
+	}
+      else
+	printf(" arg%d=%" PRId64, i, rec->args[i]);
+    }
+
+  printf("\n");
+}
+
+static int
+dump_decode(const char *path)
+{
+  struct trace_header header;
+  struct trace_record *records = NULL;
+  struct decoded *decoded = NULL;
+  uint32_t age;
+  uint64_t prev_ns;
+  size_t count;
+  size_t i;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (!fp)
+    {
+      perror(path);
+      return -1;
+    }
+
+  if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+    {
+      fprintf(stderr, "%s: Not a cliap2 trace dump\n", path);
+      goto error;
+    }
+
+  if (header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record))
+    {
+      fprintf(stderr, "%s: Unsupported trace dump version %" PRIu32 " (record size %" PRIu32 ")\n", path, header.version, header.record_size);
+      goto error;
+    }
+
+  records = calloc(header.ring_size, sizeof(struct trace_record));
+  decoded = calloc(header.ring_size, sizeof(struct decoded));
+  if (!records || !decoded)
+    {
+      fprintf(stderr, "%s: Out of memory\n", path);
+      goto error;
+    }
+
+  if (fread(records, sizeof(struct trace_record), header.ring_size, fp) != header.ring_size)
+    {
+      fprintf(stderr, "%s: Truncated trace dump\n", path);
+      goto error;
+    }
+
+  // Records hold the low 32 bits of their sequence number + 1, so order them
+  // by their distance to the sequence number at the time of the dump
+  for (i = 0, count = 0; i < header.ring_size; i++)
+    {
+      if (records[i].seq == 0)
+	continue;
+
+      age = (uint32_t)header.next_seq - (records[i].seq - 1);
+      if (age == 0 || age > header.ring_size)
+	continue;
+
+      decoded[count].seq = header.next_seq - age;
+      decoded[count].rec = &records[i];
+      count++;
+    }
+
+  qsort(decoded, count, sizeof(struct decoded), decoded_cmp);
+
+  printf("# %s: pid %" PRIu32 ", reason '%.*s', %zu of %" PRIu64 " records\n",
+    path, header.pid, (int)sizeof(header.reason), header.reason, count, header.next_seq);
+
+  for (i = 0, prev_ns = 0; i < count; i++)
+    {
+      record_print(&header, decoded[i].rec, prev_ns);
+      prev_ns = decoded[i].rec->ts_ns;
+    }
+
+  free(decoded);
+  free(records);
+  fclose(fp);
+  return 0;
+
+ error:
+  free(decoded);
+  free(records);
+  fclose(fp);
+  return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+  int ret = EXIT_SUCCESS;
+  int i;
+
+  if (argc < 2)
+    {
+      fprintf(stderr, "Usage: %s <dump> [<dump> ...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      if (dump_decode(argv[i]) < 0)
+	ret = EXIT_FAILURE;
+    }
+
+  return ret;
+}
@@ -19,9 +19,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <curl/curl.h>
+#include <libavformat/avformat.h>
 
 // Owntones headers
+#include "artscale.h"
 #include "artwork.h"
 #include "conffile.h"
 #include "db.h"
@@ -53,6 +58,36 @@ typedef struct db_queue {
 
 db_queue_t *queue = NULL; // Always points to the head
 
+// Artwork images handed to the output module, see artwork_mem_add(). A few
+// are kept, since the output may still ask for the previous item's artwork
+// after the next one arrived.
+#define ARTWORK_MEM_SLOTS 4
+// Scaled versions kept per image, one per size that outputs have asked for
+#define ARTWORK_MEM_VARIANTS 2
+
+struct artwork_mem_variant
+{
+  bool valid;
+  int max_w;
+  int max_h;
+  int format;
+  // NULL if the original is used for this size
+  struct evbuffer *image;
+};
+
+struct artwork_mem
+{
+  uint32_t id;
+  int format;
+  struct evbuffer *image;
+  struct artwork_mem_variant variants[ARTWORK_MEM_VARIANTS];
+  int variant_next;
+};
+
+static struct artwork_mem artwork_mem[ARTWORK_MEM_SLOTS];
+static uint32_t artwork_mem_next_id;
+static pthread_mutex_t artwork_mem_lck = PTHREAD_MUTEX_INITIALIZER;
+
 // Function to create a new node - it still needs to be placed in the linked list
 // after creation
 static struct
@@ -718,68 +753,280 @@ struct output_definition output_rcp =
   .device_cb_set = output_wrapper_device_cb_set,
 };
 
+/*
+ * Lazy network initialisation
+ *
+ * Only artwork fetching needs libcurl and the libav network layer, so they are
+ * set up on first use rather than in main(), which keeps them off the path to
+ * the first audio packet.
+ */
+static pthread_once_t net_once = PTHREAD_ONCE_INIT;
+static bool net_initialized;
+static bool net_curl_initialized;
+
+static void
+net_init_once(void)
+{
+#if HAVE_DECL_AVFORMAT_NETWORK_INIT
+  avformat_network_init();
+#endif
+  if (!net_curl_initialized)
+    {
+      curl_global_init(CURL_GLOBAL_DEFAULT);
+      net_curl_initialized = true;
+    }
+
+  net_initialized = true;
+
+  DPRINTF(E_DBG, L_MAIN, "Network libraries initialized on first use\n");
+}
+
+/*
+ * curl_global_init() is only thread safe from libcurl 7.84, which says so with
+ * CURL_VERSION_THREADSAFE. With an older libcurl it can't wait for the first
+ * artwork fetch on the worker thread, so it is done here. Must be called
+ * before any thread is started, and doesn't log, since the logger isn't set up
+ * yet.
+ */
+void
+net_early_init(void)
+{
+#ifdef CURL_VERSION_THREADSAFE
+  if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_THREADSAFE)
+    return;
+#endif
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  net_curl_initialized = true;
+}
+
+void
+net_lazy_init(void)
+{
+  pthread_once(&net_once, net_init_once);
+}
+
+/*
+ * Release what net_lazy_init() set up, if it ever ran. Must only be called
+ * once all threads that may fetch artwork have stopped.
+ */
+void
+net_lazy_deinit(void)
+{
+  if (net_curl_initialized)
+    {
+      curl_global_cleanup();
+      net_curl_initialized = false;
+    }
+
+  if (!net_initialized)
+    return;
+
+#if HAVE_DECL_AVFORMAT_NETWORK_INIT
+  avformat_network_deinit();
+#endif
+  net_initialized = false;
+}
+
 /*
  * Wrappers for artwork.c
  */
+static void
+artwork_mem_slot_clear(struct artwork_mem *slot)
+{
+  int i;
+
+  for (i = 0; i < ARTWORK_MEM_VARIANTS; i++)
+    {
+      if (slot->variants[i].image)
+	evbuffer_free(slot->variants[i].image);
+    }
+
+  if (slot->image)
+    evbuffer_free(slot->image);
+
+  memset(slot, 0, sizeof(struct artwork_mem));
+}
+
+static struct artwork_mem_variant *
+artwork_mem_variant_find(struct artwork_mem *slot, int max_w, int max_h)
+{
+  int i;
+
+  for (i = 0; i < ARTWORK_MEM_VARIANTS; i++)
+    {
+      if (slot->variants[i].valid && slot->variants[i].max_w == max_w && slot->variants[i].max_h == max_h)
+	return &slot->variants[i];
+    }
+
+  return NULL;
+}
+
+/* Keep an image in memory for the output module, see artwork_get_by_queue_item_id()
+ *
+ * @in  image     Image data, ownership is taken and it must not be modified
+ *                afterwards. May reference memory of others (e.g. a mapped cache
+ *                entry), it is never copied.
+ * @in  format    ART_FMT_* of the image
+ * @return        "mem:" URL to set as the queue item's artwork_url, to be freed
+ *                by the caller
+ */
+char *
+artwork_mem_add(struct evbuffer *image, int format)
+{
+  struct artwork_mem *slot;
+  uint32_t id;
+
+  // The image is referenced from the worker, player and mass_cmd threads, and
+  // libevent protects the refcount of shared chains with the source's lock
+  evbuffer_enable_locking(image, NULL);
+
+  pthread_mutex_lock(&artwork_mem_lck);
+
+  // Zero is never used, so an unset slot never matches
+  if (++artwork_mem_next_id == 0)
+    artwork_mem_next_id = 1;
+  id = artwork_mem_next_id;
+
+  // Overwrites the oldest image. Buffers that were handed out keep a reference
+  // to its data, so they stay valid.
+  slot = &artwork_mem[id % ARTWORK_MEM_SLOTS];
+  artwork_mem_slot_clear(slot);
+
+  slot->id = id;
+  slot->format = format;
+  slot->image = image;
+
+  pthread_mutex_unlock(&artwork_mem_lck);
+
+  return safe_asprintf("mem:%" PRIu32, id);
+}
+
+void
+artwork_mem_clear(void)
+{
+  int i;
+
+  pthread_mutex_lock(&artwork_mem_lck);
+  for (i = 0; i < ARTWORK_MEM_SLOTS; i++)
+    artwork_mem_slot_clear(&artwork_mem[i]);
+  pthread_mutex_unlock(&artwork_mem_lck);
+}
+
 /*
  * Get the artwork image for an individual item (track)
- * For Music Assistant, we have previously written the artwork_url curl request
- * result into a temporary file, so here we just need to read that file into the
- * evbuf and return the format.
+ * For Music Assistant, the fetched image was stored with artwork_mem_add() and
+ * the queue item's artwork_url refers to it. If it is larger than requested it
+ * is scaled down (see artscale.c), and the result is kept for the next request
+ * of the same size. Images are added to evbuf by reference.
  *
  * @out evbuf    Event buffer that will contain the (scaled) image
  * @in  id       The mfi item id
- * @in  max_w    Requested maximum image width (may not be obeyed)
- * @in  max_h    Requested maximum image height (may not be obeyed)
+ * @in  max_w    Requested maximum image width, 0 for no limit
+ * @in  max_h    Requested maximum image height, 0 for no limit
  * @in  format   Requested format (may not be obeyed), 0 for default
  * @return       ART_FMT_* on success, -1 on error or no artwork found
+ * @note         Called by outputs.c from the worker thread, so scaling doesn't
+ *               hold up the player
  */
 int
 artwork_get_by_queue_item_id(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
 {
-    size_t len = 0;
+  struct db_queue_item *qi;
+  struct artwork_mem *slot;
+  struct artwork_mem_variant *variant;
+  struct evbuffer *orig;
+  struct evbuffer *scaled;
+  uint32_t mem_id;
+  int orig_format;
+  int ret;
 
-    len = evbuffer_get_length(evbuf);
-    
-    // find the queue item by id to get the artwork_url
-    struct db_queue_item *qi = db_queue_fetch_byitemid((uint32_t)id);
-    if (qi && qi->artwork_url) {
-        // read the artwork file into the evbuf
-        FILE *f = fopen(qi->artwork_url + 5, "rb"); // skip "file:"
-        if (f) {
-            fseek(f, 0, SEEK_END);
-            len = ftell(f);
-            fseek(f, 0, SEEK_SET);
-            unsigned char *buffer = (unsigned char *)malloc(len);
-            if (buffer) {
-                size_t read_len = fread(buffer, 1, len, f);
-                if (read_len == len) {
-                    evbuffer_add(evbuf, buffer, len);
-                    free(buffer);
-                    fclose(f);
-                    // determine format from file extension
-                    const char *ext = strrchr(qi->artwork_url, '.');
-                    if (ext) {
-                        if (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0) {
-                            return ART_FMT_JPEG;
-                        }
-                        else if (strcasecmp(ext, ".png") == 0) {
-                            return ART_FMT_PNG;
-                        }
-                    }
-                    return ART_FMT_JPEG; // default
-                }
-                free(buffer);
-            }
-            fclose(f);
-        }
-        else {
-            DPRINTF(E_LOG, L_ART, "%s:Could not open artwork file '%s'. %s\n", 
-                __func__, qi->artwork_url + 5, strerror(errno));
-        }
-    }
-    
+  qi = db_queue_fetch_byitemid((uint32_t)id);
+  if (!qi || !qi->artwork_url)
     return -1;
+
+  if (strncmp(qi->artwork_url, "mem:", 4) != 0 || safe_atou32(qi->artwork_url + 4, &mem_id) < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "%s:Unsupported artwork URL '%s'\n", __func__, qi->artwork_url);
+      return -1;
+    }
+
+  CHECK_NULL(L_ART, orig = evbuffer_new());
+
+  pthread_mutex_lock(&artwork_mem_lck);
+  slot = &artwork_mem[mem_id % ARTWORK_MEM_SLOTS];
+  if (!slot->image || slot->id != mem_id)
+    {
+      pthread_mutex_unlock(&artwork_mem_lck);
+      DPRINTF(E_DBG, L_ART, "%s:Artwork '%s' is no longer available\n", __func__, qi->artwork_url);
+      evbuffer_free(orig);
+      return -1;
+    }
+
+  variant = artwork_mem_variant_find(slot, max_w, max_h);
+  if (variant)
+    {
+      if (variant->image)
+	ret = (evbuffer_add_buffer_reference(evbuf, variant->image) == 0) ? variant->format : -1;
+      else
+	ret = (evbuffer_add_buffer_reference(evbuf, slot->image) == 0) ? slot->format : -1;
+      pthread_mutex_unlock(&artwork_mem_lck);
+      evbuffer_free(orig);
+      return ret;
+    }
+
+  // Not scaled for this size yet. The lock is not held while scaling, the
+  // original stays valid through the reference.
+  ret = evbuffer_add_buffer_reference(orig, slot->image);
+  orig_format = slot->format;
+  pthread_mutex_unlock(&artwork_mem_lck);
+  if (ret < 0)
+    {
+      evbuffer_free(orig);
+      return -1;
+    }
+
+  CHECK_NULL(L_ART, scaled = evbuffer_new());
+
+  // On error the original is sent, and not scaled again for this size
+  ret = artscale_scale(scaled, orig, orig_format, max_w, max_h);
+  if (ret > 0)
+    {
+      // Shared like the original, see artwork_mem_add()
+      evbuffer_enable_locking(scaled, NULL);
+      evbuffer_add_buffer_reference(evbuf, scaled);
+    }
+  else
+    {
+      evbuffer_free(scaled);
+      scaled = NULL;
+      evbuffer_add_buffer(evbuf, orig);
+      ret = orig_format;
+    }
+
+  pthread_mutex_lock(&artwork_mem_lck);
+  if (slot->id == mem_id && !artwork_mem_variant_find(slot, max_w, max_h))
+    {
+      variant = &slot->variants[slot->variant_next];
+      slot->variant_next = (slot->variant_next + 1) % ARTWORK_MEM_VARIANTS;
+      if (variant->image)
+	evbuffer_free(variant->image);
+
+      variant->valid = true;
+      variant->max_w = max_w;
+      variant->max_h = max_h;
+      variant->format = ret;
+      variant->image = scaled;
+      scaled = NULL;
+    }
+  pthread_mutex_unlock(&artwork_mem_lck);
+
+  // Superseded while scaling, evbuf keeps its own reference
+  if (scaled)
+    evbuffer_free(scaled);
+  evbuffer_free(orig);
+
+  return ret;
 }
 
 bool
@@ -790,63 +1037,97 @@ artwork_extension_is_artwork(const char *path)
 }
 
 
+static size_t
+artwork_curl_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  struct evbuffer *evbuf = userdata;
+
+  // Anything but the full length makes curl abort the transfer
+  if (evbuffer_add(evbuf, ptr, size * nmemb) < 0)
+    return 0;
+
+  return size * nmemb;
+}
+
 /* Reads an artwork file from the given http url straight into an evbuf
  *
- * @out evbuf     Image data
- * @in  url       URL for the image
- * @return        ART_FMT_* on success, ART_E_NONE on 404, ART_E_ERROR otherwise
+ * The fetch blocks the worker thread that other jobs queue behind, and
+ * owntone's http_client_request() takes no timeout from the caller, so the
+ * request is made with curl directly.
+ *
+ * @out evbuf       Image data
+ * @in  url         URL for the image
+ * @in  timeout_ms  the whole request, connect included, is aborted after this
+ * @return          ART_FMT_* on success, ART_E_NONE on 404, ART_E_ERROR otherwise
  */
 int
-artwork_read_byurl(struct evbuffer *evbuf, const char *url)
+artwork_read_byurl(struct evbuffer *evbuf, const char *url, long timeout_ms)
 {
-  struct http_client_ctx client;
-  struct keyval *kv;
-  const char *content_type;
+  CURL *curl;
+  CURLcode res;
+  char *content_type;
+  long response_code;
   size_t len;
   int format;
-  int ret;
 
   DPRINTF(E_SPAM, L_ART, "Trying internet artwork in %s\n", url);
 
   format = ART_E_ERROR;
-  CHECK_NULL(L_ART, kv = keyval_alloc());
 
   len = strlen(url);
   if ((len < 14) || (len > PATH_MAX)) { // Can't be shorter than http://a/1.jpg
     DPRINTF(E_LOG, L_ART, "Artwork request URL is invalid (len=%zu): '%s'\n", len, url);
-    goto out;
+    return format;
   }
 
-  memset(&client, 0, sizeof(struct http_client_ctx));
-  client.url = url;
-  client.input_headers = kv;
-  client.input_body = evbuf;
+  net_lazy_init();
+
+  curl = curl_easy_init();
+  if (!curl) {
+    DPRINTF(E_LOG, L_ART, "Could not create curl handle for '%s'\n", url);
+    return format;
+  }
 
-  ret = http_client_request(&client, NULL);
-  if (ret < 0) {
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, cfg_getstr(cfg_getsec(cfg, "general"), "user_agent"));
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, (long)cfg_getbool(cfg_getsec(cfg, "general"), "ssl_verifypeer"));
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+  // Timeouts are otherwise implemented with SIGALRM, which is not thread safe
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, artwork_curl_write_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, evbuf);
+
+  res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    DPRINTF(E_LOG, L_ART, "Request to '%s' failed: %s\n", url, curl_easy_strerror(res));
     goto out;
   }
 
-  if (client.response_code == HTTP_NOTFOUND) {
-    DPRINTF(E_INFO, L_ART, "No artwork found at '%s' (code %d)\n", url, client.response_code);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  if (response_code == HTTP_NOTFOUND) {
+    DPRINTF(E_INFO, L_ART, "No artwork found at '%s' (code %ld)\n", url, response_code);
     format = ART_E_NONE;
     goto out;
   }
-  else if (client.response_code != HTTP_OK) {
-    DPRINTF(E_LOG, L_ART, "Request to '%s' failed with code %d\n", url, client.response_code);
+  else if (response_code != HTTP_OK) {
+    DPRINTF(E_LOG, L_ART, "Request to '%s' failed with code %ld\n", url, response_code);
     goto out;
   }
 
-  content_type = keyval_get(kv, "Content-Type");
-  if (content_type && (strcasecmp(content_type, "image/jpeg") == 0 || strcasecmp(content_type, "image/jpg") == 0))
+  // May come with parameters, e.g. "image/jpeg; charset=binary"
+  content_type = NULL;
+  curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+  len = content_type ? strcspn(content_type, "; ") : 0;
+  if ((len == 10 && strncasecmp(content_type, "image/jpeg", len) == 0) || (len == 9 && strncasecmp(content_type, "image/jpg", len) == 0))
     format = ART_FMT_JPEG;
-  else if (content_type && strcasecmp(content_type, "image/png") == 0)
+  else if (len == 9 && strncasecmp(content_type, "image/png", len) == 0)
     format = ART_FMT_PNG;
   else
     DPRINTF(E_LOG, L_ART, "Artwork from '%s' has no known content type\n", url);
 
  out:
-  keyval_clear(kv);
-  free(kv);
+  curl_easy_cleanup(curl);
   return format;
 }
@@ -4,6 +4,18 @@
 #include "misc.h"
 #include "cliap2.h"
 
+/*
+ * Lazy initialisation of libcurl and the libav network layer
+ */
+void
+net_early_init(void);
+
+void
+net_lazy_init(void);
+
+void
+net_lazy_deinit(void);
+
 /*
  * Wrappers for db.c
  */
@@ -47,7 +59,10 @@ db_perthread_deinit(void);
 #define ART_E_ERROR -1
 #define ART_E_ABORT -2
 
-int artwork_read_byurl(struct evbuffer *evbuf, const char *url);
+int artwork_read_byurl(struct evbuffer *evbuf, const char *url, long timeout_ms);
+
+char *artwork_mem_add(struct evbuffer *image, int format);
+void artwork_mem_clear(void);
 
 /*
  * Wrappers for mdns.c
@@ -0,0 +1,492 @@
+/*
+ * Prefork session server for cliap2 (--server <socket>)
+ *
+ * The server initialises the libraries once, then waits on a Unix socket for
+ * session requests. Each request forks a child that is already past dynamic
+ * loading, config parsing and library initialisation, and continues main()
+ * exactly like a freshly started cliap2 would.
+ *
+ * Request format (SOCK_STREAM, one request per connection):
+ *   - a 4 byte payload length in network byte order, sent in a single
+ *     sendmsg() together with an SCM_RIGHTS message carrying three or four
+ *     file descriptors in enum zygote_fd order: audio, command, stderr and
+ *     optionally the status fd, which is given to the session as --status_fd
+ *   - the payload: the session options as NUL terminated strings, exactly as
+ *     they would be given on the command line, e.g. "--name\0Kitchen\0..."
+ *
+ * The server replies with "<pid>\n" of the spawned session, or "ERR <reason>\n",
+ * and closes the connection. The command fd must be a pipe or FIFO, since the
+ * session opens it again through /dev/fd. Logging options and --config are
+ * taken from the server and ignored in session requests.
+ *
+ * Only the calling thread survives fork(). The server must therefore not run
+ * other threads, except the log writer, which logger.c stops before each fork
+ * and starts again in the server and in the session.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+#include "cliap2.h"
+#include "zygote.h"
+
+// Upper limit of the option payload of a session request
+#define ZYGOTE_REQUEST_MAX 16384
+// Pending connections on the listening socket
+#define ZYGOTE_BACKLOG     16
+// Seconds a client gets to send its request and take the reply. The server
+// handles one connection at a time, so a stalled client must not hold it.
+#define ZYGOTE_CONN_TIMEOUT_SEC 2
+
+static volatile sig_atomic_t zygote_stop;
+
+static struct sigaction saved_sigint;
+static struct sigaction saved_sigterm;
+static struct sigaction saved_sigchld;
+static struct sigaction saved_sigpipe;
+
+/* -------------------------------- HELPERS --------------------------------- */
+
+static void
+zygote_signal_cb(int signo)
+{
+  zygote_stop = 1;
+}
+
+static void
+zygote_signals_set(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+
+  // No SA_RESTART, so that accept() returns on SIGINT/SIGTERM
+  sa.sa_handler = zygote_signal_cb;
+  sigaction(SIGINT, &sa, &saved_sigint);
+  sigaction(SIGTERM, &sa, &saved_sigterm);
+
+  // Sessions are reaped automatically, we don't track their exit status
+  sa.sa_handler = SIG_DFL;
+  sa.sa_flags = SA_NOCLDWAIT;
+  sigaction(SIGCHLD, &sa, &saved_sigchld);
+
+  // A client that hangs up before reading the reply must not kill the server
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = 0;
+  sigaction(SIGPIPE, &sa, &saved_sigpipe);
+}
+
+static void
+zygote_signals_restore(void)
+{
+  sigaction(SIGINT, &saved_sigint, NULL);
+  sigaction(SIGTERM, &saved_sigterm, NULL);
+  sigaction(SIGCHLD, &saved_sigchld, NULL);
+  sigaction(SIGPIPE, &saved_sigpipe, NULL);
+}
+
+static void
+zygote_fds_close(int *fds)
+{
+  int i;
+
+  for (i = 0; i < ZYGOTE_NFDS; i++)
+    {
+      if (fds[i] >= 0)
+	close(fds[i]);
+      fds[i] = -1;
+    }
+}
+
+static int
+zygote_read_full(int fd, void *buf, size_t len)
+{
+  uint8_t *ptr = buf;
+  ssize_t got;
+
+  while (len > 0)
+    {
+      got = read(fd, ptr, len);
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got <= 0)
+	return -1;
+
+      ptr += got;
+      len -= got;
+    }
+
+  return 0;
+}
+
+static void
+zygote_reply(int conn, const char *fmt, int val, const char *reason)
+{
+  char buf[128];
+  int len;
+
+  if (reason)
+    len = snprintf(buf, sizeof(buf), "ERR %s\n", reason);
+  else
+    len = snprintf(buf, sizeof(buf), fmt, val);
+
+  if (write(conn, buf, len) < 0)
+    DPRINTF(E_WARN, L_MAIN, "%s:Could not reply to session request: %s\n", __func__, strerror(errno));
+}
+
+static int
+zygote_listen(const char *socket_path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Server socket path '%s' is too long\n", socket_path);
+      return -1;
+    }
+
+  // Remove a stale socket left behind by a previous server
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(socket_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Could not create server socket: %s\n", strerror(errno));
+      return -1;
+    }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  // Sessions run with the privileges and config of the server, so only its
+  // owner may connect. The mode is set before listen(), so that nobody can
+  // connect while the socket still has the permissions of the umask.
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(socket_path, 0600) < 0 || listen(fd, ZYGOTE_BACKLOG) < 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Could not listen on '%s': %s\n", socket_path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/**
+ * Read a session request from a connection
+ * @param conn         connected socket
+ * @param payload      [out] option payload, NUL terminated, to be freed by the caller
+ * @param payload_len  [out] length of the payload
+ * @param fds          [out] ZYGOTE_NFDS received file descriptors, -1 if not received
+ * @returns 0 on success, -1 on an invalid request
+ */
+static int
+zygote_request_read(int conn, char **payload, size_t *payload_len, int *fds)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_NFDS)];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  uint32_t len_be;
+  size_t len;
+  ssize_t got;
+  int nfds = 0;
+  int n;
+  int i;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &len_be;
+  iov.iov_len = sizeof(len_be);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  // Close-on-exec until the session child takes them, so that nothing else the
+  // server spawns meanwhile inherits the fds of another session
+  do
+    got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  while (got < 0 && errno == EINTR);
+
+  if (got <= 0)
+    return -1;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	continue;
+
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (i = 0; i < n; i++)
+	{
+	  if (nfds < ZYGOTE_NFDS)
+	    memcpy(&fds[nfds++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	  else
+	    {
+	      int extra;
+	      memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	      close(extra);
+	    }
+	}
+    }
+
+  // The status fd is optional
+  if (nfds < ZYGOTE_FD_STATUS || (msg.msg_flags & MSG_CTRUNC))
+    {
+      DPRINTF(E_LOG, L_MAIN, "%s:Session request carried %d file descriptors, expected %d or %d\n", __func__, nfds, ZYGOTE_FD_STATUS, ZYGOTE_NFDS);
+      return -1;
+    }
+
+  if ((size_t)got < sizeof(len_be) && zygote_read_full(conn, (uint8_t *)&len_be + got, sizeof(len_be) - got) < 0)
+    return -1;
+
+  len = ntohl(len_be);
+  if (len == 0 || len > ZYGOTE_REQUEST_MAX)
+    {
+      DPRINTF(E_LOG, L_MAIN, "%s:Invalid session request length %zu\n", __func__, len);
+      return -1;
+    }
+
+  *payload = malloc(len + 1);
+  if (!*payload)
+    return -1;
+
+  if (zygote_read_full(conn, *payload, len) < 0 || (*payload)[len - 1] != '\0')
+    {
+      DPRINTF(E_LOG, L_MAIN, "%s:Truncated or unterminated session request\n", __func__);
+      free(*payload);
+      *payload = NULL;
+      return -1;
+    }
+
+  (*payload)[len] = '\0';
+  *payload_len = len;
+
+  return 0;
+}
+
+/**
+ * Build the argument vector of the session from the request payload. The
+ * command fd is appended as --command_pipe /dev/fd/<n>, and the status fd, if
+ * any, as --status_fd <n>.
+ * @returns the NULL terminated vector, NULL on allocation failure
+ */
+static char **
+zygote_argv_build(const char *program, char *payload, size_t payload_len, int *fds, int *argc)
+{
+  char **argv;
+  size_t count = 0;
+  size_t i;
+  int n;
+
+  for (i = 0; i < payload_len; i++)
+    if (payload[i] == '\0')
+      count++;
+
+  argv = calloc(count + 6, sizeof(char *));
+  if (!argv)
+    return NULL;
+
+  n = 0;
+  argv[n++] = (char *)program;
+  for (i = 0; i < payload_len; i += strlen(payload + i) + 1)
+    argv[n++] = payload + i;
+
+  argv[n++] = "--command_pipe";
+  if (asprintf(&argv[n++], "/dev/fd/%d", fds[ZYGOTE_FD_COMMAND]) < 0)
+    {
+      free(argv);
+      return NULL;
+    }
+
+  if (fds[ZYGOTE_FD_STATUS] >= 0)
+    {
+      argv[n++] = "--status_fd";
+      if (asprintf(&argv[n++], "%d", fds[ZYGOTE_FD_STATUS]) < 0)
+	{
+	  free(argv[n - 3]);
+	  free(argv);
+	  return NULL;
+	}
+    }
+  argv[n] = NULL;
+
+  *argc = n;
+  return argv;
+}
+
+/**
+ * Install the received file descriptors as stdin/stderr of the session
+ * @returns 0 on success, -1 on failure
+ */
+static int
+zygote_child_fds_setup(int *fds)
+{
+  int i;
+
+  // Keep the received fds clear of the standard fds before we dup2() over them
+  for (i = 0; i < ZYGOTE_NFDS; i++)
+    {
+      if (fds[i] < 0 || fds[i] > STDERR_FILENO)
+	continue;
+
+      fds[i] = fcntl(fds[i], F_DUPFD, STDERR_FILENO + 1);
+      if (fds[i] < 0)
+	return -1;
+    }
+
+  if (dup2(fds[ZYGOTE_FD_AUDIO], STDIN_FILENO) < 0 || dup2(fds[ZYGOTE_FD_STDERR], STDERR_FILENO) < 0)
+    return -1;
+
+  close(fds[ZYGOTE_FD_AUDIO]);
+  close(fds[ZYGOTE_FD_STDERR]);
+
+  // Received with close-on-exec, the session keeps these like a cold start does
+  if (fcntl(fds[ZYGOTE_FD_COMMAND], F_SETFD, 0) < 0 ||
+      (fds[ZYGOTE_FD_STATUS] >= 0 && fcntl(fds[ZYGOTE_FD_STATUS], F_SETFD, 0) < 0))
+    return -1;
+
+  return 0;
+}
+
+/* ---------------------------------- API ----------------------------------- */
+
+/**
+ * Run the session server until SIGINT/SIGTERM
+ * @param socket_path  path of the Unix socket to listen on
+ * @param program      argv[0] to give to sessions
+ * @param argc         [out] argument count of the session, set in the child only
+ * @param argv         [out] argument vector of the session, set in the child only
+ * @returns 0 in a forked session child, which should continue starting up with
+ *          argc/argv, 1 in the server after a clean shutdown, -1 on error
+ */
+int
+zygote_run(const char *socket_path, const char *program, int *argc, char ***argv)
+{
+  struct timeval conn_timeout = { .tv_sec = ZYGOTE_CONN_TIMEOUT_SEC };
+  int fds[ZYGOTE_NFDS];
+  char *payload;
+  size_t payload_len;
+  pid_t pid;
+  int lfd;
+  int conn;
+  int ret;
+
+  lfd = zygote_listen(socket_path);
+  if (lfd < 0)
+    return -1;
+
+  zygote_signals_set();
+  logger_atfork_register();
+
+  DPRINTF(E_LOG, L_MAIN, "Server ready, waiting for sessions on '%s'\n", socket_path);
+
+  ret = 1;
+  while (!zygote_stop)
+    {
+      conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+	{
+	  if (errno == EINTR || errno == ECONNABORTED)
+	    continue;
+
+	  DPRINTF(E_LOG, L_MAIN, "Server socket error: %s\n", strerror(errno));
+	  ret = -1;
+	  break;
+	}
+
+      // Also bounds zygote_read_full() and zygote_reply(), which use the socket
+      if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &conn_timeout, sizeof(conn_timeout)) < 0 ||
+	  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &conn_timeout, sizeof(conn_timeout)) < 0)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not set timeout on session connection: %s\n", strerror(errno));
+	  close(conn);
+	  continue;
+	}
+
+      payload = NULL;
+      fds[ZYGOTE_FD_AUDIO] = fds[ZYGOTE_FD_COMMAND] = fds[ZYGOTE_FD_STDERR] = fds[ZYGOTE_FD_STATUS] = -1;
+
+      if (zygote_request_read(conn, &payload, &payload_len, fds) < 0)
+	{
+	  zygote_reply(conn, NULL, 0, "invalid request");
+	  goto next;
+	}
+
+      pid = fork();
+      if (pid == 0)
+	{
+	  close(lfd);
+	  close(conn);
+	  zygote_signals_restore();
+
+	  if (zygote_child_fds_setup(fds) < 0)
+	    _exit(EXIT_FAILURE);
+
+	  *argv = zygote_argv_build(program, payload, payload_len, fds, argc);
+	  if (!*argv)
+	    _exit(EXIT_FAILURE);
+
+	  return 0;
+	}
+      else if (pid < 0)
+	{
+	  DPRINTF(E_LOG, L_MAIN, "Could not fork session: %s\n", strerror(errno));
+	  zygote_reply(conn, NULL, 0, "fork failed");
+	}
+      else
+	{
+	  DPRINTF(E_INFO, L_MAIN, "Spawned session with pid %d\n", (int)pid);
+	  zygote_reply(conn, "%d\n", (int)pid, NULL);
+	}
+
+    next:
+      zygote_fds_close(fds);
+      free(payload);
+      close(conn);
+    }
+
+  close(lfd);
+  unlink(socket_path);
+  zygote_signals_restore();
+
+  DPRINTF(E_LOG, L_MAIN, "Server stopped\n");
+
+  return ret;
+}
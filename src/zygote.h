@@ -0,0 +1,21 @@
+#ifndef __ZYGOTE_H__
+#define __ZYGOTE_H__
+
+// Order of the file descriptors passed with a session request
+enum zygote_fd
+{
+  // Raw PCM audio, becomes stdin of the session
+  ZYGOTE_FD_AUDIO,
+  // Commands and metadata, used as the session's --command_pipe
+  ZYGOTE_FD_COMMAND,
+  // Becomes stderr of the session, i.e. where Music Assistant reads the log
+  ZYGOTE_FD_STDERR,
+  // Optional, used as the session's --status_fd
+  ZYGOTE_FD_STATUS,
+  ZYGOTE_NFDS,
+};
+
+int
+zygote_run(const char *socket_path, const char *program, int *argc, char ***argv);
+
+#endif /* !__ZYGOTE_H__ */